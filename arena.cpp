@@ -0,0 +1,68 @@
+#include "arena.h"
+#include <cstdint>
+#include <new>
+
+static std::atomic<size_t> held{ 0 };
+
+Arena::Arena () : current (nullptr) {}
+
+Arena::~Arena ()
+{
+  if (current != nullptr)
+    drop (current);
+}
+
+void
+Arena::drop (Block *block)
+{
+  if (block->live.fetch_sub (1) == 1)
+    {
+      block->~Block ();
+      ::operator delete (block, std::align_val_t (block_size));
+      held.fetch_sub (1, std::memory_order_relaxed);
+    }
+}
+
+void *
+Arena::take (size_t size)
+{
+  size = (size + alignment - 1) / alignment * alignment;
+  if (size > block_size - block_header)
+    throw std::bad_alloc ();
+  if (current == nullptr || block_size - current->used < size)
+    {
+      void *memory
+          = ::operator new (block_size, std::align_val_t (block_size));
+      Block *block = new (memory) Block{ { 1 }, block_header };
+      held.fetch_add (1, std::memory_order_relaxed);
+      if (current != nullptr)
+        drop (current);
+      current = block;
+    }
+  void *node = reinterpret_cast<char *> (current) + current->used;
+  current->used += size;
+  current->live.fetch_add (1);
+  return node;
+}
+
+void *
+Arena::allocate (size_t size)
+{
+  static thread_local Arena arena;
+  return arena.take (size);
+}
+
+void
+Arena::release (void *pointer)
+{
+  if (pointer == nullptr)
+    return;
+  uintptr_t address = reinterpret_cast<uintptr_t> (pointer);
+  drop (reinterpret_cast<Block *> (address & ~(block_size - 1)));
+}
+
+size_t
+Arena::blocks ()
+{
+  return held.load (std::memory_order_relaxed);
+}
@@ -0,0 +1,57 @@
+#ifndef arena_H
+#define arena_H
+
+#include <atomic>
+#include <cstddef>
+
+/* Arena hands out the memory for Expression nodes. Each thread allocates
+ * from its own block, one node after another, so the nodes of a formula
+ * are laid out contiguously and formulas parsed one after the other sit
+ * next to each other. Nodes carry no header: blocks are aligned to their
+ * size, so the block a node came from is found by rounding its address
+ * down.
+ *
+ * Deleting a node only counts it off its block, a block is given back to
+ * the heap in one go once every node in it has been deleted and its thread
+ * has moved on to a newer block. Nodes may be deleted on any thread.
+ *
+ * Freed space is never reused, so a block lives as long as its longest
+ * lived node: in the worst case a single node of a few dozen bytes keeps
+ * all 64KiB of its block. Formulas are allocated in the order they are
+ * loaded, so clearing a run of rows gives back the blocks holding them,
+ * but clearing every other row of a sheet gives back next to nothing.
+ */
+class Arena
+{
+private:
+  static constexpr size_t block_size = 64 * 1024;
+  // Every allocation is rounded up to keep the alignment new guarantees
+  static constexpr size_t alignment = alignof (std::max_align_t);
+
+  struct Block
+  {
+    // Nodes not yet deleted, plus one while the block is its thread's
+    // current block
+    std::atomic<size_t> live;
+    size_t used;
+  };
+  static constexpr size_t block_header
+      = (sizeof (Block) + alignment - 1) / alignment * alignment;
+
+  Block *current;
+
+  Arena ();
+  ~Arena ();
+  void *take (size_t size);
+  static void drop (Block *block);
+
+public:
+  // size must fit in a block, which every Expression does by far
+  static void *allocate (size_t size);
+  static void release (void *pointer);
+
+  // Blocks currently held from the heap, across every thread
+  static size_t blocks ();
+};
+
+#endif
@@ -0,0 +1,290 @@
+#include "batch.h"
+#include "csv.h"
+#include "formula.h"
+#include "sheetfile.h"
+#include <charconv>
+#include <chrono>
+#include <fstream>
+#include <stdexcept>
+#include <memory>
+
+std::string
+Batch::escape (std::string_view text)
+{
+  std::string ret;
+  ret.reserve (text.size ());
+  for (char c : text)
+    {
+      switch (c)
+        {
+        case '\n':
+          ret += "\\n";
+          break;
+        case '\t':
+          ret += "\\t";
+          break;
+        case '\\':
+          ret += "\\\\";
+          break;
+        default:
+          ret += c;
+        }
+    }
+  return ret;
+}
+
+std::string
+Batch::unescape (std::string_view text)
+{
+  std::string ret;
+  ret.reserve (text.size ());
+  for (size_t i = 0; i < text.size (); i++)
+    {
+      if (text[i] == '\\' && i + 1 < text.size ())
+        {
+          char next = text[i + 1];
+          if (next == 'n' || next == 't' || next == '\\')
+            {
+              ret += next == 'n' ? '\n' : next == 't' ? '\t' : '\\';
+              i++;
+              continue;
+            }
+        }
+      ret += text[i];
+    }
+  return ret;
+}
+
+// Parses a whole field as an int
+static bool
+parseInt (std::string_view field, int &val)
+{
+  auto result = std::from_chars (field.data (), field.data () + field.size (),
+                                 val);
+  return result.ec == std::errc ()
+         && result.ptr == field.data () + field.size ();
+}
+
+size_t
+Batch::load (std::istream &in, Grid &grid, Runtime &runtime)
+{
+  std::string line;
+  size_t line_number = 0;
+  size_t count = 0;
+  // Filled down formulas are only parsed once
+  FormulaTable formulas;
+  while (std::getline (in, line))
+    {
+      line_number++;
+      if (!line.empty () && line.back () == '\r')
+        line.pop_back ();
+      if (line.empty () || line[0] == '#')
+        continue;
+
+      std::string_view view (line);
+      size_t first = view.find ('\t');
+      size_t second = first == std::string_view::npos
+                          ? std::string_view::npos
+                          : view.find ('\t', first + 1);
+      int row, col;
+      if (second == std::string_view::npos
+          || !parseInt (view.substr (0, first), row)
+          || !parseInt (view.substr (first + 1, second - first - 1), col)
+          || row < 0 || row >= grid.getRows () || col < 0
+          || col >= grid.getCols ())
+        {
+          throw std::runtime_error ("Malformed cell on line "
+                                    + std::to_string (line_number));
+        }
+
+      std::string source = unescape (view.substr (second + 1));
+      // Same as entering the source in the editor
+      try
+        {
+          grid.loadFormula (row, col, source,
+                            formulas.intern (source, row, col), runtime);
+        }
+      catch (std::exception &e)
+        {
+          grid.loadCell (row, col, source,
+                         std::make_unique<String> ("NULL", 0, 0), runtime,
+                         e.what ());
+        }
+      count++;
+    }
+  return count;
+}
+
+void
+Batch::write (std::ostream &out, Grid &grid)
+{
+  grid.forEachCell ([&] (int row, int col, std::shared_ptr<Cell> &cell) {
+    out << row << '\t' << col << '\t'
+        << escape (cell->getValue ().serialize ()) << '\t'
+        << escape (cell->getError ()) << '\n';
+  });
+}
+
+static int
+usage ()
+{
+  std::cerr << "usage: spreadsheet --batch SHEET [-o OUTPUT] [--save FILE] "
+               "[--export FILE] [--iterative] [--csv | --tsv] [--threads N]"
+            << std::endl;
+  return EXIT_FAILURE;
+}
+
+int
+Batch::run (int argc, char **argv)
+{
+  std::string sheet;
+  std::string output;
+  std::string save;
+  std::string exported;
+  bool iterative = false;
+  // Set when SHEET is comma or tab separated data
+  char separator = '\0';
+  int threads = 0;
+  for (int i = 2; i < argc; i++)
+    {
+      std::string arg = argv[i];
+      if (arg == "-o" && i + 1 < argc)
+        output = argv[++i];
+      else if (arg == "--save" && i + 1 < argc)
+        save = argv[++i];
+      else if (arg == "--export" && i + 1 < argc)
+        exported = argv[++i];
+      else if (arg == "--iterative")
+        iterative = true;
+      else if (arg == "--csv" || arg == "--tsv")
+        separator = arg == "--csv" ? ',' : '\t';
+      else if (arg == "--threads" && i + 1 < argc)
+        {
+          std::string_view count = argv[++i];
+          if (!parseInt (count, threads) || threads < 0)
+            return usage ();
+        }
+      else if (sheet.empty () && arg[0] != '-')
+        sheet = arg;
+      else
+        return usage ();
+    }
+  if (sheet.empty ())
+    {
+      return usage ();
+    }
+
+  bool binary = separator == '\0' && SheetFile::isSheetFile (sheet);
+  std::ifstream in;
+  if (!binary)
+    {
+      in.open (sheet, std::ios::binary);
+      if (!in)
+        {
+          std::cerr << "Can't open " << sheet << std::endl;
+          return EXIT_FAILURE;
+        }
+    }
+
+  std::shared_ptr<Grid> grid = std::make_shared<Grid> ();
+  std::shared_ptr<Runtime> runtime = std::make_shared<Runtime> (grid);
+  grid->setIterativeCalculation (iterative);
+  runtime->setThreads (threads);
+
+  using Clock = std::chrono::steady_clock;
+  Clock::time_point start = Clock::now ();
+  size_t count;
+  try
+    {
+      if (binary)
+        {
+          grid->open (SheetFile::open (sheet));
+          count = grid->size ();
+        }
+      else if (separator != '\0')
+        count = Csv::import (in, *grid, separator, threads);
+      else
+        count = load (in, *grid, *runtime);
+    }
+  catch (std::exception &e)
+    {
+      std::cerr << sheet << ": " << e.what () << std::endl;
+      return EXIT_FAILURE;
+    }
+  Clock::time_point loaded = Clock::now ();
+  grid->updateGrid (*runtime);
+  Clock::time_point calculated = Clock::now ();
+
+  // A run whose results were lost must not look like it succeeded
+  if (output.empty ())
+    {
+      write (std::cout, *grid);
+      std::cout.flush ();
+      if (std::cout.fail ())
+        {
+          std::cerr << "Can't write standard output" << std::endl;
+          return EXIT_FAILURE;
+        }
+    }
+  else
+    {
+      std::ofstream out (output);
+      if (out)
+        {
+          write (out, *grid);
+          out.close ();
+        }
+      if (out.fail ())
+        {
+          std::cerr << "Can't write " << output << std::endl;
+          return EXIT_FAILURE;
+        }
+    }
+  if (!save.empty ())
+    {
+      try
+        {
+          SheetFile::save (save, *grid);
+        }
+      catch (std::exception &e)
+        {
+          std::cerr << e.what () << std::endl;
+          return EXIT_FAILURE;
+        }
+    }
+  if (!exported.empty ())
+    {
+      std::ofstream out (exported, std::ios::binary);
+      if (!out)
+        {
+          std::cerr << "Can't write " << exported << std::endl;
+          return EXIT_FAILURE;
+        }
+      bool tsv = exported.size () >= 4
+                 && exported.compare (exported.size () - 4, 4, ".tsv") == 0;
+      try
+        {
+          Csv::write (out, *grid, tsv ? '\t' : ',');
+        }
+      catch (std::exception &e)
+        {
+          std::cerr << exported << ": " << e.what () << std::endl;
+          return EXIT_FAILURE;
+        }
+    }
+  Clock::time_point written = Clock::now ();
+
+  auto seconds = [] (Clock::duration duration) {
+    return std::chrono::duration<double> (duration).count ();
+  };
+  double recalc = seconds (calculated - loaded);
+  std::cerr << "cells: " << count << '\n'
+            << "load: " << seconds (loaded - start) * 1000 << " ms\n"
+            << "recalculate: " << recalc * 1000 << " ms\n"
+            << "write: " << seconds (written - calculated) * 1000 << " ms\n"
+            << "total: " << seconds (written - start) * 1000 << " ms\n"
+            << "cells/sec: "
+            << (recalc > 0 ? static_cast<double> (grid->size ()) / recalc : 0)
+            << std::endl;
+  return EXIT_SUCCESS;
+}
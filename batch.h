@@ -0,0 +1,42 @@
+#ifndef batch_H
+#define batch_H
+
+#include "grid.h"
+#include "runtime.h"
+#include <iostream>
+#include <string>
+
+/* Batch runs a sheet without the terminal interface, for scripts and CI:
+ *
+ *   spreadsheet --batch SHEET [-o OUTPUT] [--save FILE] [--export FILE]
+ *                       [--iterative] [--csv | --tsv] [--threads N]
+ *
+ * A sheet file has one cell per line, row<TAB>col<TAB>source. Newlines,
+ * tabs and backslashes in the source are written as \n, \t and \\. Blank
+ * lines and lines starting with # are skipped. The results are written the
+ * same way, row<TAB>col<TAB>value<TAB>error, in row-major order. Timings go
+ * to stderr.
+ *
+ * SHEET can also be a binary sheet file, see SheetFile, and --save writes
+ * one after recalculating. With --csv or --tsv SHEET is plain comma or tab
+ * separated data instead, see Csv. --export writes the values as comma
+ * separated data, or tab separated if FILE ends in .tsv. --threads is the
+ * number of threads used to import and recalculate, one per core by
+ * default.
+ */
+class Batch
+{
+public:
+  // Reads every cell of a sheet into grid without recalculating. Returns
+  // the number of cells read, throws runtime_error on a malformed line.
+  static size_t load (std::istream &in, Grid &grid, Runtime &runtime);
+  static void write (std::ostream &out, Grid &grid);
+
+  static std::string escape (std::string_view text);
+  static std::string unescape (std::string_view text);
+
+  // Entry point from main, returns the exit status
+  static int run (int argc, char **argv);
+};
+
+#endif
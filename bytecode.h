@@ -0,0 +1,113 @@
+#ifndef bytecode_H
+#define bytecode_H
+
+#include "value.h"
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/* The instruction set of the virtual machine. Operands are taken off the
+ * top of the stack and the result is pushed back, so an expression tree
+ * compiles to its operands followed by its operator. arg is only used where
+ * noted.
+ */
+enum class OpCode : uint8_t
+{
+  CONSTANT,      // Push constants[arg]
+  LOAD,          // Push the variable in frame slot arg
+  STORE,         // Copy the top of the stack into frame slot arg
+  POP,           // Discard the top of the stack
+  JUMP,          // Continue at instruction arg
+  JUMP_IF_FALSE, // Pop a Boolean, continue at arg if it is false
+  FAIL,          // Throw the String constants[arg] as an error
+
+  // Same as the Expression classes of the same name
+  ADD,
+  SUBTRACT,
+  MULTIPLY,
+  DIVIDE,
+  MODULO,
+  EXPONENTIATE,
+  NEGATE,
+  AND,
+  OR,
+  NOT,
+  BITAND,
+  BITOR,
+  BITXOR,
+  BITNOT,
+  LEFTSHIFT,
+  RIGHTSHIFT,
+  EQUALS,
+  NOTEQUALS,
+  LESSTHAN,
+  LESSTHANEQUAL,
+  GREATERTHAN,
+  GREATERTHANEQUAL,
+  FLOATTOINT,
+  INTTOFLOAT,
+  ADDRESS, // Pop a row and a column, push their CellAddress
+  CELL,    // Pop a row and a column, push the value of that cell
+  MAX,     // The statistical functions pop two addresses
+  MIN,
+  MEAN,
+  SUM,
+
+  // Picked by the compiler when both operands are known to be Integers (_II)
+  // or both Floats (_FF), they skip looking up the operand types.
+  ADD_II,
+  ADD_FF,
+  SUBTRACT_II,
+  SUBTRACT_FF,
+  MULTIPLY_II,
+  MULTIPLY_FF,
+  DIVIDE_II,
+  DIVIDE_FF,
+  EQUALS_II,
+  EQUALS_FF,
+  NOTEQUALS_II,
+  NOTEQUALS_FF,
+  LESSTHAN_II,
+  LESSTHAN_FF,
+  LESSTHANEQUAL_II,
+  LESSTHANEQUAL_FF,
+  GREATERTHAN_II,
+  GREATERTHAN_FF,
+  GREATERTHANEQUAL_II,
+  GREATERTHANEQUAL_FF,
+
+  // For loops. FOR_ENTER pops two addresses and starts a loop whose exit is
+  // at arg. FOR_NEXT binds slot arg to the next cell or jumps to the exit
+  // once there are none left. FOR_CONTINUE pops the value of the loop body
+  // and goes back to the FOR_NEXT at arg. FOR_EXIT pushes the last value of
+  // the body and ends the loop.
+  FOR_ENTER,
+  FOR_NEXT,
+  FOR_CONTINUE,
+  FOR_EXIT,
+  // Pop a Boolean, continue at arg if it is true. Skips evaluating a
+  // Hoisted expression that already has a value.
+  JUMP_IF_TRUE,
+  // Push the row (or column) of the cell being evaluated plus arg, see Offset
+  ROW,
+  COLUMN,
+};
+
+struct Instruction
+{
+  OpCode op;
+  int32_t arg;
+};
+
+// A compiled expression. Instructions are stored contiguously and refer to
+// constants by index. Variables are resolved to slots of a Frame when they
+// are compiled, names[slot] is the variable's name and names.size () the
+// number of slots a run needs.
+struct Program
+{
+  std::vector<Instruction> code;
+  std::vector<Value> constants;
+  std::vector<std::string> names;
+};
+
+#endif
@@ -1,11 +1,17 @@
 #include "cell.h"
+#include "compiler.h"
+#include "formula.h"
 #include <memory>
 // Cell class implementation. See cell.h for more information.
 
-Cell::Cell (std::string src, std::unique_ptr<Expression> exp,
-            std::unique_ptr<Primitive> primitive, std::string error)
-    : src (src), exp (std::move (exp)), primitive (std::move (primitive)),
-      error ("") {};
+Cell::Cell (std::string src, std::unique_ptr<Expression> exp, Value value,
+            std::string error)
+    : src (src), exp (std::move (exp)), value (std::move (value)),
+      error (error)
+{
+  if (this->exp != nullptr)
+    program = Compiler::compile (*this->exp);
+}
 
 std::string
 Cell::getString ()
@@ -19,16 +25,24 @@ Cell::getExpression ()
   return exp;
 }
 
+const std::shared_ptr<Program> &
+Cell::getProgram ()
+{
+  return program;
+}
+
 std::unique_ptr<Primitive>
-Cell::getPrimitive (std::shared_ptr<Runtime> runtime)
+Cell::getPrimitive ()
 {
-  if (primitive == nullptr)
-    {
-      return nullptr;
-    }
   // This allows the getPrimitive to return a seperate, new primitive rather
   // than a pointer to the one held by Cell
-  return primitive->evaluate (runtime);
+  return value.toPrimitive ();
+}
+
+const Value &
+Cell::getValue ()
+{
+  return value;
 }
 
 std::string
@@ -44,16 +58,37 @@ Cell::setStr (std::string string)
 }
 
 void
-Cell::setExpression (std::unique_ptr<Expression> expression,
-                     std::shared_ptr<Runtime> runtime)
+Cell::setExpression (std::unique_ptr<Expression> expression)
 {
   exp = std::move (expression);
+  // Compiled once here so recalculating doesn't walk the tree again
+  program = exp != nullptr ? Compiler::compile (*exp) : nullptr;
+}
+
+void
+Cell::setFormula (std::shared_ptr<Formula> formula)
+{
+  // exp keeps the formula alive, FormulaTable only holds on to it weakly
+  program = formula->program;
+  exp = std::shared_ptr<Expression> (formula, formula->exp.get ());
+}
+
+void
+Cell::setProgram (std::shared_ptr<Program> program)
+{
+  this->program = std::move (program);
 }
 
 void
 Cell::setPrimitive (std::unique_ptr<Primitive> prim)
 {
-  primitive = std::move (prim);
+  value = Value::fromPrimitive (prim.get ());
+}
+
+void
+Cell::setValue (Value value)
+{
+  this->value = std::move (value);
 }
 
 void
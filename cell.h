@@ -1,13 +1,15 @@
 #ifndef cell_H
 #define cell_H
+#include "bytecode.h"
 #include "expression.h"
 #include "forward_declarations.h"
+#include "value.h"
 #include <memory>
 #include <string>
 
 /* Cell class represents a single cell in the spreadsheet. It holds a string of
- * the source code,an Expression, and the Primitive that the expression
- * evaluates to.
+ * the source code,an Expression, the Expression compiled to bytecode, and the
+ * Value that the expression evaluates to.
  *
  * @date 12-17-2024
  */
@@ -26,21 +28,34 @@ private:
   // unique_ptr to a shared_ptr, as it needs to be accessible from the grid,
   // and if it was moved out of the cell then problems would arise.
   std::shared_ptr<Expression> exp;
-  std::unique_ptr<Primitive>
-      primitive; // Field for what the expression evaluates to (a primitive)
+  // exp compiled for the virtual machine, null when there is no expression
+  std::shared_ptr<Program> program;
+  Value value; // Field for what the expression evaluates to
   std::string error;
 
 public:
-  Cell (std::string src, std::unique_ptr<Expression> exp,
-        std::unique_ptr<Primitive> primitive, std::string error);
+  Cell (std::string src, std::unique_ptr<Expression> exp, Value value,
+        std::string error);
   std::string getString ();
   std::shared_ptr<Expression> getExpression ();
-  std::unique_ptr<Primitive> getPrimitive (std::shared_ptr<Runtime> runtime);
+  // Borrowed, valid until the expression is next set. Cells sharing a
+  // formula would otherwise all contend for its reference count.
+  const std::shared_ptr<Program> &getProgram ();
+  // Returns a new Primitive holding the value, nullptr if there is none
+  std::unique_ptr<Primitive> getPrimitive ();
+  // Borrowed, valid until the value is next set
+  const Value &getValue ();
   std::string getError ();
   void setStr (std::string string);
-  void setExpression (std::unique_ptr<Expression> expression,
-                      std::shared_ptr<Runtime> runtime);
+  void setExpression (std::unique_ptr<Expression> expression);
+  // Shares an interned formula with the other cells that have it, see
+  // FormulaTable
+  void setFormula (std::shared_ptr<Formula> formula);
+  // For a cell read back from a sheet file, which has a program without an
+  // expression
+  void setProgram (std::shared_ptr<Program> program);
   void setPrimitive (std::unique_ptr<Primitive> prim);
+  void setValue (Value value);
   void setError (std::string error);
 };
 
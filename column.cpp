@@ -0,0 +1,401 @@
+#include "column.h"
+#include <algorithm>
+#include <cmath>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+// -------------------- Kernels
+
+static bool
+isValid (const uint64_t *valid, size_t row)
+{
+  return valid[row >> 6] >> (row & 63) & 1;
+}
+
+static double
+sumScalar (const double *values, size_t count)
+{
+  double sum = 0;
+  for (size_t i = 0; i < count; i++)
+    {
+      sum += values[i];
+    }
+  return sum;
+}
+
+// Only numbers that beat ret replace it, so NaN never does
+template <bool Max>
+static double
+extremeScalar (const double *values, const uint64_t *valid, size_t first,
+               size_t last, double ret)
+{
+  for (size_t i = first; i < last; i++)
+    {
+      if (isValid (valid, i) && (Max ? values[i] > ret : values[i] < ret))
+        {
+          ret = values[i];
+        }
+    }
+  return ret;
+}
+
+#if defined(__x86_64__)
+
+// SSE2 is part of x86-64, so this is the version every x86-64 processor can
+// run. The AVX2 version is the same thing twice as wide.
+static double
+sumSse2 (const double *values, size_t count)
+{
+  __m128d sums[4] = { _mm_setzero_pd (), _mm_setzero_pd (), _mm_setzero_pd (),
+                      _mm_setzero_pd () };
+  size_t i = 0;
+  // Independent sums so each add doesn't wait on the one before it
+  for (; i + 8 <= count; i += 8)
+    {
+      for (int k = 0; k < 4; k++)
+        {
+          sums[k] = _mm_add_pd (sums[k], _mm_loadu_pd (values + i + 2 * k));
+        }
+    }
+  __m128d total = _mm_add_pd (_mm_add_pd (sums[0], sums[1]),
+                              _mm_add_pd (sums[2], sums[3]));
+  double lanes[2];
+  _mm_storeu_pd (lanes, total);
+  return lanes[0] + lanes[1] + sumScalar (values + i, count - i);
+}
+
+template <bool Max>
+static double
+extremeSse2 (const double *values, const uint64_t *valid, size_t first,
+             size_t last, double ret)
+{
+  // Up to an even row, so a pair's bits are always in the same word
+  size_t i = std::min (last, (first + 1) & ~size_t (1));
+  ret = extremeScalar<Max> (values, valid, first, i, ret);
+
+  const __m128d none = _mm_set1_pd (ret);
+  __m128d best = none;
+  for (; i + 2 <= last; i += 2)
+    {
+      uint64_t bits = valid[i >> 6] >> (i & 63) & 3;
+      if (bits == 0)
+        continue;
+      __m128d x = _mm_loadu_pd (values + i);
+      if (bits != 3)
+        {
+          __m128d mask = _mm_castsi128_pd (
+              _mm_set_epi64x (-static_cast<int64_t> (bits >> 1),
+                              -static_cast<int64_t> (bits & 1)));
+          x = _mm_or_pd (_mm_and_pd (mask, x), _mm_andnot_pd (mask, none));
+        }
+      // x is first so a NaN in it loses to best
+      best = Max ? _mm_max_pd (x, best) : _mm_min_pd (x, best);
+    }
+  double lanes[2];
+  _mm_storeu_pd (lanes, best);
+  for (double lane : lanes)
+    {
+      ret = Max ? std::max (ret, lane) : std::min (ret, lane);
+    }
+  return extremeScalar<Max> (values, valid, i, last, ret);
+}
+
+__attribute__ ((target ("avx2"))) static double
+sumAvx2 (const double *values, size_t count)
+{
+  __m256d sums[4] = { _mm256_setzero_pd (), _mm256_setzero_pd (),
+                      _mm256_setzero_pd (), _mm256_setzero_pd () };
+  size_t i = 0;
+  for (; i + 16 <= count; i += 16)
+    {
+      for (int k = 0; k < 4; k++)
+        {
+          sums[k] = _mm256_add_pd (sums[k],
+                                   _mm256_loadu_pd (values + i + 4 * k));
+        }
+    }
+  __m256d total = _mm256_add_pd (_mm256_add_pd (sums[0], sums[1]),
+                                 _mm256_add_pd (sums[2], sums[3]));
+  double lanes[4];
+  _mm256_storeu_pd (lanes, total);
+  return lanes[0] + lanes[1] + lanes[2] + lanes[3]
+         + sumScalar (values + i, count - i);
+}
+
+template <bool Max>
+__attribute__ ((target ("avx2"))) static double
+extremeAvx2 (const double *values, const uint64_t *valid, size_t first,
+             size_t last, double ret)
+{
+  size_t i = std::min (last, (first + 3) & ~size_t (3));
+  ret = extremeScalar<Max> (values, valid, first, i, ret);
+
+  const __m256d none = _mm256_set1_pd (ret);
+  const __m256i lanes = _mm256_setr_epi64x (1, 2, 4, 8);
+  __m256d best = none;
+  for (; i + 4 <= last; i += 4)
+    {
+      uint64_t bits = valid[i >> 6] >> (i & 63) & 0xf;
+      if (bits == 0)
+        continue;
+      __m256d x = _mm256_loadu_pd (values + i);
+      if (bits != 0xf)
+        {
+          __m256i mask = _mm256_cmpeq_epi64 (
+              _mm256_and_si256 (
+                  _mm256_set1_epi64x (static_cast<int64_t> (bits)), lanes),
+              lanes);
+          x = _mm256_blendv_pd (none, x, _mm256_castsi256_pd (mask));
+        }
+      best = Max ? _mm256_max_pd (x, best) : _mm256_min_pd (x, best);
+    }
+  double out[4];
+  _mm256_storeu_pd (out, best);
+  for (double lane : out)
+    {
+      ret = Max ? std::max (ret, lane) : std::min (ret, lane);
+    }
+  return extremeScalar<Max> (values, valid, i, last, ret);
+}
+
+#endif
+
+namespace
+{
+struct Kernels
+{
+  double (*sum) (const double *values, size_t count);
+  double (*max) (const double *values, const uint64_t *valid, size_t first,
+                 size_t last, double ret);
+  double (*min) (const double *values, const uint64_t *valid, size_t first,
+                 size_t last, double ret);
+};
+}
+
+// Picked once, the first time an aggregate is taken
+static const Kernels &
+kernels ()
+{
+  static const Kernels chosen = [] () -> Kernels {
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports ("avx2"))
+      return { sumAvx2, extremeAvx2<true>, extremeAvx2<false> };
+    return { sumSse2, extremeSse2<true>, extremeSse2<false> };
+#else
+    return { sumScalar, extremeScalar<true>, extremeScalar<false> };
+#endif
+  }();
+  return chosen;
+}
+
+// -------------------- NumericColumn
+
+void
+NumericColumn::resize (size_t rows)
+{
+  values.resize (rows, 0);
+  valid.resize ((rows + block_rows - 1) / block_rows, 0);
+  stale = true;
+}
+
+void
+NumericColumn::set (size_t row, const Value &value)
+{
+  if (row >= values.size ())
+    {
+      resize (std::max (row + 1, values.size () + values.size () / 2));
+    }
+  uint64_t bit = static_cast<uint64_t> (1) << (row & 63);
+  if (value.isNumeric ())
+    {
+      values[row] = value.toDouble ();
+      valid[row >> 6] |= bit;
+    }
+  else
+    {
+      values[row] = 0;
+      valid[row >> 6] &= ~bit;
+    }
+
+  if (!stale)
+    {
+      // Past a point it is cheaper to rebuild the tree than to fix it up
+      if (dirty.size () >= valid.size () / 4)
+        {
+          stale = true;
+          dirty.clear ();
+        }
+      else
+        {
+          dirty.push_back (row / block_rows);
+        }
+    }
+}
+
+// -------------------- Aggregates over rows
+
+double
+NumericColumn::sumRows (size_t first, size_t last) const
+{
+  if (first >= last)
+    return 0;
+  return kernels ().sum (values.data () + first, last - first);
+}
+
+size_t
+NumericColumn::countRows (size_t first, size_t last) const
+{
+  size_t count = 0;
+  while (first < last)
+    {
+      // Whatever part of this word is in the range
+      size_t end = std::min (last, (first | 63) + 1);
+      uint64_t bits = valid[first >> 6] >> (first & 63);
+      if (end - first < 64)
+        bits &= (static_cast<uint64_t> (1) << (end - first)) - 1;
+      count += __builtin_popcountll (bits);
+      first = end;
+    }
+  return count;
+}
+
+double
+NumericColumn::maxRows (size_t first, size_t last, double ret) const
+{
+  if (first >= last)
+    return ret;
+  return kernels ().max (values.data (), valid.data (), first, last, ret);
+}
+
+double
+NumericColumn::minRows (size_t first, size_t last, double ret) const
+{
+  if (first >= last)
+    return ret;
+  return kernels ().min (values.data (), valid.data (), first, last, ret);
+}
+
+// -------------------- Segment tree
+
+NumericColumn::Summary
+NumericColumn::combine (const Summary &a, const Summary &b)
+{
+  return { a.sum + b.sum, std::min (a.min, b.min), std::max (a.max, b.max),
+           a.count + b.count };
+}
+
+NumericColumn::Summary
+NumericColumn::summarize (size_t block) const
+{
+  size_t first = block * block_rows;
+  size_t last = std::min (first + block_rows, values.size ());
+  return { sumRows (first, last), minRows (first, last, INFINITY),
+           maxRows (first, last, -INFINITY),
+           static_cast<size_t> (__builtin_popcountll (valid[block])) };
+}
+
+void
+NumericColumn::refresh () const
+{
+  std::lock_guard<std::mutex> lock (refreshing);
+  size_t blocks = valid.size ();
+  if (stale)
+    {
+      tree.assign (2 * blocks, emptySummary ());
+      for (size_t b = 0; b < blocks; b++)
+        {
+          tree[blocks + b] = summarize (b);
+        }
+      for (size_t node = blocks; node-- > 1;)
+        {
+          tree[node] = combine (tree[2 * node], tree[2 * node + 1]);
+        }
+      stale = false;
+      dirty.clear ();
+      return;
+    }
+  for (size_t block : dirty)
+    {
+      size_t node = blocks + block;
+      tree[node] = summarize (block);
+      for (node /= 2; node > 0; node /= 2)
+        {
+          tree[node] = combine (tree[2 * node], tree[2 * node + 1]);
+        }
+    }
+  dirty.clear ();
+}
+
+bool
+NumericColumn::split (size_t first, size_t last, size_t &head, size_t &tail,
+                      Summary &blocks) const
+{
+  size_t first_block = (first + block_rows - 1) / block_rows;
+  size_t last_block = last / block_rows;
+  if (last_block < first_block + tree_blocks)
+    {
+      return false;
+    }
+  refresh ();
+
+  // The usual bottom-up walk, leaves l and r - 1 are both in the range
+  blocks = emptySummary ();
+  size_t count = valid.size ();
+  for (size_t l = first_block + count, r = last_block + count; l < r;
+       l /= 2, r /= 2)
+    {
+      if (l & 1)
+        blocks = combine (blocks, tree[l++]);
+      if (r & 1)
+        blocks = combine (blocks, tree[--r]);
+    }
+  head = first_block * block_rows;
+  tail = last_block * block_rows;
+  return true;
+}
+
+double
+NumericColumn::sum (size_t first, size_t last) const
+{
+  last = std::min (last, values.size ());
+  size_t head, tail;
+  Summary blocks;
+  if (!split (first, last, head, tail, blocks))
+    return sumRows (first, last);
+  return sumRows (first, head) + blocks.sum + sumRows (tail, last);
+}
+
+size_t
+NumericColumn::count (size_t first, size_t last) const
+{
+  last = std::min (last, values.size ());
+  size_t head, tail;
+  Summary blocks;
+  if (!split (first, last, head, tail, blocks))
+    return countRows (first, last);
+  return countRows (first, head) + blocks.count + countRows (tail, last);
+}
+
+double
+NumericColumn::max (size_t first, size_t last) const
+{
+  last = std::min (last, values.size ());
+  size_t head, tail;
+  Summary blocks;
+  if (!split (first, last, head, tail, blocks))
+    return maxRows (first, last, -INFINITY);
+  return maxRows (tail, last, maxRows (first, head, blocks.max));
+}
+
+double
+NumericColumn::min (size_t first, size_t last) const
+{
+  last = std::min (last, values.size ());
+  size_t head, tail;
+  Summary blocks;
+  if (!split (first, last, head, tail, blocks))
+    return minRows (first, last, INFINITY);
+  return minRows (tail, last, minRows (first, head, blocks.min));
+}
@@ -0,0 +1,99 @@
+#ifndef column_H
+#define column_H
+
+#include "value.h"
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+/* NumericColumn is a dense copy of the numbers in one column of a Grid,
+ * kept so range functions can read a column as a plain array of doubles
+ * instead of looking up every cell. valid has a bit per row that is set
+ * when the cell holds an Integer or Float. Rows without a number are 0 in
+ * values, so they can be added in without checking valid.
+ *
+ * The aggregates use AVX2 when the processor has it, SSE2 otherwise, or
+ * plain loops on processors that are not x86-64. Each works on rows
+ * [first, last) and rows past the end of the column count as empty.
+ *
+ * Many formulas often total overlapping ranges of the same column, so the
+ * totals of every block of 64 rows are also kept in a segment tree. A range
+ * spanning many blocks only reads the rows at either end that don't make a
+ * whole block, and takes the rest from O(log n) nodes of the tree. Ranges
+ * are never totalled by taking one prefix sum from another, that would
+ * lose the small values of a range after large ones. Writes only mark their
+ * block, the tree is brought up to date by the next query.
+ */
+class NumericColumn
+{
+private:
+  std::vector<double> values;
+  std::vector<uint64_t> valid;
+
+  // One block is the rows of one word of valid
+  static constexpr size_t block_rows = 64;
+  // Ranges spanning fewer whole blocks than this just read every row
+  static constexpr size_t tree_blocks = 8;
+
+  struct Summary
+  {
+    double sum;
+    double min;
+    double max;
+    size_t count;
+  };
+
+  static Summary
+  emptySummary ()
+  {
+    return { 0, INFINITY, -INFINITY, 0 };
+  }
+
+  static Summary combine (const Summary &a, const Summary &b);
+
+  // The leaves are at tree[blocks + b] for block b, each node above them
+  // combines its two children. These are a cache that the const queries
+  // bring up to date, dirty lists the blocks written since. stale means the
+  // whole tree has to be rebuilt. Queries can come from several threads at
+  // once, refreshing locks the tree while it brings it up to date.
+  mutable std::vector<Summary> tree;
+  mutable std::vector<size_t> dirty;
+  mutable bool stale = true;
+  mutable std::mutex refreshing;
+
+  Summary summarize (size_t block) const;
+  void refresh () const;
+  // Totals the whole blocks of [first, last) into blocks, the rows before
+  // and after them are [first, head) and [tail, last). False if the range
+  // doesn't span enough blocks to be worth it.
+  bool split (size_t first, size_t last, size_t &head, size_t &tail,
+              Summary &blocks) const;
+
+  double sumRows (size_t first, size_t last) const;
+  size_t countRows (size_t first, size_t last) const;
+  double maxRows (size_t first, size_t last, double ret) const;
+  double minRows (size_t first, size_t last, double ret) const;
+
+public:
+  size_t
+  size () const
+  {
+    return values.size ();
+  }
+
+  void resize (size_t rows);
+  // Grows the column if row is past the end, by at least half again so a
+  // column written a row at a time isn't rebuilt every row
+  void set (size_t row, const Value &value);
+
+  double sum (size_t first, size_t last) const;
+  // Number of rows with a number in them
+  size_t count (size_t first, size_t last) const;
+  // -INFINITY and INFINITY when there are no numbers, NaN is skipped
+  double max (size_t first, size_t last) const;
+  double min (size_t first, size_t last) const;
+};
+
+#endif
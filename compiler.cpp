@@ -0,0 +1,111 @@
+#include "compiler.h"
+#include "expression.h"
+
+Compiler::Compiler () : program (std::make_shared<Program> ()) {}
+
+std::shared_ptr<Program>
+Compiler::compile (Expression &exp)
+{
+  Compiler compiler;
+  exp.compile (compiler);
+  return compiler.program;
+}
+
+int
+Compiler::emit (OpCode op, int arg)
+{
+  program->code.push_back ({ op, arg });
+  return static_cast<int> (program->code.size ()) - 1;
+}
+
+int
+Compiler::here ()
+{
+  return static_cast<int> (program->code.size ());
+}
+
+void
+Compiler::patch (int index, int target)
+{
+  program->code[index].arg = target;
+}
+
+void
+Compiler::constant (Value val)
+{
+  program->constants.push_back (std::move (val));
+  emit (OpCode::CONSTANT, static_cast<int> (program->constants.size ()) - 1);
+}
+
+int
+Compiler::name (const std::string &name)
+{
+  for (size_t i = 0; i < program->names.size (); i++)
+    {
+      if (program->names[i] == name)
+        return static_cast<int> (i);
+    }
+  program->names.push_back (name);
+  return static_cast<int> (program->names.size ()) - 1;
+}
+
+void
+Compiler::fail (const std::string &message)
+{
+  program->constants.push_back (Value::fromString (message));
+  emit (OpCode::FAIL, static_cast<int> (program->constants.size ()) - 1);
+}
+
+void
+Compiler::unary (Expression *exp, OpCode op)
+{
+  exp->compile (*this);
+  emit (op);
+}
+
+// Operators with instructions for operands of a known type
+struct Specialization
+{
+  OpCode generic;
+  OpCode integers;
+  OpCode floats;
+};
+
+static const Specialization specializations[] = {
+  { OpCode::ADD, OpCode::ADD_II, OpCode::ADD_FF },
+  { OpCode::SUBTRACT, OpCode::SUBTRACT_II, OpCode::SUBTRACT_FF },
+  { OpCode::MULTIPLY, OpCode::MULTIPLY_II, OpCode::MULTIPLY_FF },
+  { OpCode::DIVIDE, OpCode::DIVIDE_II, OpCode::DIVIDE_FF },
+  { OpCode::EQUALS, OpCode::EQUALS_II, OpCode::EQUALS_FF },
+  { OpCode::NOTEQUALS, OpCode::NOTEQUALS_II, OpCode::NOTEQUALS_FF },
+  { OpCode::LESSTHAN, OpCode::LESSTHAN_II, OpCode::LESSTHAN_FF },
+  { OpCode::LESSTHANEQUAL, OpCode::LESSTHANEQUAL_II,
+    OpCode::LESSTHANEQUAL_FF },
+  { OpCode::GREATERTHAN, OpCode::GREATERTHAN_II, OpCode::GREATERTHAN_FF },
+  { OpCode::GREATERTHANEQUAL, OpCode::GREATERTHANEQUAL_II,
+    OpCode::GREATERTHANEQUAL_FF },
+};
+
+void
+Compiler::binary (Expression *left, Expression *right, OpCode op)
+{
+  left->compile (*this);
+  right->compile (*this);
+
+  ValueType leftType = left->staticType ();
+  ValueType rightType = right->staticType ();
+  if (leftType == rightType)
+    {
+      for (const Specialization &special : specializations)
+        {
+          if (special.generic != op)
+            continue;
+          if (leftType == ValueType::INTEGER)
+            op = special.integers;
+          else if (leftType == ValueType::FLOAT)
+            op = special.floats;
+          break;
+        }
+    }
+  emit (op);
+}
@@ -0,0 +1,40 @@
+#ifndef compiler_H
+#define compiler_H
+
+#include "bytecode.h"
+#include "forward_declarations.h"
+#include <memory>
+#include <string>
+
+/* Compiler flattens an Expression tree into a Program for the virtual
+ * machine. Each Expression compiles itself through the helpers here, see
+ * Expression::compile.
+ */
+class Compiler
+{
+private:
+  std::shared_ptr<Program> program;
+
+  Compiler ();
+
+public:
+  static std::shared_ptr<Program> compile (Expression &exp);
+
+  // Appends an instruction and returns its index
+  int emit (OpCode op, int arg = 0);
+  // Index of the next instruction, for jumps
+  int here ();
+  // Points the jump at index to target
+  void patch (int index, int target);
+
+  void constant (Value val);
+  // Frame slot of a variable name, each name gets one slot
+  int name (const std::string &name);
+  // Compiles to an instruction that throws message when it is reached
+  void fail (const std::string &message);
+
+  void unary (Expression *exp, OpCode op);
+  void binary (Expression *left, Expression *right, OpCode op);
+};
+
+#endif
@@ -0,0 +1,415 @@
+#include "csv.h"
+#include <algorithm>
+#include <cctype>
+#include <charconv>
+#include <cstring>
+#include <deque>
+#include <future>
+#include <memory>
+#include <stdexcept>
+#include <thread>
+
+// Where the last record that ends in text ends, 0 if none does. Carries on
+// from where scan got to in the same text, so text that grows while no
+// record ends in it is only scanned once.
+size_t
+Csv::recordEnd (std::string_view text, char separator, Scan &scan)
+{
+  size_t end = 0;
+  for (size_t i = scan.next; i < text.size (); i++)
+    {
+      char c = text[i];
+      switch (scan.state)
+        {
+        case Scan::QUOTED:
+          if (c == '"')
+            scan.state = Scan::CLOSING_QUOTE;
+          continue;
+        case Scan::CLOSING_QUOTE:
+          if (c == '"')
+            {
+              scan.state = Scan::QUOTED;
+              continue;
+            }
+          break;
+        case Scan::FIELD_START:
+          if (c == '"')
+            {
+              scan.state = Scan::QUOTED;
+              continue;
+            }
+          break;
+        case Scan::UNQUOTED:
+          break;
+        }
+      // Outside quotes, which is all a stray quote in a field is too
+      if (c == separator)
+        scan.state = Scan::FIELD_START;
+      else if (c == '\n')
+        {
+          scan.state = Scan::FIELD_START;
+          end = i + 1;
+        }
+      else
+        scan.state = Scan::UNQUOTED;
+    }
+  scan.next = text.size ();
+  return end;
+}
+
+void
+Csv::addField (Chunk &chunk, int col, std::string_view text, bool quoted)
+{
+  if (text.empty ())
+    {
+      return;
+    }
+  const char *first = text.data ();
+  const char *last = text.data () + text.size ();
+  if (!quoted)
+    {
+      // Only what the Lexer would read as a number, so no inf, nan or hex
+      size_t digit = text[0] == '-' ? 1 : 0;
+      if (digit < text.size () && isdigit (text[digit]))
+        {
+          int int_val;
+          auto result = std::from_chars (first, last, int_val);
+          if (result.ec == std::errc () && result.ptr == last)
+            {
+              chunk.fields.push_back ({ chunk.rows, col, std::string (text),
+                                        Value::fromInt (int_val) });
+              return;
+            }
+          float float_val;
+          result = std::from_chars (first, last, float_val,
+                                    std::chars_format::fixed);
+          if (result.ec == std::errc () && result.ptr == last)
+            {
+              chunk.fields.push_back ({ chunk.rows, col, std::string (text),
+                                        Value::fromFloat (float_val) });
+              return;
+            }
+        }
+      if (text == "true" || text == "false")
+        {
+          chunk.fields.push_back ({ chunk.rows, col, std::string (text),
+                                    Value::fromBool (text == "true") });
+          return;
+        }
+    }
+  // The source is the string literal, unless the text has a quote in it
+  // since string literals can't.
+  std::string src = text.find ('"') == std::string_view::npos
+                        ? "\"" + std::string (text) + "\""
+                        : std::string (text);
+  chunk.fields.push_back (
+      { chunk.rows, col, std::move (src), Value::fromString (text) });
+}
+
+Csv::Chunk
+Csv::parse (std::string_view text, char separator)
+{
+  Chunk chunk;
+  std::string unquoted;
+  int col = 0;
+  size_t i = 0;
+  while (i < text.size ())
+    {
+      std::string_view field;
+      bool quoted = text[i] == '"';
+      if (quoted)
+        {
+          // Only a quoted field can differ from the text it came from
+          unquoted.clear ();
+          i++;
+          while (i < text.size ())
+            {
+              size_t quote = std::min (text.find ('"', i), text.size ());
+              unquoted.append (text.substr (i, quote - i));
+              i = quote + 1;
+              if (i < text.size () && text[i] == '"')
+                {
+                  unquoted += '"';
+                  i++;
+                }
+              else
+                {
+                  break;
+                }
+            }
+          field = unquoted;
+          // Anything after the closing quote is dropped
+          while (i < text.size () && text[i] != separator && text[i] != '\n')
+            i++;
+        }
+      else
+        {
+          size_t end = i;
+          while (end < text.size () && text[end] != separator
+                 && text[end] != '\n')
+            end++;
+          field = text.substr (i, end - i);
+          if (!field.empty () && field.back () == '\r')
+            field.remove_suffix (1);
+          i = end;
+        }
+      addField (chunk, col, field, quoted);
+
+      if (i < text.size () && text[i] == separator)
+        {
+          col++;
+          i++;
+          continue;
+        }
+      // The end of a line or the end of the text ends the record
+      chunk.rows++;
+      col = 0;
+      i++;
+    }
+  return chunk;
+}
+
+size_t
+Csv::import (std::istream &in, Grid &grid, char separator, unsigned threads)
+{
+  if (threads == 0)
+    {
+      threads = std::max (1u, std::thread::hardware_concurrency ());
+    }
+  std::deque<std::future<Chunk> > parsing;
+  size_t count = 0;
+  int row = 0;
+
+  // Chunks are inserted in the order they were read, so each one's rows
+  // start where the last one's ended.
+  auto insertNext = [&] () {
+    Chunk chunk = parsing.front ().get ();
+    parsing.pop_front ();
+    for (Field &field : chunk.fields)
+      {
+        if (field.row >= grid.getRows () - row
+            || field.col >= grid.getCols ())
+          {
+            throw std::runtime_error (
+                "Record " + std::to_string (row + field.row + 1)
+                + " doesn't fit in the sheet");
+          }
+        grid.loadValue (row + field.row, field.col, std::move (field.src),
+                        std::move (field.value));
+      }
+    count += chunk.fields.size ();
+    row += chunk.rows;
+  };
+
+  std::string carry;
+  Scan scan;
+  while (in)
+    {
+      std::string text = std::move (carry);
+      size_t start = text.size ();
+      text.resize (start + chunk_size);
+      in.read (text.data () + start, chunk_size);
+      text.resize (start + in.gcount ());
+
+      // The unfinished record at the end goes with the next chunk. If no
+      // record ends in the chunk at all, keep reading until one does.
+      size_t end = in ? recordEnd (text, separator, scan) : text.size ();
+      if (end == 0 && in)
+        {
+          carry = std::move (text);
+          continue;
+        }
+      carry.assign (text, end);
+      // The carry has been scanned already, from the start of a record
+      scan.next = carry.size ();
+      text.resize (end);
+
+      if (parsing.size () >= threads)
+        {
+          insertNext ();
+        }
+      parsing.push_back (std::async (
+          std::launch::async, [text = std::move (text), separator] () {
+            return parse (text, separator);
+          }));
+    }
+  while (!parsing.empty ())
+    {
+      insertNext ();
+    }
+  return count;
+}
+
+// Collects output until there is enough to be worth a write. What is left
+// in it has to be flushed by hand, so a failed write can be reported.
+class OutputBuffer
+{
+private:
+  static constexpr size_t capacity = 1 << 20;
+
+  std::ostream &out;
+  std::unique_ptr<char[]> data;
+  size_t used;
+
+public:
+  OutputBuffer (std::ostream &out)
+      : out (out), data (std::make_unique<char[]> (capacity)), used (0)
+  {
+  }
+
+  void
+  flush ()
+  {
+    out.write (data.get (), used);
+    used = 0;
+  }
+
+  // Room for at least count more characters, count must be under capacity
+  char *
+  reserve (size_t count)
+  {
+    if (capacity - used < count)
+      flush ();
+    return data.get () + used;
+  }
+
+  void
+  commit (char *end)
+  {
+    used = end - data.get ();
+  }
+
+  void
+  put (char c)
+  {
+    *reserve (1) = c;
+    used++;
+  }
+
+  void
+  put (std::string_view text)
+  {
+    if (text.size () >= capacity)
+      {
+        flush ();
+        out.write (text.data (), text.size ());
+        return;
+      }
+    std::memcpy (reserve (text.size ()), text.data (), text.size ());
+    used += text.size ();
+  }
+};
+
+bool
+Csv::needsQuotes (std::string_view text, char separator)
+{
+  if (text.empty () || text == "true" || text == "false")
+    return true;
+  size_t digit = text[0] == '-' ? 1 : 0;
+  if (digit < text.size () && isdigit (text[digit]))
+    return true;
+  for (char c : text)
+    {
+      if (c == separator || c == '"' || c == '\n' || c == '\r')
+        return true;
+    }
+  return false;
+}
+
+void
+Csv::write (std::ostream &out, Grid &grid, char separator)
+{
+  OutputBuffer buffer (out);
+  // Where the last cell written was, rows before the first cell still need
+  // their empty lines.
+  int row = 0;
+  int col = -1;
+  grid.forEachCell ([&] (int cell_row, int cell_col,
+                         std::shared_ptr<Cell> &cell) {
+    const Value &value = cell->getValue ();
+    if (value.isEmpty ())
+      {
+        return;
+      }
+    for (; row < cell_row; row++)
+      {
+        buffer.put ('\n');
+        col = -1;
+      }
+    for (int j = std::max (col, 0); j < cell_col; j++)
+      {
+        buffer.put (separator);
+      }
+    col = cell_col;
+
+    // Enough for any number, and an address with its quotes
+    constexpr size_t number = 64;
+    char *start;
+    switch (value.getType ())
+      {
+      case ValueType::INTEGER:
+        start = buffer.reserve (number);
+        buffer.commit (
+            std::to_chars (start, start + number, value.getInt ()).ptr);
+        break;
+      case ValueType::FLOAT:
+        start = buffer.reserve (number);
+        buffer.commit (std::to_chars (start, start + number,
+                                      value.getFloat (),
+                                      std::chars_format::fixed, 2)
+                           .ptr);
+        break;
+      case ValueType::BOOLEAN:
+        buffer.put (value.getBool () ? "true" : "false");
+        break;
+      case ValueType::CELLADDRESS:
+        {
+          // Always quoted, "[row, col]" has a comma in it
+          start = buffer.reserve (number);
+          char *end = start;
+          *end++ = '"';
+          *end++ = '[';
+          end = std::to_chars (end, start + number, value.getRow ()).ptr;
+          *end++ = ',';
+          *end++ = ' ';
+          end = std::to_chars (end, start + number, value.getCol ()).ptr;
+          *end++ = ']';
+          *end++ = '"';
+          buffer.commit (end);
+          break;
+        }
+      case ValueType::STRING:
+        {
+          std::string_view text = value.getString ();
+          if (!needsQuotes (text, separator))
+            {
+              buffer.put (text);
+              break;
+            }
+          buffer.put ('"');
+          size_t quote;
+          while ((quote = text.find ('"')) != std::string_view::npos)
+            {
+              buffer.put (text.substr (0, quote + 1));
+              buffer.put ('"');
+              text.remove_prefix (quote + 1);
+            }
+          buffer.put (text);
+          buffer.put ('"');
+          break;
+        }
+      case ValueType::EMPTY:
+        break;
+      }
+  });
+  if (col >= 0)
+    {
+      buffer.put ('\n');
+    }
+  buffer.flush ();
+  out.flush ();
+  if (out.fail ())
+    {
+      throw std::runtime_error ("Can't write exported values");
+    }
+}
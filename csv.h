@@ -0,0 +1,87 @@
+#ifndef csv_H
+#define csv_H
+
+#include "grid.h"
+#include "value.h"
+#include <cstddef>
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+/* Csv imports comma or tab separated data into a Grid, one record per row
+ * starting at row 0, column 0, and exports the values of a Grid the same
+ * way. Fields are quoted the usual way, with "" for a quote inside a quoted
+ * field.
+ *
+ * The input is read a chunk at a time and each chunk is split after the
+ * last record that ends in it, so every chunk can be parsed on its own
+ * thread. Parsed chunks are inserted into the grid in order on the calling
+ * thread, and no more than a few chunks per thread are held at once, so
+ * memory stays the same however large the input is.
+ *
+ * Fields are stored as literal cells without going through the Lexer and
+ * Parser. Whole numbers become Integers and other numbers Floats, true and
+ * false become Booleans, and everything else (including anything quoted)
+ * becomes a String. Empty fields leave their cell empty.
+ *
+ * Exporting writes every row up to the last populated one, each up to its
+ * last populated cell, with empty fields for empty cells. Values are
+ * formatted straight into a large buffer that is written out whenever it
+ * fills, Floats with 2 decimals the same as Value::serialize. Strings are
+ * quoted when they would otherwise read back as something else.
+ */
+class Csv
+{
+private:
+  static constexpr size_t chunk_size = 4 << 20;
+
+  struct Field
+  {
+    int row;
+    int col;
+    std::string src;
+    Value value;
+  };
+
+  // What a chunk parses to, rows are counted from the start of the chunk
+  struct Chunk
+  {
+    std::vector<Field> fields;
+    int rows = 0;
+  };
+
+  // Where recordEnd is in text that is still being read. Quotes are
+  // followed the same way parse does, a quote only opens a field at its
+  // start.
+  struct Scan
+  {
+    enum State
+    {
+      FIELD_START,
+      UNQUOTED,
+      QUOTED,
+      CLOSING_QUOTE // A quote in a quoted field, closing it or doubled
+    };
+    State state = FIELD_START;
+    size_t next = 0;
+  };
+
+  static size_t recordEnd (std::string_view text, char separator,
+                           Scan &scan);
+  static Chunk parse (std::string_view text, char separator);
+  static void addField (Chunk &chunk, int col, std::string_view text,
+                        bool quoted);
+  static bool needsQuotes (std::string_view text, char separator);
+
+public:
+  // Returns the number of cells imported. threads is the number of chunks
+  // parsed at once, 0 for one per core. The cells are not recalculated,
+  // call updateGrid when the import is done.
+  static size_t import (std::istream &in, Grid &grid, char separator = ',',
+                        unsigned threads = 0);
+  // Throws runtime_error if out fails, out is flushed before returning
+  static void write (std::ostream &out, Grid &grid, char separator = ',');
+};
+
+#endif
@@ -0,0 +1,379 @@
+#include "dependency.h"
+#include <algorithm>
+#include <deque>
+#include <functional>
+#include <queue>
+
+void
+DependencyGraph::removeFrom (std::vector<uint64_t> &list, uint64_t key)
+{
+  auto found = std::find (list.begin (), list.end (), key);
+  if (found != list.end ())
+    {
+      *found = list.back ();
+      list.pop_back ();
+    }
+}
+
+void
+DependencyGraph::removeCell (int row, int col)
+{
+  uint64_t key = cellKey (row, col);
+  auto found = precedents.find (key);
+  if (found == precedents.end ())
+    {
+      return;
+    }
+
+  for (CellRange &range : found->second)
+    {
+      if (range.isEverything ())
+        {
+          auto volatile_cell = std::lower_bound (volatiles.begin (),
+                                                 volatiles.end (), key);
+          if (volatile_cell != volatiles.end () && *volatile_cell == key)
+            volatiles.erase (volatile_cell);
+        }
+      else if (range.top == range.bottom && range.left == range.right)
+        {
+          uint64_t target = cellKey (range.top, range.left);
+          removeFrom (singles[target], key);
+          if (singles[target].empty ())
+            singles.erase (target);
+        }
+      else if (range.right / band_cols - range.left / band_cols >= max_bands)
+        {
+          removeFrom (wide, key);
+        }
+      else
+        {
+          for (int band = range.left / band_cols;
+               band <= range.right / band_cols; band++)
+            {
+              removeFrom (bands[band], key);
+              if (bands[band].empty ())
+                bands.erase (band);
+            }
+        }
+    }
+  precedents.erase (found);
+}
+
+const std::vector<CellRange> *
+DependencyGraph::precedentsOf (int row, int col)
+{
+  auto found = precedents.find (cellKey (row, col));
+  return found != precedents.end () ? &found->second : nullptr;
+}
+
+void
+DependencyGraph::setPrecedents (int row, int col,
+                                std::vector<CellRange> references)
+{
+  removeCell (row, col);
+  if (references.empty ())
+    {
+      return;
+    }
+
+  uint64_t key = cellKey (row, col);
+  for (CellRange &range : references)
+    {
+      if (range.isEverything ())
+        {
+          auto volatile_cell = std::lower_bound (volatiles.begin (),
+                                                 volatiles.end (), key);
+          if (volatile_cell == volatiles.end () || *volatile_cell != key)
+            volatiles.insert (volatile_cell, key);
+        }
+      else if (range.top == range.bottom && range.left == range.right)
+        {
+          singles[cellKey (range.top, range.left)].push_back (key);
+        }
+      else if (range.right / band_cols - range.left / band_cols >= max_bands)
+        {
+          wide.push_back (key);
+        }
+      else
+        {
+          for (int band = range.left / band_cols;
+               band <= range.right / band_cols; band++)
+            {
+              bands[band].push_back (key);
+            }
+        }
+    }
+  precedents[key] = std::move (references);
+}
+
+void
+DependencyGraph::dependentsOf (int row, int col, std::vector<uint64_t> &out)
+{
+  size_t first = out.size ();
+
+  auto single = singles.find (cellKey (row, col));
+  if (single != singles.end ())
+    {
+      out.insert (out.end (), single->second.begin (), single->second.end ());
+    }
+
+  // Only ranges that actually cover the cell count, a bucket just narrows
+  // down which ranges need to be checked.
+  auto checkRanges = [&] (std::vector<uint64_t> &candidates) {
+    for (uint64_t dependent : candidates)
+      {
+        for (CellRange &range : precedents[dependent])
+          {
+            if (!range.isEverything () && range.contains (row, col))
+              {
+                out.push_back (dependent);
+                break;
+              }
+          }
+      }
+  };
+  auto band = bands.find (col / band_cols);
+  if (band != bands.end ())
+    {
+      checkRanges (band->second);
+    }
+  checkRanges (wide);
+
+  std::sort (out.begin () + first, out.end ());
+  out.erase (std::unique (out.begin () + first, out.end ()), out.end ());
+}
+
+Recalculation
+DependencyGraph::recalculationOrder (const std::vector<uint64_t> &roots)
+{
+  if (volatiles.empty ())
+    {
+      return order (roots, {});
+    }
+
+  // The volatile cells and what depends on them are taken out and ordered
+  // on their own after the rest. Nothing in the rest reads them, so none of
+  // it has to wait for them and no edge runs from them back into it.
+  std::unordered_set<uint64_t> late (volatiles.begin (), volatiles.end ());
+  std::unordered_map<uint64_t, std::vector<uint64_t> > edges;
+  std::unordered_map<uint64_t, int> incoming;
+  std::vector<uint64_t> queue (volatiles);
+  while (!queue.empty ())
+    {
+      uint64_t key = queue.back ();
+      queue.pop_back ();
+      std::vector<uint64_t> &out = edges[key];
+      dependentsOf (keyRow (key), keyCol (key), out);
+      for (uint64_t dependent : out)
+        {
+          if (late.insert (dependent).second)
+            queue.push_back (dependent);
+          incoming[dependent]++;
+        }
+    }
+
+  Recalculation result = order (roots, late);
+  size_t offset = result.order.size ();
+
+  // A volatile cell may read any of the others, so they are evaluated one
+  // at a time in row-major order, as far as the cells they read allow. Keys
+  // sort row-major.
+  std::priority_queue<uint64_t, std::vector<uint64_t>, std::greater<> > next;
+  for (uint64_t key : late)
+    {
+      if (incoming[key] == 0)
+        next.push (key);
+    }
+  while (!next.empty ())
+    {
+      uint64_t key = next.top ();
+      next.pop ();
+      result.order.push_back (key);
+      for (uint64_t dependent : edges[key])
+        {
+          if (--incoming[dependent] == 0)
+            next.push (dependent);
+        }
+    }
+  if (result.order.size () - offset < late.size ())
+    {
+      // There is a cycle among them, which only the full ordering handles
+      Recalculation after = order (volatiles, {});
+      result.order.resize (offset);
+      result.order.insert (result.order.end (), after.order.begin (),
+                           after.order.end ());
+      for (auto &[first, last] : after.cycles)
+        {
+          result.cycles.push_back ({ first + offset, last + offset });
+        }
+    }
+  return result;
+}
+
+Recalculation
+DependencyGraph::order (const std::vector<uint64_t> &roots,
+                        const std::unordered_set<uint64_t> &late)
+{
+  // Breadth first search for everything affected, remembering the edges so
+  // they don't need to be looked up a second time.
+  std::unordered_map<uint64_t, std::vector<uint64_t> > edges;
+  std::unordered_map<uint64_t, int> incoming;
+  std::deque<uint64_t> queue;
+  std::vector<uint64_t> visited;
+
+  for (uint64_t root : roots)
+    {
+      if (!late.count (root) && incoming.emplace (root, 0).second)
+        {
+          queue.push_back (root);
+          visited.push_back (root);
+        }
+    }
+  while (!queue.empty ())
+    {
+      uint64_t key = queue.front ();
+      queue.pop_front ();
+      std::vector<uint64_t> &out = edges[key];
+      dependentsOf (keyRow (key), keyCol (key), out);
+      if (!late.empty ())
+        {
+          std::erase_if (out, [&] (uint64_t dependent) {
+            return late.count (dependent) > 0;
+          });
+        }
+      for (uint64_t dependent : out)
+        {
+          if (incoming.emplace (dependent, 0).second)
+            {
+              queue.push_back (dependent);
+              visited.push_back (dependent);
+            }
+          incoming[dependent]++;
+        }
+    }
+
+  // Kahn's algorithm over the affected cells only
+  Recalculation result;
+  std::vector<uint64_t> &order = result.order;
+  order.reserve (visited.size ());
+  for (uint64_t key : visited)
+    {
+      if (incoming[key] == 0)
+        order.push_back (key);
+    }
+  // Kahn's queue holds one level at a time. A cell is only queued once the
+  // last cell it reads has been taken off, so each level's cells are all
+  // queued while the level before it is taken off.
+  result.levels.push_back (0);
+  size_t level_end = order.size ();
+  for (size_t i = 0; i < order.size (); i++)
+    {
+      if (i == level_end)
+        {
+          result.levels.push_back (i);
+          level_end = order.size ();
+        }
+      for (uint64_t dependent : edges[order[i]])
+        {
+          if (--incoming[dependent] == 0)
+            order.push_back (dependent);
+        }
+    }
+  result.levels.push_back (order.size ());
+  if (order.size () == visited.size ())
+    {
+      return result;
+    }
+
+  // What is left is in a cycle or reads from one. Tarjan's algorithm splits
+  // it into strongly connected components, which come out with dependents
+  // before the cells they read. It is written with an explicit stack since a
+  // long chain hanging off a cycle would overflow the call stack.
+  struct Frame
+  {
+    uint64_t key;
+    size_t edge;
+  };
+  std::unordered_map<uint64_t, int> index;
+  std::unordered_map<uint64_t, int> lowlink;
+  std::unordered_set<uint64_t> on_stack;
+  std::vector<uint64_t> stack;
+  std::vector<Frame> frames;
+  std::vector<std::vector<uint64_t> > components;
+  int counter = 0;
+
+  for (uint64_t start : visited)
+    {
+      if (incoming[start] == 0 || index.count (start))
+        continue;
+      frames.push_back ({ start, 0 });
+      index[start] = lowlink[start] = counter++;
+      stack.push_back (start);
+      on_stack.insert (start);
+
+      while (!frames.empty ())
+        {
+          Frame &frame = frames.back ();
+          std::vector<uint64_t> &out = edges[frame.key];
+          if (frame.edge < out.size ())
+            {
+              uint64_t next = out[frame.edge++];
+              if (incoming[next] == 0)
+                continue; // Already ordered
+              if (!index.count (next))
+                {
+                  index[next] = lowlink[next] = counter++;
+                  stack.push_back (next);
+                  on_stack.insert (next);
+                  frames.push_back ({ next, 0 });
+                }
+              else if (on_stack.count (next))
+                {
+                  lowlink[frame.key]
+                      = std::min (lowlink[frame.key], index[next]);
+                }
+              continue;
+            }
+
+          uint64_t key = frame.key;
+          frames.pop_back ();
+          if (!frames.empty ())
+            {
+              uint64_t parent = frames.back ().key;
+              lowlink[parent] = std::min (lowlink[parent], lowlink[key]);
+            }
+          if (lowlink[key] == index[key])
+            {
+              std::vector<uint64_t> component;
+              uint64_t member;
+              do
+                {
+                  member = stack.back ();
+                  stack.pop_back ();
+                  on_stack.erase (member);
+                  component.push_back (member);
+                }
+              while (member != key);
+              components.push_back (std::move (component));
+            }
+        }
+    }
+
+  for (auto component = components.rbegin (); component != components.rend ();
+       component++)
+    {
+      uint64_t first = component->front ();
+      std::vector<uint64_t> &out = edges[first];
+      // A single cell is only a cycle if it reads itself
+      bool cycle
+          = component->size () > 1
+            || std::find (out.begin (), out.end (), first) != out.end ();
+      if (cycle)
+        {
+          result.cycles.push_back (
+              { order.size (), order.size () + component->size () });
+        }
+      order.insert (order.end (), component->begin (), component->end ());
+    }
+  return result;
+}
@@ -0,0 +1,129 @@
+#ifndef dependency_H
+#define dependency_H
+
+#include <climits>
+#include <cstddef>
+#include <cstdint>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+// Packs a cell position into a single key for hashing.
+inline uint64_t
+cellKey (int row, int col)
+{
+  return (static_cast<uint64_t> (static_cast<uint32_t> (row)) << 32)
+         | static_cast<uint32_t> (col);
+}
+
+inline int
+keyRow (uint64_t key)
+{
+  return static_cast<int> (key >> 32);
+}
+
+inline int
+keyCol (uint64_t key)
+{
+  return static_cast<int> (key & 0xffffffff);
+}
+
+// An inclusive rectangle of cells that an expression reads from.
+struct CellRange
+{
+  int top;
+  int left;
+  int bottom;
+  int right;
+
+  bool
+  contains (int row, int col) const
+  {
+    return row >= top && row <= bottom && col >= left && col <= right;
+  }
+
+  // Used when the cells read can only be known by evaluating, such as
+  // #[x, 0]. A cell that reads this is volatile, see DependencyGraph.
+  static CellRange
+  everything ()
+  {
+    return { 0, 0, INT_MAX, INT_MAX };
+  }
+
+  bool
+  isEverything () const
+  {
+    return top == 0 && left == 0 && bottom == INT_MAX && right == INT_MAX;
+  }
+};
+
+// The cells to recalculate after an edit, in the order to evaluate them.
+// Cells that read each other in a cycle have no such order, each cycle is a
+// contiguous [first, last) span of order and the cells after it only read
+// it once the whole cycle has been dealt with.
+//
+// order starts with the cells that neither are in a cycle nor read one,
+// grouped into levels. No cell reads another of its own level, only cells
+// of earlier levels, so the cells of a level can be evaluated in any order
+// or all at once. Level k is [levels[k], levels[k + 1]) of order and the
+// last entry of levels is where the cells that have to be evaluated one at
+// a time begin. Those are the cells that involve cycles, then the volatile
+// cells and the cells that read them.
+struct Recalculation
+{
+  std::vector<uint64_t> order;
+  std::vector<std::pair<size_t, size_t> > cycles;
+  std::vector<size_t> levels;
+};
+
+/* DependencyGraph records which cells each formula reads (its precedents)
+ * and answers the reverse question, which formulas read a given cell (its
+ * dependents). Single cell references are looked up directly, ranges are
+ * bucketed by the columns they cover so only nearby ranges are checked.
+ *
+ * A cell with a computed address, one that reads CellRange::everything (),
+ * is volatile. It could read any cell, so it is recalculated after every
+ * edit, once everything else has been. Reading everything doesn't make it
+ * a dependent of any cell, not even itself, so it is only in a cycle
+ * through the addresses it has that are literals.
+ */
+class DependencyGraph
+{
+private:
+  // Number of columns in a bucket for range lookups
+  static constexpr int band_cols = 64;
+  // Ranges wider than this many buckets are kept in one list instead
+  static constexpr int max_bands = 16;
+
+  std::unordered_map<uint64_t, std::vector<CellRange> > precedents;
+  std::unordered_map<uint64_t, std::vector<uint64_t> > singles;
+  std::unordered_map<int, std::vector<uint64_t> > bands;
+  std::vector<uint64_t> wide;
+  // Sorted, so volatile cells are recalculated in row-major order
+  std::vector<uint64_t> volatiles;
+
+  static void removeFrom (std::vector<uint64_t> &list, uint64_t key);
+  // recalculationOrder for the cells that aren't in late, late are left
+  // out along with everything that depends on them
+  Recalculation order (const std::vector<uint64_t> &roots,
+                       const std::unordered_set<uint64_t> &late);
+
+public:
+  // Replaces whatever the cell used to read with references
+  void setPrecedents (int row, int col, std::vector<CellRange> references);
+  void removeCell (int row, int col);
+  // What the cell reads, null if it reads nothing
+  const std::vector<CellRange> *precedentsOf (int row, int col);
+
+  // Appends every cell that reads (row, col), without duplicates
+  void dependentsOf (int row, int col, std::vector<uint64_t> &out);
+
+  // Returns the roots and everything that transitively depends on them,
+  // with every cell after the cells it reads. Cycles and levels are found
+  // here, at no extra cost when there are no cycles. Volatile cells and
+  // what depends on them come last whatever the roots are.
+  Recalculation recalculationOrder (const std::vector<uint64_t> &roots);
+};
+
+#endif
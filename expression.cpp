@@ -7,12 +7,467 @@
  */
 
 #include "expression.h"
-#include <cmath>
+#include "arena.h"
+#include "compiler.h"
+#include "kernels.h"
+#include "operations.h"
+#include "optimizer.h"
 #include <format>
 #include <memory>
 
+void *
+Expression::operator new (size_t size)
+{
+  return Arena::allocate (size);
+}
+
+void
+Expression::operator delete (void *node)
+{
+  Arena::release (node);
+}
+
+//--------------- References -------------------
+// Every expression reports the cells it reads so the grid can work out what
+// to recalculate. Literal addresses give exact cells, anything computed at
+// runtime could be any cell in the sheet.
+
+void
+Expression::collectReferences (std::vector<CellRange> &references,
+                               int row, int col)
+{
+}
+
+void
+BinaryOperation::collectReferences (std::vector<CellRange> &references,
+                                    int row, int col)
+{
+  left->collectReferences (references, row, col);
+  right->collectReferences (references, row, col);
+}
+
+// True (with the value) for an operand of an address known without
+// evaluating it, an Integer literal or an Offset from the cell at (row, col)
+static bool
+literalIndex (Expression *exp, int row, int col, int &val)
+{
+  Integer *integer = dynamic_cast<Integer *> (exp);
+  if (integer != nullptr)
+    {
+      val = integer->getVal ();
+      return true;
+    }
+  Offset *offset = dynamic_cast<Offset *> (exp);
+  if (offset != nullptr)
+    {
+      val = offset->resolve (row, col);
+      return true;
+    }
+  return false;
+}
+
+bool
+BinaryOperation::literalOperands (int row, int col, int &leftVal,
+                                  int &rightVal)
+{
+  return literalIndex (left.get (), row, col, leftVal)
+         && literalIndex (right.get (), row, col, rightVal);
+}
+
+void
+UnaryOperation::collectReferences (std::vector<CellRange> &references,
+                                   int row, int col)
+{
+  exp->collectReferences (references, row, col);
+}
+
+// True (with the row and column) for an address known without evaluating
+// it in the cell at (row, col), either an LValue of literal operands or one
+// already folded into a CellAddress
+static bool
+literalAddress (Expression *exp, int row, int col, int &addressRow,
+                int &addressCol)
+{
+  CellAddress *address = dynamic_cast<CellAddress *> (exp);
+  if (address != nullptr)
+    {
+      addressRow = address->getRow ();
+      addressCol = address->getCol ();
+      return true;
+    }
+  LValue *lvalue = dynamic_cast<LValue *> (exp);
+  return lvalue != nullptr
+         && lvalue->literalOperands (row, col, addressRow, addressCol);
+}
+
+// Shared by the statistical functions and for loops, which all read the
+// rectangle between two addresses.
+static void
+collectRange (Expression *topLeft, Expression *bottomRight,
+              std::vector<CellRange> &references, int row, int col)
+{
+  topLeft->collectReferences (references, row, col);
+  bottomRight->collectReferences (references, row, col);
+
+  int top, left, bottom, right;
+  if (literalAddress (topLeft, row, col, top, left)
+      && literalAddress (bottomRight, row, col, bottom, right))
+    {
+      references.push_back ({ top, left, bottom, right });
+    }
+  else
+    {
+      references.push_back (CellRange::everything ());
+    }
+}
+
+//--------------- Effects -------------------
+// Most expressions only have the effects of their operands. Reading a cell,
+// reading a variable, assigning one, and an Offset are where effects come
+// from.
+
+unsigned
+Expression::effects ()
+{
+  return NO_EFFECTS;
+}
+
+unsigned
+BinaryOperation::effects ()
+{
+  return left->effects () | right->effects ();
+}
+
+unsigned
+UnaryOperation::effects ()
+{
+  return exp->effects ();
+}
+
+unsigned
+RValue::effects ()
+{
+  return READS_CELLS | BinaryOperation::effects ();
+}
+
+unsigned
+Max::effects ()
+{
+  return READS_CELLS | BinaryOperation::effects ();
+}
+
+unsigned
+Min::effects ()
+{
+  return READS_CELLS | BinaryOperation::effects ();
+}
+
+unsigned
+Mean::effects ()
+{
+  return READS_CELLS | BinaryOperation::effects ();
+}
+
+unsigned
+Sum::effects ()
+{
+  return READS_CELLS | BinaryOperation::effects ();
+}
+
+unsigned
+Block::effects ()
+{
+  unsigned ret = NO_EFFECTS;
+  for (std::unique_ptr<Expression> &statement : statements)
+    {
+      ret |= statement->effects ();
+    }
+  return ret;
+}
+
+unsigned
+Variable::effects ()
+{
+  return READS_VARIABLES;
+}
+
+// The variable being assigned isn't read
+unsigned
+Assignment::effects ()
+{
+  return WRITES_VARIABLES | right->effects ();
+}
+
+unsigned
+IfExpr::effects ()
+{
+  return condition->effects () | ifTrue->effects () | ifFalse->effects ();
+}
+
+// The loop assigns its variable each time it reads the next cell
+unsigned
+ForExpr::effects ()
+{
+  return READS_CELLS | WRITES_VARIABLES | left->effects ()
+         | right->effects () | block->effects ();
+}
+
+//--------------- Optimization -------------------
+// See optimizer.h, which walks the tree with forEachOperand. Folding
+// constants is done there for every expression, what is left here are the
+// identities that hold for particular operators. They only apply when the
+// static types show the operand already has the type the operator would
+// have evaluated to.
+
+void
+Expression::forEachOperand (const OperandFunction &f)
+{
+}
+
+std::unique_ptr<Expression>
+Expression::simplify ()
+{
+  return nullptr;
+}
+
+void
+BinaryOperation::forEachOperand (const OperandFunction &f)
+{
+  f (left);
+  f (right);
+}
+
+void
+UnaryOperation::forEachOperand (const OperandFunction &f)
+{
+  f (exp);
+}
+
+void
+Block::forEachOperand (const OperandFunction &f)
+{
+  for (std::unique_ptr<Expression> &statement : statements)
+    {
+      f (statement);
+    }
+}
+
+void
+IfExpr::forEachOperand (const OperandFunction &f)
+{
+  f (condition);
+  f (ifTrue);
+  f (ifFalse);
+}
+
+// The loop variable is only ever assigned, it isn't an operand
+void
+ForExpr::forEachOperand (const OperandFunction &f)
+{
+  f (left);
+  f (right);
+  f (block);
+}
+
+// True if exp is an Integer or Float literal equal to val
+static bool
+isLiteral (Expression *exp, int val)
+{
+  Integer *integer = dynamic_cast<Integer *> (exp);
+  if (integer != nullptr)
+    {
+      return integer->getVal () == val;
+    }
+  Float *real = dynamic_cast<Float *> (exp);
+  return real != nullptr && real->getVal () == val;
+}
+
+// exp in place of an operation that evaluates to type, if exp is known to
+// evaluate to that type as well
+static std::unique_ptr<Expression>
+sameType (std::unique_ptr<Expression> &exp, ValueType type)
+{
+  if (type == ValueType::EMPTY || exp->staticType () != type)
+    {
+      return nullptr;
+    }
+  return std::move (exp);
+}
+
+// A single statement evaluates the same without the block around it
+std::unique_ptr<Expression>
+Block::simplify ()
+{
+  if (statements.size () != 1)
+    {
+      return nullptr;
+    }
+  return std::move (statements.front ());
+}
+
+// x + 0 and 0 + x. Only for Integers, -0.0 + 0 is 0.0 for Floats.
+std::unique_ptr<Expression>
+Add::simplify ()
+{
+  if (staticType () != ValueType::INTEGER)
+    {
+      return nullptr;
+    }
+  if (isLiteral (right.get (), 0))
+    {
+      return sameType (left, ValueType::INTEGER);
+    }
+  if (isLiteral (left.get (), 0))
+    {
+      return sameType (right, ValueType::INTEGER);
+    }
+  return nullptr;
+}
+
+// x - 0
+std::unique_ptr<Expression>
+Subtract::simplify ()
+{
+  if (isLiteral (right.get (), 0))
+    {
+      return sameType (left, staticType ());
+    }
+  return nullptr;
+}
+
+// x * 1 and 1 * x
+std::unique_ptr<Expression>
+Multiply::simplify ()
+{
+  if (isLiteral (right.get (), 1))
+    {
+      return sameType (left, staticType ());
+    }
+  if (isLiteral (left.get (), 1))
+    {
+      return sameType (right, staticType ());
+    }
+  return nullptr;
+}
+
+// x / 1
+std::unique_ptr<Expression>
+Divide::simplify ()
+{
+  if (isLiteral (right.get (), 1))
+    {
+      return sameType (left, staticType ());
+    }
+  return nullptr;
+}
+
+// -(-x)
+std::unique_ptr<Expression>
+Negation::simplify ()
+{
+  Negation *inner = dynamic_cast<Negation *> (exp.get ());
+  if (inner == nullptr)
+    {
+      return nullptr;
+    }
+  return sameType (inner->exp, staticType ());
+}
+
+// !!b
+std::unique_ptr<Expression>
+Not::simplify ()
+{
+  Not *inner = dynamic_cast<Not *> (exp.get ());
+  if (inner == nullptr)
+    {
+      return nullptr;
+    }
+  return sameType (inner->exp, ValueType::BOOLEAN);
+}
+
+// ~~x
+std::unique_ptr<Expression>
+BitNot::simplify ()
+{
+  BitNot *inner = dynamic_cast<BitNot *> (exp.get ());
+  if (inner == nullptr)
+    {
+      return nullptr;
+    }
+  return sameType (inner->exp, ValueType::INTEGER);
+}
+
+// Only the branch a literal condition picks is ever evaluated
+std::unique_ptr<Expression>
+IfExpr::simplify ()
+{
+  Boolean *literal = dynamic_cast<Boolean *> (condition.get ());
+  if (literal == nullptr)
+    {
+      return nullptr;
+    }
+  return std::move (literal->getVal () ? ifTrue : ifFalse);
+}
+
+//--------------- Static Types -------------------
+// Known types let the compiler pick instructions for those types. A type is
+// what the expression evaluates to when it evaluates at all, an expression
+// that throws has no value for anything to depend on.
+
+ValueType
+Expression::staticType ()
+{
+  return ValueType::EMPTY;
+}
+
+// Integers stay Integers, any other mix of numbers is a Float
+static ValueType
+arithmeticType (ValueType left, ValueType right)
+{
+  if (left == ValueType::INTEGER && right == ValueType::INTEGER)
+    {
+      return ValueType::INTEGER;
+    }
+  if (isNumericType (left) && isNumericType (right))
+    {
+      return ValueType::FLOAT;
+    }
+  return ValueType::EMPTY;
+}
+
+//--------------- Evaluation -------------------
+
+std::unique_ptr<Primitive>
+Expression::evaluate (EvalContext &context)
+{
+  return evaluateValue (context).toPrimitive ();
+}
+
+// Evaluates the corners of the rectangle used by the statistical functions
+// and for loops.
+static CellRange
+evaluateRange (Expression *topLeft, Expression *bottomRight,
+               EvalContext &context)
+{
+  Value leftAddress = topLeft->evaluateValue (context);
+  return Operations::range (leftAddress, bottomRight->evaluateValue (context));
+}
+
 //--------------- Primitives -------------------
 
+// A primitive is its own value, whatever the context
+void
+Primitive::compile (Compiler &compiler)
+{
+  compiler.constant (toValue ());
+}
+
+ValueType
+Primitive::staticType ()
+{
+  return toValue ().getType ();
+}
+
 // ---------------------Integer
 std::string
 Integer::serialize ()
@@ -20,14 +475,16 @@ Integer::serialize ()
   return std::to_string (val);
 }
 
-std::unique_ptr<Primitive>
-Integer::evaluate (std::shared_ptr<Runtime> runtime)
+Value
+Integer::evaluateValue (EvalContext &context)
+{
+  return toValue ();
+}
+
+Value
+Integer::toValue ()
 {
-  return std::make_unique<Integer> (
-      val, -1,
-      -1); // I considered using default arguments for start and end params,
-           // but I figure the IDE checking would help catch more misuses if I
-           // was declaring these outside evaluate statement
+  return Value::fromInt (val);
 }
 
 int
@@ -43,10 +500,16 @@ Float::serialize ()
   return std::format ("{:.2f}", val);
 }
 
-std::unique_ptr<Primitive>
-Float::evaluate (std::shared_ptr<Runtime> runtime)
+Value
+Float::evaluateValue (EvalContext &context)
+{
+  return toValue ();
+}
+
+Value
+Float::toValue ()
 {
-  return std::make_unique<Float> (val, start, end);
+  return Value::fromFloat (val);
 }
 
 float
@@ -62,10 +525,16 @@ Boolean::serialize ()
   return val ? "true" : "false";
 }
 
-std::unique_ptr<Primitive>
-Boolean::evaluate (std::shared_ptr<Runtime> runtime)
+Value
+Boolean::evaluateValue (EvalContext &context)
 {
-  return std::make_unique<Boolean> (val, start, end);
+  return toValue ();
+}
+
+Value
+Boolean::toValue ()
+{
+  return Value::fromBool (val);
 }
 
 bool
@@ -79,10 +548,16 @@ Boolean::getVal ()
 String::String (std::string val, int start, int end)
     : Primitive (start, end), val (val) {};
 
-std::unique_ptr<Primitive>
-String::evaluate (std::shared_ptr<Runtime> runtime)
+Value
+String::evaluateValue (EvalContext &context)
 {
-  return std::make_unique<String> (val, start, end);
+  return toValue ();
+}
+
+Value
+String::toValue ()
+{
+  return Value::fromString (val);
 }
 
 std::string
@@ -119,10 +594,16 @@ CellAddress::serialize ()
   return std::format ("[{}, {}]", row, col);
 }
 
-std::unique_ptr<Primitive>
-CellAddress::evaluate (std::shared_ptr<Runtime> runtime)
+Value
+CellAddress::evaluateValue (EvalContext &context)
 {
-  return std::make_unique<CellAddress> (row, col, start, end);
+  return toValue ();
+}
+
+Value
+CellAddress::toValue ()
+{
+  return Value::fromAddress (row, col);
 }
 
 // // -------------- Arithmetic Operations --------------------
@@ -139,60 +620,28 @@ Add::serialize ()
   return ret;
 }
 
-std::unique_ptr<Primitive>
-Add::evaluate (std::shared_ptr<Runtime> runtime)
+Value
+Add::evaluateValue (EvalContext &context)
 {
+  Value leftval = left->evaluateValue (context);
+  return Operations::add (leftval, right->evaluateValue (context));
+}
 
-  std::unique_ptr<Primitive> leftprim = left->evaluate (runtime);
-  std::unique_ptr<Primitive> rightprim = right->evaluate (runtime);
-  std::unique_ptr<Primitive> ret;
+void
+Add::compile (Compiler &compiler)
+{
+  compiler.binary (left.get (), right.get (), OpCode::ADD);
+}
 
-  if (typeid (*leftprim) == typeid (Integer)
-      && typeid (*rightprim) == typeid (Integer)) // Integer/Integer case
-    {
-      ret = std::make_unique<Integer> (
-          dynamic_cast<Integer &> (*leftprim).getVal ()
-              + dynamic_cast<Integer &> (*rightprim).getVal (),
-          -1, -1); // Placeholders?
-    }
-  else if (typeid (*leftprim) == typeid (Float)
-           && typeid (*rightprim) == typeid (Float)) // Float/Float case
-    {
-      ret = std::make_unique<Float> (
-          dynamic_cast<Float &> (*leftprim).getVal ()
-              + dynamic_cast<Float &> (*rightprim).getVal (),
-          -1, -1);
-    }
-  else if (typeid (*leftprim) == typeid (Integer)
-           && typeid (*rightprim) == typeid (Float)) // Integer/Float case
-    {
-      ret = std::make_unique<Float> (
-          dynamic_cast<Integer &> (*leftprim).getVal ()
-              + dynamic_cast<Float &> (*rightprim).getVal (),
-          -1, -1);
-    }
-  else if (typeid (*leftprim) == typeid (Float)
-           && typeid (*rightprim) == typeid (Integer)) // Float/Float case
-    {
-      ret = std::make_unique<Float> (
-          dynamic_cast<Float &> (*leftprim).getVal ()
-              + dynamic_cast<Integer &> (*rightprim).getVal (),
-          -1, -1);
-    }
-  else if (typeid (*leftprim) == typeid (String)
-           && typeid (*rightprim) == typeid (String)) // String case
-    {
-      ret = std::make_unique<String> (
-          dynamic_cast<String &> (*leftprim).getVal ()
-              + dynamic_cast<String &> (*rightprim).getVal (),
-          -1, -1);
-    }
-  else
+ValueType
+Add::staticType ()
+{
+  ValueType leftType = left->staticType ();
+  if (leftType == ValueType::STRING && right->staticType () == leftType)
     {
-      throw std::runtime_error ("Unsupported types for Add operation");
+      return ValueType::STRING;
     }
-
-  return ret;
+  return arithmeticType (leftType, right->staticType ());
 }
 
 // ---------------- Subtract
@@ -206,53 +655,23 @@ Subtract::serialize ()
   return ret;
 }
 
-std::unique_ptr<Primitive>
-Subtract::evaluate (std::shared_ptr<Runtime> runtime)
+Value
+Subtract::evaluateValue (EvalContext &context)
 {
-  std::unique_ptr<Primitive> leftprim = left->evaluate (runtime);
-  std::unique_ptr<Primitive> rightprim = right->evaluate (runtime);
-
-  std::unique_ptr<Primitive> ret;
-  // Check both are the same type
+  Value leftval = left->evaluateValue (context);
+  return Operations::subtract (leftval, right->evaluateValue (context));
+}
 
-  if (typeid (*leftprim) == typeid (Integer)
-      && typeid (*rightprim) == typeid (Integer)) // Integer case
-    {
-      ret = std::make_unique<Integer> (
-          dynamic_cast<Integer &> (*leftprim).getVal ()
-              - dynamic_cast<Integer &> (*rightprim).getVal (),
-          -1, -1);
-    }
-  else if (typeid (*leftprim) == typeid (Float)
-           && typeid (*rightprim) == typeid (Float)) // Float case
-    {
-      ret = std::make_unique<Float> (
-          dynamic_cast<Float &> (*leftprim).getVal ()
-              - dynamic_cast<Float &> (*rightprim).getVal (),
-          -1, -1);
-    }
-  else if (typeid (*leftprim) == typeid (Float)
-           && typeid (*rightprim) == typeid (Integer)) // Float/Integer case
-    {
-      ret = std::make_unique<Float> (
-          dynamic_cast<Float &> (*leftprim).getVal ()
-              - dynamic_cast<Integer &> (*rightprim).getVal (),
-          -1, -1);
-    }
-  else if (typeid (*leftprim) == typeid (Integer)
-           && typeid (*rightprim) == typeid (Float)) // Integer/Float case
-    {
-      ret = std::make_unique<Float> (
-          dynamic_cast<Integer &> (*leftprim).getVal ()
-              - dynamic_cast<Float &> (*rightprim).getVal (),
-          -1, -1);
-    }
-  else
-    {
-      throw std::runtime_error ("Unsupported types for Subtract operation");
-    }
+void
+Subtract::compile (Compiler &compiler)
+{
+  compiler.binary (left.get (), right.get (), OpCode::SUBTRACT);
+}
 
-  return ret;
+ValueType
+Subtract::staticType ()
+{
+  return arithmeticType (left->staticType (), right->staticType ());
 }
 
 // ---------------- Multiply
@@ -266,53 +685,23 @@ Multiply::serialize ()
   return ret;
 }
 
-std::unique_ptr<Primitive>
-Multiply::evaluate (std::shared_ptr<Runtime> runtime)
+Value
+Multiply::evaluateValue (EvalContext &context)
 {
+  Value leftval = left->evaluateValue (context);
+  return Operations::multiply (leftval, right->evaluateValue (context));
+}
 
-  std::unique_ptr<Primitive> leftprim = left->evaluate (runtime);
-  std::unique_ptr<Primitive> rightprim = right->evaluate (runtime);
-
-  std::unique_ptr<Primitive> ret;
-
-  if (typeid (*leftprim) == typeid (Integer)
-      && typeid (*rightprim) == typeid (Integer)) // Integer case
-    {
-      ret = std::make_unique<Integer> (
-          dynamic_cast<Integer &> (*leftprim).getVal ()
-              * dynamic_cast<Integer &> (*rightprim).getVal (),
-          -1, -1);
-    }
-  else if (typeid (*leftprim) == typeid (Float)
-           && typeid (*rightprim) == typeid (Float)) // Float case
-    {
-      ret = std::make_unique<Float> (
-          dynamic_cast<Float &> (*leftprim).getVal ()
-              * dynamic_cast<Float &> (*rightprim).getVal (),
-          -1, -1);
-    }
-  else if (typeid (*leftprim) == typeid (Float)
-           && typeid (*rightprim) == typeid (Integer)) // Float/Integer case
-    {
-      ret = std::make_unique<Float> (
-          dynamic_cast<Float &> (*leftprim).getVal ()
-              * dynamic_cast<Integer &> (*rightprim).getVal (),
-          -1, -1);
-    }
-  else if (typeid (*leftprim) == typeid (Integer)
-           && typeid (*rightprim) == typeid (Float)) // Integer/Float case
-    {
-      ret = std::make_unique<Float> (
-          dynamic_cast<Integer &> (*leftprim).getVal ()
-              * dynamic_cast<Float &> (*rightprim).getVal (),
-          -1, -1);
-    }
-  else
-    {
-      throw std::runtime_error ("Unsupported types for Multiply operation");
-    }
+void
+Multiply::compile (Compiler &compiler)
+{
+  compiler.binary (left.get (), right.get (), OpCode::MULTIPLY);
+}
 
-  return ret;
+ValueType
+Multiply::staticType ()
+{
+  return arithmeticType (left->staticType (), right->staticType ());
 }
 
 //-------------------- Divide
@@ -326,70 +715,23 @@ Divide::serialize ()
   return ret;
 }
 
-std::unique_ptr<Primitive>
-Divide::evaluate (std::shared_ptr<Runtime> runtime)
+Value
+Divide::evaluateValue (EvalContext &context)
 {
-  std::unique_ptr<Primitive> leftprim = left->evaluate (runtime);
-  std::unique_ptr<Primitive> rightprim = right->evaluate (runtime);
-
-  std::unique_ptr<Primitive> ret;
-
-  if (typeid (*leftprim) == typeid (Integer)
-      && typeid (*rightprim) == typeid (Integer))
-    { // Integer case, C++ defines integer division as truncation toward
-      // zero, so this works well enough.
-      if (dynamic_cast<Integer &> (*rightprim).getVal () == 0)
-        {
+  Value leftval = left->evaluateValue (context);
+  return Operations::divide (leftval, right->evaluateValue (context));
+}
 
-          throw std::runtime_error ("Division by zero error");
-        }
-      ret = std::make_unique<Integer> (
-          dynamic_cast<Integer &> (*leftprim).getVal ()
-              / dynamic_cast<Integer &> (*rightprim).getVal (),
-          -1, -1);
-    }
-  else if (typeid (*leftprim) == typeid (Float)
-           && typeid (*rightprim) == typeid (Float))
-    { // Float case
-      if (dynamic_cast<Float &> (*rightprim).getVal () == 0.0f)
-        {
-          throw std::runtime_error ("Division by zero error");
-        }
-      ret = std::make_unique<Float> (
-          dynamic_cast<Float &> (*leftprim).getVal ()
-              / dynamic_cast<Float &> (*rightprim).getVal (),
-          -1, -1);
-    }
-  else if (typeid (*leftprim) == typeid (Float)
-           && typeid (*rightprim) == typeid (Integer))
-    { // Float and Integer case
-      if (dynamic_cast<Integer &> (*rightprim).getVal () == 0)
-        {
-          throw std::runtime_error ("Division by zero error");
-        }
-      ret = std::make_unique<Float> (
-          dynamic_cast<Float &> (*leftprim).getVal ()
-              / dynamic_cast<Integer &> (*rightprim).getVal (),
-          -1, -1);
-    }
-  else if (typeid (*leftprim) == typeid (Integer)
-           && typeid (*rightprim) == typeid (Float))
-    { // Integer and Float case
-      if (dynamic_cast<Float &> (*rightprim).getVal () == 0.0f)
-        {
-          throw std::runtime_error ("Division by zero error");
-        }
-      ret = std::make_unique<Float> (
-          dynamic_cast<Integer &> (*leftprim).getVal ()
-              / dynamic_cast<Float &> (*rightprim).getVal (),
-          -1, -1);
-    }
-  else
-    {
-      throw std::runtime_error ("Unsupported types for Divide operation");
-    }
+void
+Divide::compile (Compiler &compiler)
+{
+  compiler.binary (left.get (), right.get (), OpCode::DIVIDE);
+}
 
-  return ret;
+ValueType
+Divide::staticType ()
+{
+  return arithmeticType (left->staticType (), right->staticType ());
 }
 
 //--------------- Modulo
@@ -402,33 +744,23 @@ Modulo::serialize ()
   return ret;
 }
 
-std::unique_ptr<Primitive>
-Modulo::evaluate (std::shared_ptr<Runtime> runtime)
+Value
+Modulo::evaluateValue (EvalContext &context)
 {
-  std::unique_ptr<Primitive> leftprim = left->evaluate (runtime);
-  std::unique_ptr<Primitive> rightprim = right->evaluate (runtime);
-
-  std::unique_ptr<Primitive> ret;
-
-  if (typeid (*leftprim) == typeid (Integer)
-      && typeid (*rightprim) == typeid (Integer)) // Integer case
-    {
-      if (dynamic_cast<Integer &> (*rightprim).getVal () == 0)
-        {
+  Value leftval = left->evaluateValue (context);
+  return Operations::modulo (leftval, right->evaluateValue (context));
+}
 
-          throw std::runtime_error ("Modulo by zero error");
-        }
-      ret = std::make_unique<Integer> (
-          dynamic_cast<Integer &> (*leftprim).getVal ()
-              % dynamic_cast<Integer &> (*rightprim).getVal (),
-          -1, -1);
-    }
-  else
-    {
-      throw std::runtime_error ("Unsupported types for Modulo operation");
-    }
+void
+Modulo::compile (Compiler &compiler)
+{
+  compiler.binary (left.get (), right.get (), OpCode::MODULO);
+}
 
-  return ret;
+ValueType
+Modulo::staticType ()
+{
+  return ValueType::INTEGER;
 }
 
 // -------------- Exponentiation
@@ -441,43 +773,28 @@ Exponentiation::serialize ()
   return ret;
 }
 
-std::unique_ptr<Primitive>
-Exponentiation::evaluate (std::shared_ptr<Runtime> runtime)
+Value
+Exponentiation::evaluateValue (EvalContext &context)
 {
+  Value leftval = left->evaluateValue (context);
+  return Operations::exponentiate (leftval, right->evaluateValue (context));
+}
 
-  std::unique_ptr<Primitive> leftprim = left->evaluate (runtime);
-
-  std::unique_ptr<Primitive> rightprim = right->evaluate (runtime);
-
-  std::unique_ptr<Primitive> ret;
-  if (typeid (*leftprim) != typeid (*rightprim))
-    {
-
-      throw std::runtime_error ("Type mismatch in Exponentiation operation");
-    }
+void
+Exponentiation::compile (Compiler &compiler)
+{
+  compiler.binary (left.get (), right.get (), OpCode::EXPONENTIATE);
+}
 
-  if (typeid (*leftprim) == typeid (Integer)) // Integer case
-    {
-      ret = std::make_unique<Integer> (
-          std::pow (dynamic_cast<Integer &> (*leftprim).getVal (),
-                    dynamic_cast<Integer &> (*rightprim).getVal ()),
-          -1, -1);
-    }
-  else if (typeid (*leftprim) == typeid (Float)) // Float case
-    {
-      ret = std::make_unique<Float> (
-          std::pow (dynamic_cast<Float &> (*leftprim).getVal (),
-                    dynamic_cast<Float &> (*rightprim).getVal ()),
-          -1, -1);
-      return ret;
-    }
-  else
+ValueType
+Exponentiation::staticType ()
+{
+  ValueType leftType = left->staticType ();
+  if (isNumericType (leftType) && right->staticType () == leftType)
     {
-      throw std::runtime_error (
-          "Unsupported types for Exponentiation operation");
+      return leftType;
     }
-
-  return ret;
+  return ValueType::EMPTY;
 }
 
 // -------------- Negation
@@ -489,28 +806,23 @@ Negation::serialize ()
   return std::format ("(-({}))", exp->serialize ());
 }
 
-std::unique_ptr<Primitive>
-Negation::evaluate (std::shared_ptr<Runtime> runtime)
+Value
+Negation::evaluateValue (EvalContext &context)
 {
-  std::unique_ptr<Primitive> prim = exp->evaluate (runtime);
+  return Operations::negate (exp->evaluateValue (context));
+}
 
-  std::unique_ptr<Primitive> ret;
-  if (typeid (*prim) == typeid (Integer)) // Integer case
-    {
-      ret = std::make_unique<Integer> (
-          -dynamic_cast<Integer &> (*prim).getVal (), -1, -1);
-    }
-  else if (typeid (*prim) == typeid (Float)) // Float case
-    {
-      ret = std::make_unique<Float> (-dynamic_cast<Float &> (*prim).getVal (),
-                                     -1, -1);
-    }
-  else
-    {
-      throw std::runtime_error ("Unsupported type for Negation operation");
-    }
+void
+Negation::compile (Compiler &compiler)
+{
+  compiler.unary (exp.get (), OpCode::NEGATE);
+}
 
-  return ret;
+ValueType
+Negation::staticType ()
+{
+  ValueType type = exp->staticType ();
+  return isNumericType (type) ? type : ValueType::EMPTY;
 }
 
 // -------------- Logical Operations --------------------
@@ -523,40 +835,23 @@ And::serialize ()
   return std::format ("({} && {})", left->serialize (), right->serialize ());
 }
 
-std::unique_ptr<Primitive>
-And::evaluate (std::shared_ptr<Runtime> runtime)
+Value
+And::evaluateValue (EvalContext &context)
 {
-  std::unique_ptr<Primitive> leftprim = left->evaluate (runtime);
-  std::unique_ptr<Primitive> rightprim = right->evaluate (runtime);
-
-  if (typeid (*leftprim) == typeid (Boolean))
-    {
-      // Short if left is false
-      if (dynamic_cast<Boolean &> (*leftprim).getVal () == false)
-        {
-          std::unique_ptr<Primitive> ret
-              = std::make_unique<Boolean> (false, -1, -1);
-          return ret;
-        }
+  Value leftval = left->evaluateValue (context);
+  return Operations::logicalAnd (leftval, right->evaluateValue (context));
+}
 
-      if (typeid (*rightprim) == typeid (Boolean))
-        {
-          std::unique_ptr<Primitive> ret = std::make_unique<Boolean> (
-              dynamic_cast<Boolean &> (*leftprim).getVal ()
-                  && dynamic_cast<Boolean &> (*rightprim).getVal (),
-              -1, -1);
-          return ret;
-        }
-      else
-        {
-          throw std::runtime_error ("Unsupported type for And operation");
-        }
-    }
-  else
-    {
+void
+And::compile (Compiler &compiler)
+{
+  compiler.binary (left.get (), right.get (), OpCode::AND);
+}
 
-      throw std::runtime_error ("Unsupported type for And operation");
-    }
+ValueType
+And::staticType ()
+{
+  return ValueType::BOOLEAN;
 }
 
 // --------------- Or
@@ -567,39 +862,23 @@ Or::serialize ()
   return std::format ("({} || {})", left->serialize (), right->serialize ());
 }
 
-std::unique_ptr<Primitive>
-Or::evaluate (std::shared_ptr<Runtime> runtime)
+Value
+Or::evaluateValue (EvalContext &context)
 {
-  std::unique_ptr<Primitive> leftprim = left->evaluate (runtime);
-  std::unique_ptr<Primitive> rightprim = right->evaluate (runtime);
+  Value leftval = left->evaluateValue (context);
+  return Operations::logicalOr (leftval, right->evaluateValue (context));
+}
 
-  if (typeid (*leftprim) == typeid (Boolean))
-    {
-      // Short if left is true
-      if (dynamic_cast<Boolean &> (*leftprim).getVal () == true)
-        {
-          std::unique_ptr<Primitive> ret
-              = std::make_unique<Boolean> (true, -1, -1);
-          return ret;
-        }
-      if (typeid (*rightprim) == typeid (Boolean))
-        {
-          std::unique_ptr<Primitive> ret = std::make_unique<Boolean> (
-              dynamic_cast<Boolean &> (*leftprim).getVal ()
-                  && dynamic_cast<Boolean &> (*rightprim).getVal (),
-              -1, -1);
-          return ret;
-        }
-      else
-        {
-          throw std::runtime_error ("Unsupported type for Or operation");
-        }
-    }
-  else
-    {
+void
+Or::compile (Compiler &compiler)
+{
+  compiler.binary (left.get (), right.get (), OpCode::OR);
+}
 
-      throw std::runtime_error ("Unsupported type for Or operation");
-    }
+ValueType
+Or::staticType ()
+{
+  return ValueType::BOOLEAN;
 }
 
 // -------------- Not
@@ -610,27 +889,59 @@ Not::serialize ()
   return std::format ("!({})", exp->serialize ());
 }
 
-std::unique_ptr<Primitive>
-Not::evaluate (std::shared_ptr<Runtime> runtime)
+Value
+Not::evaluateValue (EvalContext &context)
 {
+  return Operations::logicalNot (exp->evaluateValue (context));
+}
 
-  std::unique_ptr<Primitive> prim = exp->evaluate (runtime);
-  if (typeid (*prim) == typeid (Boolean))
-    {
+void
+Not::compile (Compiler &compiler)
+{
+  compiler.unary (exp.get (), OpCode::NOT);
+}
 
-      std::unique_ptr<Primitive> ret = std::make_unique<Boolean> (
-          !dynamic_cast<Boolean &> (*prim).getVal (), -1, -1);
+ValueType
+Not::staticType ()
+{
+  return ValueType::BOOLEAN;
+}
 
-      return ret;
-    }
-  else
-    {
+//--------------------------- Cell Values --------------------------
+// --------------- Offset
+// Offset is a row or column of a literal address relative to the cell being
+// evaluated. It is never folded, each cell sharing the formula gets its own.
+std::string
+Offset::serialize ()
+{
+  return std::format ("{}{}{}", row ? "row" : "col", offset < 0 ? "" : "+",
+                      offset);
+}
 
-      throw std::runtime_error ("Unsupported types for Not operation");
-    }
+Value
+Offset::evaluateValue (EvalContext &context)
+{
+  return Value::fromInt ((row ? context.row : context.col) + offset);
+}
+
+void
+Offset::compile (Compiler &compiler)
+{
+  compiler.emit (row ? OpCode::ROW : OpCode::COLUMN, offset);
+}
+
+ValueType
+Offset::staticType ()
+{
+  return ValueType::INTEGER;
+}
+
+unsigned
+Offset::effects ()
+{
+  return READS_POSITION;
 }
 
-//--------------------------- Cell Values --------------------------
 // --------------- LValue
 // LValue represents a cell address in the spreadsheet. The difference is that
 // LValue can take expressions for parameters. However, these
@@ -641,27 +952,24 @@ LValue::serialize ()
   return std::format ("[{}, {}]", left->serialize (), right->serialize ());
 }
 
-std::unique_ptr<Primitive>
-LValue::evaluate (std::shared_ptr<Runtime> runtime)
+Value
+LValue::evaluateValue (EvalContext &context)
 {
   // Should be Integers
-  std::unique_ptr<Primitive> rowprim = left->evaluate (runtime);
-  std::unique_ptr<Primitive> colprim = right->evaluate (runtime);
+  Value rowval = left->evaluateValue (context);
+  return Operations::address (rowval, right->evaluateValue (context));
+}
 
-  // Spot on. This is how lvalues are evaluated.
-  if (typeid (*rowprim) == typeid (Integer)
-      && typeid (*colprim) == typeid (Integer))
-    {
-      std::unique_ptr<Primitive> ret = std::make_unique<CellAddress> (
-          dynamic_cast<Integer &> (*rowprim).getVal (),
-          dynamic_cast<Integer &> (*colprim).getVal (), -1, -1);
+void
+LValue::compile (Compiler &compiler)
+{
+  compiler.binary (left.get (), right.get (), OpCode::ADDRESS);
+}
 
-      return ret;
-    }
-  else
-    {
-      throw std::runtime_error ("Unsupported types for LValue");
-    }
+ValueType
+LValue::staticType ()
+{
+  return ValueType::CELLADDRESS;
 }
 
 // ------------- RValue
@@ -672,29 +980,34 @@ RValue::serialize ()
   return std::format ("#[{}, {}]", left->serialize (), right->serialize ());
 }
 
-std::unique_ptr<Primitive>
-RValue::evaluate (std::shared_ptr<Runtime> runtime)
+Value
+RValue::evaluateValue (EvalContext &context)
 {
   // Should be Integers
+  Value rowval = left->evaluateValue (context);
+  return Operations::cell (context.runtime, rowval,
+                           right->evaluateValue (context));
+}
 
-  std::unique_ptr<Primitive> rowVal = left->evaluate (runtime);
-  std::unique_ptr<Primitive> colVal = right->evaluate (runtime);
+void
+RValue::compile (Compiler &compiler)
+{
+  compiler.binary (left.get (), right.get (), OpCode::CELL);
+}
 
-  if (typeid (*rowVal) == typeid (Integer)
-      && typeid (*colVal) == typeid (Integer))
+void
+RValue::collectReferences (std::vector<CellRange> &references,
+                           int row, int col)
+{
+  BinaryOperation::collectReferences (references, row, col);
+  int cellRow, cellCol;
+  if (literalOperands (row, col, cellRow, cellCol))
     {
-      CellAddress address
-          = CellAddress (dynamic_cast<Integer &> (*rowVal).getVal (),
-                         dynamic_cast<Integer &> (*colVal).getVal (), -1,
-                         -1); // -1 is unimportant I think
-      std::unique_ptr<Primitive> cellprim
-          = (runtime->getCell (&address, runtime));
-
-      return cellprim;
+      references.push_back ({ cellRow, cellCol, cellRow, cellCol });
     }
   else
     {
-      throw std::runtime_error ("Unsupported types for RValue");
+      references.push_back (CellRange::everything ());
     }
 }
 
@@ -708,26 +1021,23 @@ BitAnd::serialize ()
   return std::format ("({} & {})", left->serialize (), right->serialize ());
 }
 
-std::unique_ptr<Primitive>
-BitAnd::evaluate (std::shared_ptr<Runtime> runtime)
+Value
+BitAnd::evaluateValue (EvalContext &context)
 {
-  std::unique_ptr<Primitive> leftprim = left->evaluate (runtime);
-  std::unique_ptr<Primitive> rightprim = right->evaluate (runtime);
+  Value leftval = left->evaluateValue (context);
+  return Operations::bitAnd (leftval, right->evaluateValue (context));
+}
 
-  if (typeid (*leftprim) == typeid (Integer)
-      && typeid (*rightprim) == typeid (Integer))
-    {
-      std::unique_ptr<Primitive> ret = std::make_unique<Integer> (
-          dynamic_cast<Integer &> (*leftprim).getVal ()
-              & dynamic_cast<Integer &> (*rightprim).getVal (),
-          -1, -1);
+void
+BitAnd::compile (Compiler &compiler)
+{
+  compiler.binary (left.get (), right.get (), OpCode::BITAND);
+}
 
-      return ret;
-    }
-  else
-    {
-      throw std::runtime_error ("Unsupported types for BitAnd operation");
-    }
+ValueType
+BitAnd::staticType ()
+{
+  return ValueType::INTEGER;
 }
 
 // ---------------- BitOr
@@ -739,26 +1049,23 @@ BitOr::serialize ()
   return std::format ("({} | {})", left->serialize (), right->serialize ());
 }
 
-std::unique_ptr<Primitive>
-BitOr::evaluate (std::shared_ptr<Runtime> runtime)
+Value
+BitOr::evaluateValue (EvalContext &context)
 {
-  std::unique_ptr<Primitive> leftprim = left->evaluate (runtime);
-  std::unique_ptr<Primitive> rightprim = right->evaluate (runtime);
+  Value leftval = left->evaluateValue (context);
+  return Operations::bitOr (leftval, right->evaluateValue (context));
+}
 
-  if (typeid (*leftprim) == typeid (Integer)
-      && typeid (*rightprim) == typeid (Integer))
-    {
-      std::unique_ptr<Primitive> ret = std::make_unique<Integer> (
-          dynamic_cast<Integer &> (*leftprim).getVal ()
-              | dynamic_cast<Integer &> (*rightprim).getVal (),
-          -1, -1);
+void
+BitOr::compile (Compiler &compiler)
+{
+  compiler.binary (left.get (), right.get (), OpCode::BITOR);
+}
 
-      return ret;
-    }
-  else
-    {
-      throw std::runtime_error ("Unsupported types for BitOr operation");
-    }
+ValueType
+BitOr::staticType ()
+{
+  return ValueType::INTEGER;
 }
 
 // ---------------- BitXor
@@ -770,26 +1077,23 @@ BitXor::serialize ()
   return std::format ("({} ^^ {})", left->serialize (), right->serialize ());
 }
 
-std::unique_ptr<Primitive>
-BitXor::evaluate (std::shared_ptr<Runtime> runtime)
+Value
+BitXor::evaluateValue (EvalContext &context)
 {
-  std::unique_ptr<Primitive> leftprim = left->evaluate (runtime);
-  std::unique_ptr<Primitive> rightprim = right->evaluate (runtime);
+  Value leftval = left->evaluateValue (context);
+  return Operations::bitXor (leftval, right->evaluateValue (context));
+}
 
-  if (typeid (*leftprim) == typeid (Integer)
-      && typeid (*rightprim) == typeid (Integer))
-    {
-      std::unique_ptr<Primitive> ret = std::make_unique<Integer> (
-          dynamic_cast<Integer &> (*leftprim).getVal ()
-              ^ dynamic_cast<Integer &> (*rightprim).getVal (),
-          -1, -1);
+void
+BitXor::compile (Compiler &compiler)
+{
+  compiler.binary (left.get (), right.get (), OpCode::BITXOR);
+}
 
-      return ret;
-    }
-  else
-    {
-      throw std::runtime_error ("Unsupported types for BitXor operation");
-    }
+ValueType
+BitXor::staticType ()
+{
+  return ValueType::INTEGER;
 }
 
 // ---------------- BitNot
@@ -800,23 +1104,22 @@ BitNot::serialize ()
   return std::format ("~({})", exp->serialize ());
 }
 
-std::unique_ptr<Primitive>
-BitNot::evaluate (std::shared_ptr<Runtime> runtime)
+Value
+BitNot::evaluateValue (EvalContext &context)
 {
-  std::unique_ptr<Primitive> prim = exp->evaluate (runtime);
-  std::unique_ptr<Primitive> ret;
+  return Operations::bitNot (exp->evaluateValue (context));
+}
 
-  if (typeid (*prim) == typeid (Integer))
-    {
-      ret = std::make_unique<Integer> (
-          ~dynamic_cast<Integer &> (*prim).getVal (), -1, -1);
+void
+BitNot::compile (Compiler &compiler)
+{
+  compiler.unary (exp.get (), OpCode::BITNOT);
+}
 
-      return ret;
-    }
-  else
-    {
-      throw std::runtime_error ("Unsupported types for BitNot operation");
-    }
+ValueType
+BitNot::staticType ()
+{
+  return ValueType::INTEGER;
 }
 
 // ---------------- LeftShift
@@ -828,26 +1131,23 @@ LeftShift::serialize ()
   return std::format ("({} << {})", left->serialize (), right->serialize ());
 }
 
-std::unique_ptr<Primitive>
-LeftShift::evaluate (std::shared_ptr<Runtime> runtime)
+Value
+LeftShift::evaluateValue (EvalContext &context)
 {
-  std::unique_ptr<Primitive> leftprim = left->evaluate (runtime);
-  std::unique_ptr<Primitive> rightprim = right->evaluate (runtime);
+  Value leftval = left->evaluateValue (context);
+  return Operations::leftShift (leftval, right->evaluateValue (context));
+}
 
-  if (typeid (*leftprim) == typeid (Integer)
-      && typeid (*rightprim) == typeid (Integer))
-    {
-      std::unique_ptr<Primitive> ret = std::make_unique<Integer> (
-          dynamic_cast<Integer &> (*leftprim).getVal ()
-              << dynamic_cast<Integer &> (*rightprim).getVal (),
-          -1, -1);
+void
+LeftShift::compile (Compiler &compiler)
+{
+  compiler.binary (left.get (), right.get (), OpCode::LEFTSHIFT);
+}
 
-      return ret;
-    }
-  else
-    {
-      throw std::runtime_error ("Unsupported types for LeftShift operation");
-    }
+ValueType
+LeftShift::staticType ()
+{
+  return ValueType::INTEGER;
 }
 
 // ---------------- RightShift
@@ -859,26 +1159,23 @@ RightShift::serialize ()
   return std::format ("({} >> {})", left->serialize (), right->serialize ());
 }
 
-std::unique_ptr<Primitive>
-RightShift::evaluate (std::shared_ptr<Runtime> runtime)
+Value
+RightShift::evaluateValue (EvalContext &context)
 {
-  std::unique_ptr<Primitive> leftprim = left->evaluate (runtime);
-  std::unique_ptr<Primitive> rightprim = right->evaluate (runtime);
+  Value leftval = left->evaluateValue (context);
+  return Operations::rightShift (leftval, right->evaluateValue (context));
+}
 
-  if (typeid (*leftprim) == typeid (Integer)
-      && typeid (*rightprim) == typeid (Integer))
-    {
-      std::unique_ptr<Primitive> ret = std::make_unique<Integer> (
-          dynamic_cast<Integer &> (*leftprim).getVal ()
-              >> dynamic_cast<Integer &> (*rightprim).getVal (),
-          -1, -1);
+void
+RightShift::compile (Compiler &compiler)
+{
+  compiler.binary (left.get (), right.get (), OpCode::RIGHTSHIFT);
+}
 
-      return ret;
-    }
-  else
-    {
-      throw std::runtime_error ("Unsupported types for RightShift operation");
-    }
+ValueType
+RightShift::staticType ()
+{
+  return ValueType::INTEGER;
 }
 
 //--------------------- Relational Operations --------------------------
@@ -892,53 +1189,23 @@ Equals::serialize ()
   return std::format ("({} == {})", left->serialize (), right->serialize ());
 }
 
-std::unique_ptr<Primitive>
-Equals::evaluate (std::shared_ptr<Runtime> runtime)
+Value
+Equals::evaluateValue (EvalContext &context)
 {
-  std::unique_ptr<Primitive> leftprim = left->evaluate (runtime);
-  std::unique_ptr<Primitive> rightprim = right->evaluate (runtime);
-
-  std::unique_ptr<Primitive> ret;
-
-  if (typeid (*leftprim) != typeid (*rightprim))
-    {
-      throw std::runtime_error ("Type mismatch in Equals operation");
-    }
+  Value leftval = left->evaluateValue (context);
+  return Operations::equals (leftval, right->evaluateValue (context));
+}
 
-  if (typeid (*leftprim) == typeid (Integer))
-    { // Integer Case
-      ret = std::make_unique<Boolean> (
-          dynamic_cast<Integer &> (*leftprim).getVal ()
-              == dynamic_cast<Integer &> (*rightprim).getVal (),
-          -1, -1);
-    }
-  else if (typeid (*leftprim) == typeid (Float))
-    { // Float Case
-      ret = std::make_unique<Boolean> (
-          dynamic_cast<Float &> (*leftprim).getVal ()
-              == dynamic_cast<Float &> (*rightprim).getVal (),
-          -1, -1);
-    }
-  else if (typeid (*leftprim) == typeid (Boolean))
-    { // Boolean Case
-      ret = std::make_unique<Boolean> (
-          dynamic_cast<Boolean &> (*leftprim).getVal ()
-              == dynamic_cast<Boolean &> (*rightprim).getVal (),
-          -1, -1);
-    }
-  else if (typeid (*leftprim) == typeid (String))
-    { // String Case, works because == is the same as .compare for std::string
-      ret = std::make_unique<Boolean> (
-          dynamic_cast<String &> (*leftprim).getVal ()
-              == dynamic_cast<String &> (*rightprim).getVal (),
-          -1, -1);
-    }
-  else
-    {
-      throw std::runtime_error ("Unsupported types for Equals operation");
-    }
+void
+Equals::compile (Compiler &compiler)
+{
+  compiler.binary (left.get (), right.get (), OpCode::EQUALS);
+}
 
-  return ret;
+ValueType
+Equals::staticType ()
+{
+  return ValueType::BOOLEAN;
 }
 
 // ---------------- NotEquals
@@ -951,53 +1218,23 @@ NotEquals::serialize ()
   return std::format ("({} != {})", left->serialize (), right->serialize ());
 }
 
-std::unique_ptr<Primitive>
-NotEquals::evaluate (std::shared_ptr<Runtime> runtime)
+Value
+NotEquals::evaluateValue (EvalContext &context)
 {
-  std::unique_ptr<Primitive> leftprim = left->evaluate (runtime);
-  std::unique_ptr<Primitive> rightprim = right->evaluate (runtime);
-
-  std::unique_ptr<Primitive> ret;
-
-  if (typeid (*leftprim) != typeid (*rightprim))
-    {
-      throw std::runtime_error ("Type mismatch in NotEquals operation");
-    }
+  Value leftval = left->evaluateValue (context);
+  return Operations::notEquals (leftval, right->evaluateValue (context));
+}
 
-  if (typeid (*leftprim) == typeid (Integer))
-    { // Integer Case
-      ret = std::make_unique<Boolean> (
-          dynamic_cast<Integer &> (*leftprim).getVal ()
-              != dynamic_cast<Integer &> (*rightprim).getVal (),
-          -1, -1);
-    }
-  else if (typeid (*leftprim) == typeid (Float))
-    { // Float Case
-      ret = std::make_unique<Boolean> (
-          dynamic_cast<Float &> (*leftprim).getVal ()
-              != dynamic_cast<Float &> (*rightprim).getVal (),
-          -1, -1);
-    }
-  else if (typeid (*leftprim) == typeid (Boolean))
-    { // Boolean Case
-      ret = std::make_unique<Boolean> (
-          dynamic_cast<Boolean &> (*leftprim).getVal ()
-              != dynamic_cast<Boolean &> (*rightprim).getVal (),
-          -1, -1);
-    }
-  else if (typeid (*leftprim) == typeid (String))
-    { // String Case
-      ret = std::make_unique<Boolean> (
-          dynamic_cast<String &> (*leftprim).getVal ()
-              != dynamic_cast<String &> (*rightprim).getVal (),
-          -1, -1);
-    }
-  else
-    {
-      throw std::runtime_error ("Unsupported types for NotEqual operation");
-    }
+void
+NotEquals::compile (Compiler &compiler)
+{
+  compiler.binary (left.get (), right.get (), OpCode::NOTEQUALS);
+}
 
-  return ret;
+ValueType
+NotEquals::staticType ()
+{
+  return ValueType::BOOLEAN;
 }
 
 // ---------------- LessThan
@@ -1010,38 +1247,23 @@ LessThan::serialize ()
   return std::format ("({} < {})", left->serialize (), right->serialize ());
 }
 
-std::unique_ptr<Primitive>
-LessThan::evaluate (std::shared_ptr<Runtime> runtime)
+Value
+LessThan::evaluateValue (EvalContext &context)
 {
-  std::unique_ptr<Primitive> leftprim = left->evaluate (runtime);
-  std::unique_ptr<Primitive> rightprim = right->evaluate (runtime);
-
-  std::unique_ptr<Primitive> ret;
+  Value leftval = left->evaluateValue (context);
+  return Operations::lessThan (leftval, right->evaluateValue (context));
+}
 
-  if (typeid (*leftprim) != typeid (*rightprim))
-    {
-      throw std::runtime_error ("Type mismatch in LessThan operation");
-    }
+void
+LessThan::compile (Compiler &compiler)
+{
+  compiler.binary (left.get (), right.get (), OpCode::LESSTHAN);
+}
 
-  if (typeid (*leftprim) == typeid (Integer))
-    { // Integer Case
-      ret = std::make_unique<Boolean> (
-          dynamic_cast<Integer &> (*leftprim).getVal ()
-              < dynamic_cast<Integer &> (*rightprim).getVal (),
-          -1, -1);
-    }
-  else if (typeid (*leftprim) == typeid (Float))
-    { // Float Case
-      ret = std::make_unique<Boolean> (
-          dynamic_cast<Float &> (*leftprim).getVal ()
-              < dynamic_cast<Float &> (*rightprim).getVal (),
-          -1, -1);
-    }
-  else
-    {
-      throw std::runtime_error ("Unsupported types for LessThan operation");
-    }
-  return ret;
+ValueType
+LessThan::staticType ()
+{
+  return ValueType::BOOLEAN;
 }
 
 // ---------------- LessThanEqual
@@ -1053,40 +1275,23 @@ LessThanEqual::serialize ()
   return std::format ("({} <= {})", left->serialize (), right->serialize ());
 }
 
-std::unique_ptr<Primitive>
-LessThanEqual::evaluate (std::shared_ptr<Runtime> runtime)
+Value
+LessThanEqual::evaluateValue (EvalContext &context)
 {
-  std::unique_ptr<Primitive> leftprim = left->evaluate (runtime);
-  std::unique_ptr<Primitive> rightprim = right->evaluate (runtime);
-
-  std::unique_ptr<Primitive> ret;
-
-  if (typeid (*leftprim) != typeid (*rightprim))
-    {
-      throw std::runtime_error ("Type mismatch in LessThanEqual operation");
-    }
+  Value leftval = left->evaluateValue (context);
+  return Operations::lessThanEqual (leftval, right->evaluateValue (context));
+}
 
-  if (typeid (*leftprim) == typeid (Integer))
-    { // Integer Case
-      ret = std::make_unique<Boolean> (
-          dynamic_cast<Integer &> (*leftprim).getVal ()
-              <= dynamic_cast<Integer &> (*rightprim).getVal (),
-          -1, -1);
-    }
-  else if (typeid (*leftprim) == typeid (Float))
-    { // Float Case
-      ret = std::make_unique<Boolean> (
-          dynamic_cast<Float &> (*leftprim).getVal ()
-              <= dynamic_cast<Float &> (*rightprim).getVal (),
-          -1, -1);
-    }
-  else
-    {
-      throw std::runtime_error (
-          "Unsupported types for LessThanEqual operation");
-    }
+void
+LessThanEqual::compile (Compiler &compiler)
+{
+  compiler.binary (left.get (), right.get (), OpCode::LESSTHANEQUAL);
+}
 
-  return ret;
+ValueType
+LessThanEqual::staticType ()
+{
+  return ValueType::BOOLEAN;
 }
 
 // ---------------- GreaterThan
@@ -1098,39 +1303,23 @@ GreaterThan::serialize ()
   return std::format ("({} > {})", left->serialize (), right->serialize ());
 }
 
-std::unique_ptr<Primitive>
-GreaterThan::evaluate (std::shared_ptr<Runtime> runtime)
+Value
+GreaterThan::evaluateValue (EvalContext &context)
 {
-  std::unique_ptr<Primitive> leftprim = left->evaluate (runtime);
-  std::unique_ptr<Primitive> rightprim = right->evaluate (runtime);
-
-  std::unique_ptr<Primitive> ret;
-
-  if (typeid (*leftprim) != typeid (*rightprim))
-    {
-      throw std::runtime_error ("Type mismatch in GreaterThan operation");
-    }
+  Value leftval = left->evaluateValue (context);
+  return Operations::greaterThan (leftval, right->evaluateValue (context));
+}
 
-  if (typeid (*leftprim) == typeid (Integer))
-    { // Integer Case
-      ret = std::make_unique<Boolean> (
-          dynamic_cast<Integer &> (*leftprim).getVal ()
-              > dynamic_cast<Integer &> (*rightprim).getVal (),
-          -1, -1);
-    }
-  else if (typeid (*leftprim) == typeid (Float))
-    { // Float Case
-      ret = std::make_unique<Boolean> (
-          dynamic_cast<Float &> (*leftprim).getVal ()
-              > dynamic_cast<Float &> (*rightprim).getVal (),
-          -1, -1);
-    }
-  else
-    {
-      throw std::runtime_error ("Unsupported types for GreaterThan operation");
-    }
+void
+GreaterThan::compile (Compiler &compiler)
+{
+  compiler.binary (left.get (), right.get (), OpCode::GREATERTHAN);
+}
 
-  return ret;
+ValueType
+GreaterThan::staticType ()
+{
+  return ValueType::BOOLEAN;
 }
 
 // ---------------- GreaterThanEqual
@@ -1142,39 +1331,24 @@ GreaterThanEqual::serialize ()
   return std::format ("({} >= {})", left->serialize (), right->serialize ());
 }
 
-std::unique_ptr<Primitive>
-GreaterThanEqual::evaluate (std::shared_ptr<Runtime> runtime)
+Value
+GreaterThanEqual::evaluateValue (EvalContext &context)
 {
-  std::unique_ptr<Primitive> leftprim = left->evaluate (runtime);
-  std::unique_ptr<Primitive> rightprim = right->evaluate (runtime);
-
-  std::unique_ptr<Primitive> ret;
+  Value leftval = left->evaluateValue (context);
+  return Operations::greaterThanEqual (leftval,
+                                       right->evaluateValue (context));
+}
 
-  if (typeid (*leftprim) != typeid (*rightprim))
-    {
-      throw std::runtime_error ("Type mismatch in GreaterThanEqual operation");
-    }
+void
+GreaterThanEqual::compile (Compiler &compiler)
+{
+  compiler.binary (left.get (), right.get (), OpCode::GREATERTHANEQUAL);
+}
 
-  if (typeid (*leftprim) == typeid (Integer))
-    { // Integer Case
-      ret = std::make_unique<Boolean> (
-          dynamic_cast<Integer &> (*leftprim).getVal ()
-              >= dynamic_cast<Integer &> (*rightprim).getVal (),
-          -1, -1);
-    }
-  else if (typeid (*leftprim) == typeid (Float))
-    { // Float Case
-      ret = std::make_unique<Boolean> (
-          dynamic_cast<Float &> (*leftprim).getVal ()
-              >= dynamic_cast<Float &> (*rightprim).getVal (),
-          -1, -1);
-    }
-  else
-    {
-      throw std::runtime_error (
-          "Unsupported types for GreaterThanEqual operation");
-    }
-  return ret;
+ValueType
+GreaterThanEqual::staticType ()
+{
+  return ValueType::BOOLEAN;
 }
 
 // --------------------- Casting Operations
@@ -1187,27 +1361,22 @@ FloatToInt::serialize ()
   return std::format ("(int({}))", exp->serialize ());
 }
 
-std::unique_ptr<Primitive>
-FloatToInt::evaluate (std::shared_ptr<Runtime> runtime)
+Value
+FloatToInt::evaluateValue (EvalContext &context)
 {
-  std::unique_ptr<Primitive> prim = exp->evaluate (runtime);
-
-  if (typeid (*prim) == typeid (Float))
-    {
+  return Operations::floatToInt (exp->evaluateValue (context));
+}
 
-      std::unique_ptr<Primitive> ret = std::make_unique<Integer> (
-          static_cast<int> (dynamic_cast<Float &> (*prim).getVal ()), -1, -1);
+void
+FloatToInt::compile (Compiler &compiler)
+{
+  compiler.unary (exp.get (), OpCode::FLOATTOINT);
+}
 
-      return ret;
-    }
-  else if (typeid (*prim) == typeid (Integer))
-    {
-      return prim;
-    }
-  else
-    {
-      throw std::runtime_error ("Unsupported types for FloatToInt operation");
-    }
+ValueType
+FloatToInt::staticType ()
+{
+  return ValueType::INTEGER;
 }
 
 //--------------------- IntToFloat
@@ -1218,29 +1387,22 @@ IntToFloat::serialize ()
   return std::format ("(float({}))", exp->serialize ());
 }
 
-std::unique_ptr<Primitive>
-IntToFloat::evaluate (std::shared_ptr<Runtime> runtime)
+Value
+IntToFloat::evaluateValue (EvalContext &context)
 {
-  std::unique_ptr<Primitive> prim = exp->evaluate (runtime);
-
-  if (typeid (*prim) == typeid (Integer))
-
-    {
+  return Operations::intToFloat (exp->evaluateValue (context));
+}
 
-      std::unique_ptr<Primitive> ret = std::make_unique<Float> (
-          static_cast<float> (dynamic_cast<Integer &> (*prim).getVal ()), -1,
-          -1);
+void
+IntToFloat::compile (Compiler &compiler)
+{
+  compiler.unary (exp.get (), OpCode::INTTOFLOAT);
+}
 
-      return ret;
-    }
-  else if (typeid (*prim) == typeid (Float))
-    {
-      return prim;
-    }
-  else
-    {
-      throw std::runtime_error ("Unsupported types for IntToFloatoperation");
-    }
+ValueType
+IntToFloat::staticType ()
+{
+  return ValueType::FLOAT;
 }
 
 //--------------------- Statistical Functions --------------------------
@@ -1254,77 +1416,30 @@ Max::serialize ()
                       right->serialize ());
 }
 
-std::unique_ptr<Primitive>
-Max::evaluate (std::shared_ptr<Runtime> runtime)
+Value
+Max::evaluateValue (EvalContext &context)
 {
-  // All four stats functions perform a similar traversal.
-  // Consider factoring out some of the grossness to a helper method.
-
-  std::unique_ptr<Primitive> leftAddress = (left->evaluate (runtime));
-  std::unique_ptr<Primitive> rightAddress = (right->evaluate (runtime));
-
-  if (typeid (*leftAddress) != typeid (CellAddress))
-    {
-      throw std::runtime_error ("Invalid left address");
-    }
-
-  if (typeid (*rightAddress) != typeid (CellAddress))
-    {
-      throw std::runtime_error ("Invalid right address");
-    }
-
-  int leftRow = dynamic_cast<CellAddress &> (*leftAddress).getRow ();
-  int leftCol = dynamic_cast<CellAddress &> (*leftAddress).getCol ();
-  int rightRow = dynamic_cast<CellAddress &> (*rightAddress).getRow ();
-  int rightCol = dynamic_cast<CellAddress &> (*rightAddress).getCol ();
-
-  if (leftRow > rightRow || leftCol > rightCol)
-    {
-      throw std::runtime_error (
-          "Cells must be ordered (topLeft, bottomRight)");
-    }
+  return Operations::max (
+      context.runtime, evaluateRange (left.get (), right.get (), context));
+}
 
-  double max = -INFINITY;
+void
+Max::compile (Compiler &compiler)
+{
+  compiler.binary (left.get (), right.get (), OpCode::MAX);
+}
 
-  for (int i = leftRow; i <= rightRow; i++)
-    {
-      for (int j = leftCol; j <= rightCol; j++)
-        {
-          CellAddress address (i, j, -1, -1); // -1 is a placeholder
-
-          std::unique_ptr<Primitive> cellprim
-              = runtime->getCell (&address, runtime);
-          if (cellprim == nullptr || typeid (*cellprim) == typeid (Boolean)
-              || typeid (*cellprim) == typeid (String)
-              || typeid (*cellprim) == typeid (CellAddress))
-            {
-              continue; // Skip empty cells, design choice
-            }
-          else if (typeid (*cellprim) == typeid (Integer))
-            {
-              int val = dynamic_cast<Integer &> (*cellprim).getVal ();
-              if (val > max)
-                {
-                  max = val;
-                }
-            }
-          else if (typeid (*cellprim) == typeid (Float))
-            {
-              double val = dynamic_cast<Float &> (*cellprim).getVal ();
-              if (val > max)
-                {
-                  max = val;
-                }
-            }
-          else
-            {
-              throw std::runtime_error ("Unsupported type in Sum operation "
-                                        "(Supports Integers and Floats)");
-            }
-        }
-    }
+ValueType
+Max::staticType ()
+{
+  return ValueType::FLOAT;
+}
 
-  return std::make_unique<Float> (max, -1, -1);
+void
+Max::collectReferences (std::vector<CellRange> &references,
+                        int row, int col)
+{
+  collectRange (left.get (), right.get (), references, row, col);
 }
 
 //-------------- Min
@@ -1337,74 +1452,30 @@ Min::serialize ()
                       right->serialize ());
 }
 
-std::unique_ptr<Primitive>
-Min::evaluate (std::shared_ptr<Runtime> runtime)
+Value
+Min::evaluateValue (EvalContext &context)
 {
-  std::unique_ptr<Primitive> leftAddress = (left->evaluate (runtime));
-  std::unique_ptr<Primitive> rightAddress = (right->evaluate (runtime));
-
-  if (typeid (*leftAddress) != typeid (CellAddress))
-    {
-      throw std::runtime_error ("Invalid left address");
-    }
-
-  if (typeid (*rightAddress) != typeid (CellAddress))
-    {
-      throw std::runtime_error ("Invalid right address");
-    }
-
-  int leftRow = dynamic_cast<CellAddress &> (*leftAddress).getRow ();
-  int leftCol = dynamic_cast<CellAddress &> (*leftAddress).getCol ();
-  int rightRow = dynamic_cast<CellAddress &> (*rightAddress).getRow ();
-  int rightCol = dynamic_cast<CellAddress &> (*rightAddress).getCol ();
-
-  if (leftRow > rightRow || leftCol > rightCol)
-    {
-      throw std::runtime_error (
-          "Cells must be ordered (topLeft, bottomRight)");
-    }
+  return Operations::min (
+      context.runtime, evaluateRange (left.get (), right.get (), context));
+}
 
-  double min = INFINITY;
+void
+Min::compile (Compiler &compiler)
+{
+  compiler.binary (left.get (), right.get (), OpCode::MIN);
+}
 
-  for (int i = leftRow; i <= rightRow; i++)
-    {
-      for (int j = leftCol; j <= rightCol; j++)
-        {
-          CellAddress address (i, j, -1, -1); // -1 is a placeholder
-
-          std::unique_ptr<Primitive> cellprim
-              = runtime->getCell (&address, runtime);
-          if (cellprim == nullptr || typeid (*cellprim) == typeid (Boolean)
-              || typeid (*cellprim) == typeid (String)
-              || typeid (*cellprim) == typeid (CellAddress)) // DANGER
-            {
-              continue; // Skip empty cells, design choice
-            }
-          else if (typeid (*cellprim) == typeid (Integer))
-            {
-              int val = dynamic_cast<Integer &> (*cellprim).getVal ();
-              if (val < min)
-                {
-                  min = val;
-                }
-            }
-          else if (typeid (*cellprim) == typeid (Float))
-            {
-              double val = dynamic_cast<Float &> (*cellprim).getVal ();
-              if (val < min)
-                {
-                  min = val;
-                }
-            }
-          else
-            {
-              throw std::runtime_error ("Unsupported type in Sum operation "
-                                        "(Supports Integers and Floats)");
-            }
-        }
-    }
+ValueType
+Min::staticType ()
+{
+  return ValueType::FLOAT;
+}
 
-  return std::make_unique<Float> (min, -1, -1);
+void
+Min::collectReferences (std::vector<CellRange> &references,
+                        int row, int col)
+{
+  collectRange (left.get (), right.get (), references, row, col);
 }
 
 //-------------- Mean
@@ -1416,74 +1487,30 @@ Mean::serialize ()
   return std::format ("mean({}, {})", left->serialize (), right->serialize ());
 }
 
-std::unique_ptr<Primitive>
-Mean::evaluate (std::shared_ptr<Runtime> runtime)
+Value
+Mean::evaluateValue (EvalContext &context)
 {
-  std::unique_ptr<Primitive> leftAddress = (left->evaluate (runtime));
-  std::unique_ptr<Primitive> rightAddress = (right->evaluate (runtime));
-
-  if (typeid (*leftAddress) != typeid (CellAddress))
-    {
-      throw std::runtime_error ("Invalid left address");
-    }
-
-  if (typeid (*rightAddress) != typeid (CellAddress))
-    {
-      throw std::runtime_error ("Invalid right address");
-    }
-
-  int leftRow = dynamic_cast<CellAddress &> (*leftAddress).getRow ();
-  int leftCol = dynamic_cast<CellAddress &> (*leftAddress).getCol ();
-  int rightRow = dynamic_cast<CellAddress &> (*rightAddress).getRow ();
-  int rightCol = dynamic_cast<CellAddress &> (*rightAddress).getCol ();
-
-  if (leftRow > rightRow || leftCol > rightCol)
-    {
-      throw std::runtime_error (
-          "Cells must be ordered (topLeft, bottomRight)");
-    }
-
-  int count = 0;
-  double sum = 0;
+  return Operations::mean (
+      context.runtime, evaluateRange (left.get (), right.get (), context));
+}
 
-  for (int i = leftRow; i <= rightRow; i++)
-    {
-      for (int j = leftCol; j <= rightCol; j++)
-        {
-          CellAddress address (i, j, -1, -1); // -1 is a placeholder
-
-          std::unique_ptr<Primitive> cellprim
-              = runtime->getCell (&address, runtime);
-          if (cellprim == nullptr || typeid (*cellprim) == typeid (Boolean)
-              || typeid (*cellprim) == typeid (String)
-              || typeid (*cellprim) == typeid (CellAddress)) // DANGER
-            {
-              continue; // Skip empty cells, design choice
-            }
-          else if (typeid (*cellprim) == typeid (Integer))
-            {
-              count += 1;
-              sum += dynamic_cast<Integer &> (*cellprim).getVal ();
-            }
-          else if (typeid (*cellprim) == typeid (Float))
-            {
-              count += 1;
-              sum += dynamic_cast<Float &> (*cellprim).getVal ();
-            }
-          else
-            {
-              throw std::runtime_error ("Unsupported type in Sum operation "
-                                        "(Supports Integers and Floats)");
-            }
-        }
-    }
+void
+Mean::compile (Compiler &compiler)
+{
+  compiler.binary (left.get (), right.get (), OpCode::MEAN);
+}
 
-  if (count == 0)
-    {
-      return std::make_unique<Float> (0, -1, -1); // Avoid division by zero
-    }
+ValueType
+Mean::staticType ()
+{
+  return ValueType::FLOAT;
+}
 
-  return std::make_unique<Float> (sum / count, -1, -1);
+void
+Mean::collectReferences (std::vector<CellRange> &references,
+                         int row, int col)
+{
+  collectRange (left.get (), right.get (), references, row, col);
 }
 
 //-------------- Sum
@@ -1493,65 +1520,30 @@ Sum::serialize ()
   return std::format ("sum({}, {})", left->serialize (), right->serialize ());
 }
 
-std::unique_ptr<Primitive>
-Sum::evaluate (std::shared_ptr<Runtime> runtime)
+Value
+Sum::evaluateValue (EvalContext &context)
 {
-  double sum = 0;
-
-  std::unique_ptr<Primitive> leftAddress = (left->evaluate (runtime));
-  std::unique_ptr<Primitive> rightAddress = (right->evaluate (runtime));
-
-  if (typeid (*leftAddress) != typeid (CellAddress))
-    {
-      throw std::runtime_error ("Invalid left address");
-    }
-
-  if (typeid (*rightAddress) != typeid (CellAddress))
-    {
-      throw std::runtime_error ("Invalid right address");
-    }
+  return Operations::sum (
+      context.runtime, evaluateRange (left.get (), right.get (), context));
+}
 
-  int leftRow = dynamic_cast<CellAddress &> (*leftAddress).getRow ();
-  int leftCol = dynamic_cast<CellAddress &> (*leftAddress).getCol ();
-  int rightRow = dynamic_cast<CellAddress &> (*rightAddress).getRow ();
-  int rightCol = dynamic_cast<CellAddress &> (*rightAddress).getCol ();
+void
+Sum::compile (Compiler &compiler)
+{
+  compiler.binary (left.get (), right.get (), OpCode::SUM);
+}
 
-  if (leftRow > rightRow || leftCol > rightCol)
-    {
-      throw std::runtime_error (
-          "Cells must be ordered (topLeft, bottomRight)");
-    }
+ValueType
+Sum::staticType ()
+{
+  return ValueType::FLOAT;
+}
 
-  for (int i = leftRow; i <= rightRow; i++)
-    {
-      for (int j = leftCol; j <= rightCol; j++)
-        {
-          CellAddress address (i, j, -1, -1); // -1 is a placeholder
-
-          std::unique_ptr<Primitive> cellprim
-              = runtime->getCell (&address, runtime);
-          if (cellprim == nullptr || typeid (*cellprim) == typeid (Boolean)
-              || typeid (*cellprim) == typeid (String)
-              || typeid (*cellprim) == typeid (CellAddress)) // DANGER
-            {
-              continue; // Skip empty cells, design choice
-            }
-          else if (typeid (*cellprim) == typeid (Integer))
-            {
-              sum += dynamic_cast<Integer &> (*cellprim).getVal ();
-            }
-          else if (typeid (*cellprim) == typeid (Float))
-            {
-              sum += dynamic_cast<Float &> (*cellprim).getVal ();
-            }
-          else
-            {
-              throw std::runtime_error ("Unsupported type in Sum operation "
-                                        "(Supports Integers and Floats)");
-            }
-        }
-    }
-  return std::make_unique<Float> (sum, -1, -1);
+void
+Sum::collectReferences (std::vector<CellRange> &references,
+                        int row, int col)
+{
+  collectRange (left.get (), right.get (), references, row, col);
 }
 
 // --------------------- Blocks, Variables, and Assignments
@@ -1568,18 +1560,44 @@ Block::serialize ()
   return ret;
 }
 
-std::unique_ptr<Primitive>
-Block::evaluate (std::shared_ptr<Runtime> runtime)
+Value
+Block::evaluateValue (EvalContext &context)
 {
-  std::unique_ptr<Primitive> ret;
+  Value ret;
   for (std::unique_ptr<Expression> &statement : statements)
     {
       // Runs each statement, then returns whatever the last one evaluates to
-      ret = statement->evaluate (runtime);
+      ret = statement->evaluateValue (context);
     }
   return ret;
 }
 
+void
+Block::compile (Compiler &compiler)
+{
+  if (statements.empty ())
+    {
+      compiler.constant (Value ());
+      return;
+    }
+  for (size_t i = 0; i < statements.size (); i++)
+    {
+      if (i > 0)
+        compiler.emit (OpCode::POP);
+      statements[i]->compile (compiler);
+    }
+}
+
+void
+Block::collectReferences (std::vector<CellRange> &references,
+                          int row, int col)
+{
+  for (std::unique_ptr<Expression> &statement : statements)
+    {
+      statement->collectReferences (references, row, col);
+    }
+}
+
 // --------------- Variable
 std::string
 Variable::serialize ()
@@ -1587,15 +1605,16 @@ Variable::serialize ()
   return std::format ("Variable:{}", name);
 }
 
-std::unique_ptr<Primitive>
-Variable::evaluate (std::shared_ptr<Runtime> runtime)
+Value
+Variable::evaluateValue (EvalContext &context)
 {
-  std::unique_ptr<Primitive> ret = runtime->getVariable (name);
-  if (ret == nullptr)
-    {
-      throw std::runtime_error ("Undefined variable found");
-    }
-  return ret;
+  return context.frame.get (getSlot ());
+}
+
+void
+Variable::compile (Compiler &compiler)
+{
+  compiler.emit (OpCode::LOAD, resolve (compiler));
 }
 
 std::string
@@ -1604,6 +1623,24 @@ Variable::getName ()
   return name;
 }
 
+int
+Variable::resolve (Compiler &compiler)
+{
+  slot = compiler.name (name);
+  return slot;
+}
+
+int
+Variable::getSlot ()
+{
+  if (slot < 0)
+    {
+      throw std::runtime_error ("Variable " + name
+                                + " was evaluated before it was compiled");
+    }
+  return slot;
+}
+
 // --------------- Assignment
 std::string
 Assignment::serialize ()
@@ -1611,22 +1648,33 @@ Assignment::serialize ()
   return std::format ("{} = {}", left->serialize (), right->serialize ());
 }
 
-std::unique_ptr<Primitive>
-Assignment::evaluate (std::shared_ptr<Runtime> runtime)
+Value
+Assignment::evaluateValue (EvalContext &context)
 {
-  std::unique_ptr<Primitive> rightprim = right->evaluate (runtime);
-  // if (typeid (*left) != typeid (Variable))
-  //   {
-  //     throw std::runtime_error (
-  //         "Left hand side of assignment must be a variable");
-  //   }
-
-  runtime->setVariable (dynamic_cast<Variable &> (*left).getName (),
-                        std::move (rightprim));
+  Value rightval = right->evaluateValue (context);
+  Variable *variable = dynamic_cast<Variable *> (left.get ());
+  if (variable == nullptr)
+    {
+      throw std::runtime_error (
+          "Left hand side of assignment must be a variable");
+    }
 
-  rightprim = right->evaluate (runtime);
+  // The assignment evaluates to the value it stored
+  context.frame.set (variable->getSlot (), rightval);
+  return rightval;
+}
 
-  return rightprim;
+void
+Assignment::compile (Compiler &compiler)
+{
+  right->compile (compiler);
+  Variable *variable = dynamic_cast<Variable *> (left.get ());
+  if (variable == nullptr)
+    {
+      compiler.fail ("Left hand side of assignment must be a variable");
+      return;
+    }
+  compiler.emit (OpCode::STORE, variable->resolve (compiler));
 }
 
 // --------------- IfExpr
@@ -1637,26 +1685,47 @@ IfExpr::serialize ()
                       ifTrue->serialize (), ifFalse->serialize ());
 }
 
-std::unique_ptr<Primitive>
-IfExpr::evaluate (std::shared_ptr<Runtime> runtime)
+Value
+IfExpr::evaluateValue (EvalContext &context)
 {
-  std::unique_ptr<Primitive> conditionprim = condition->evaluate (runtime);
+  Value conditionval = condition->evaluateValue (context);
 
-  if (typeid (*conditionprim) != typeid (Boolean))
+  if (conditionval.getType () != ValueType::BOOLEAN)
     {
       throw std::runtime_error ("Condition must evaluate to a boolean");
     }
 
-  if (dynamic_cast<Boolean &> (*conditionprim).getVal ())
+  if (conditionval.getBool ())
     {
-      return ifTrue->evaluate (runtime);
+      return ifTrue->evaluateValue (context);
     }
   else
     {
-      return ifFalse->evaluate (runtime);
+      return ifFalse->evaluateValue (context);
     }
 }
 
+void
+IfExpr::compile (Compiler &compiler)
+{
+  condition->compile (compiler);
+  int toFalse = compiler.emit (OpCode::JUMP_IF_FALSE);
+  ifTrue->compile (compiler);
+  int toEnd = compiler.emit (OpCode::JUMP);
+  compiler.patch (toFalse, compiler.here ());
+  ifFalse->compile (compiler);
+  compiler.patch (toEnd, compiler.here ());
+}
+
+void
+IfExpr::collectReferences (std::vector<CellRange> &references,
+                           int row, int col)
+{
+  condition->collectReferences (references, row, col);
+  ifTrue->collectReferences (references, row, col);
+  ifFalse->collectReferences (references, row, col);
+}
+
 // -------------- ForExpr
 std::string
 ForExpr::serialize ()
@@ -1666,56 +1735,179 @@ ForExpr::serialize ()
                       block->serialize ());
 }
 
-std::unique_ptr<Primitive>
-ForExpr::evaluate (std::shared_ptr<Runtime> runtime)
+Value
+ForExpr::evaluateValue (EvalContext &context)
 {
   if (typeid (*variable) != typeid (Variable))
     {
       throw std::runtime_error ("Invalid variable in For loop");
     }
+  int slot = dynamic_cast<Variable &> (*variable).getSlot ();
 
-  std::unique_ptr<Primitive> leftAddress = (left->evaluate (runtime));
-  std::unique_ptr<Primitive> rightAddress = (right->evaluate (runtime));
-
-  if (typeid (*leftAddress) != typeid (CellAddress))
+  CellRange range = evaluateRange (left.get (), right.get (), context);
+  for (std::unique_ptr<Variable> &computed : hidden)
     {
-      throw std::runtime_error ("Invalid left address");
+      context.frame.set (computed->getSlot (), Value::fromBool (false));
     }
 
-  if (typeid (*rightAddress) != typeid (CellAddress))
+  Value ret;
+  std::vector<Value> values;
+  size_t width = static_cast<size_t> (range.right - range.left) + 1;
+  int batch_top = range.top;
+  int batch_end = range.top;
+
+  for (int i = range.top; i <= range.bottom; i++)
     {
-      throw std::runtime_error ("Invalid right address");
+      // A batch of rows at a time, which stops short at the edge of the
+      // sheet. readCell throws for the cell past it.
+      if (i == batch_end)
+        {
+          batch_top = i;
+          batch_end
+              = Operations::readRows (context.runtime, range, i, values);
+        }
+      for (int j = range.left; j <= range.right; j++)
+        {
+          size_t index = (i - batch_top) * width + (j - range.left);
+          context.frame.set (
+              slot, index < values.size ()
+                        ? std::move (values[index])
+                        : Operations::readCell (context.runtime, i, j));
+
+          ret = block->evaluateValue (context);
+        }
     }
 
-  int leftRow = dynamic_cast<CellAddress &> (*leftAddress).getRow ();
-  int leftCol = dynamic_cast<CellAddress &> (*leftAddress).getCol ();
-  int rightRow = dynamic_cast<CellAddress &> (*rightAddress).getRow ();
-  int rightCol = dynamic_cast<CellAddress &> (*rightAddress).getCol ();
+  return ret;
+}
 
-  if (leftRow > rightRow || leftCol > rightCol)
+void
+ForExpr::compile (Compiler &compiler)
+{
+  if (typeid (*variable) != typeid (Variable))
     {
-      throw std::runtime_error (
-          "Cells must be ordered (topLeft, bottomRight)");
+      compiler.fail ("Invalid variable in For loop");
+      return;
     }
+  int slot = dynamic_cast<Variable &> (*variable).resolve (compiler);
 
-  std::unique_ptr<Primitive> ret;
+  left->compile (compiler);
+  right->compile (compiler);
+  for (std::unique_ptr<Variable> &computed : hidden)
+    {
+      compiler.constant (Value::fromBool (false));
+      compiler.emit (OpCode::STORE, computed->resolve (compiler));
+      compiler.emit (OpCode::POP);
+    }
+  int enter = compiler.emit (OpCode::FOR_ENTER);
+  int next = compiler.emit (OpCode::FOR_NEXT, slot);
+  block->compile (compiler);
+  compiler.emit (OpCode::FOR_CONTINUE, next);
+  compiler.patch (enter, compiler.here ());
+  compiler.emit (OpCode::FOR_EXIT);
+}
+void
+ForExpr::collectReferences (std::vector<CellRange> &references,
+                            int row, int col)
+{
+  collectRange (left.get (), right.get (), references, row, col);
+  block->collectReferences (references, row, col);
+}
 
-  for (int i = leftRow; i <= rightRow; i++)
+void
+ForExpr::hoist (std::unique_ptr<Expression> &exp, Optimizer &optimizer)
+{
+  // The cell being evaluated doesn't change while the loop runs either
+  if ((exp->effects () & ~READS_POSITION) == READS_CELLS)
     {
-      for (int j = leftCol; j <= rightCol; j++)
-        {
-          std::unique_ptr<CellAddress> cellAddress
-              = std::make_unique<CellAddress> (i, j, -1, -1);
-          std::unique_ptr<Primitive> cellprim
-              = runtime->getCell (cellAddress.get (), runtime);
-          runtime->setVariable (
-              dynamic_cast<Variable &> (*variable).getName (),
-              std::move (cellprim));
-
-          ret = block->evaluate (runtime);
-        }
+      std::string name = optimizer.hiddenName ();
+      std::string computed_name = optimizer.hiddenName ();
+      hidden.push_back (std::make_unique<Variable> (
+          computed_name, exp->getStartIndex (), exp->getEndIndex ()));
+      exp = std::make_unique<Hoisted> (std::move (exp), name, computed_name);
+      return;
     }
+  exp->forEachOperand ([&] (std::unique_ptr<Expression> &operand) {
+    hoist (operand, optimizer);
+  });
+}
+
+void
+ForExpr::hoistInvariants (Optimizer &optimizer)
+{
+  hoist (block, optimizer);
+}
+
+// -------------- Hoisted
+Hoisted::Hoisted (std::unique_ptr<Expression> exp, std::string name,
+                  std::string computed_name)
+    : Expression (exp->getStartIndex (), exp->getEndIndex ()),
+      exp (std::move (exp)),
+      variable (std::make_unique<Variable> (name, start, end)),
+      computed (std::make_unique<Variable> (computed_name, start, end))
+{
+}
+
+std::string
+Hoisted::serialize ()
+{
+  return exp->serialize ();
+}
 
+Value
+Hoisted::evaluateValue (EvalContext &context)
+{
+  int slot = variable->getSlot ();
+  const Value &done = context.frame.get (computed->getSlot ());
+  if (done.getType () == ValueType::BOOLEAN && done.getBool ())
+    {
+      return context.frame.get (slot);
+    }
+  Value ret = exp->evaluateValue (context);
+  context.frame.set (slot, ret);
+  context.frame.set (computed->getSlot (), Value::fromBool (true));
   return ret;
 }
+
+void
+Hoisted::compile (Compiler &compiler)
+{
+  int slot = variable->resolve (compiler);
+  int done = computed->resolve (compiler);
+  compiler.emit (OpCode::LOAD, slot);
+  compiler.emit (OpCode::LOAD, done);
+  int skip = compiler.emit (OpCode::JUMP_IF_TRUE);
+  compiler.emit (OpCode::POP);
+  exp->compile (compiler);
+  compiler.emit (OpCode::STORE, slot);
+  compiler.constant (Value::fromBool (true));
+  compiler.emit (OpCode::STORE, done);
+  compiler.emit (OpCode::POP);
+  compiler.patch (skip, compiler.here ());
+}
+
+void
+Hoisted::collectReferences (std::vector<CellRange> &references,
+                            int row, int col)
+{
+  exp->collectReferences (references, row, col);
+}
+
+ValueType
+Hoisted::staticType ()
+{
+  return exp->staticType ();
+}
+
+unsigned
+Hoisted::effects ()
+{
+  return READS_VARIABLES | WRITES_VARIABLES | exp->effects ();
+}
+
+void
+Hoisted::forEachOperand (const OperandFunction &f)
+{
+  f (exp);
+}
 // End
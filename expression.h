@@ -8,12 +8,34 @@
 
 #ifndef expression_H
 #define expression_H
+#include "dependency.h"
 #include "forward_declarations.h"
 #include "runtime.h"
+#include "value.h"
+#include <functional>
 #include <memory>
 #include <string>
 #include <vector>
 
+// What evaluating an expression depends on besides its operands, or changes.
+// An expression with no effects evaluates to the same value every time, so
+// it can be evaluated once and the value reused. An expression that only
+// reads variables can be reused as long as none of them are assigned in
+// between. Throwing isn't an effect, though evaluating an expression that
+// would otherwise be skipped (by an IF) can still add an error.
+enum Effects : unsigned
+{
+  NO_EFFECTS = 0,
+  READS_CELLS = 1 << 0,
+  READS_VARIABLES = 1 << 1,
+  WRITES_VARIABLES = 1 << 2,
+  // Depends on which cell the expression belongs to, see Offset
+  READS_POSITION = 1 << 3,
+};
+
+// Called with each operand of an expression, which it may replace
+using OperandFunction = std::function<void (std::unique_ptr<Expression> &)>;
+
 /*
 Expression, BinaryOperation, UnaryOperation, and Primitive are abstractions for
 various expressions and operations. Their destructors are handled the same.
@@ -26,11 +48,37 @@ protected:
 
 public:
   Expression (int start, int end) : start (start), end (end) {}
+  // Nodes are allocated together from an Arena, see arena.h
+  static void *operator new (size_t size);
+  static void operator delete (void *node);
   // Returns a string representation of the expression
   virtual std::string serialize () = 0;
   // Returns a model Primitive that represents what the string evaluates to
-  virtual std::unique_ptr<Primitive>
-  evaluate (std::shared_ptr<Runtime> runtime) = 0;
+  std::unique_ptr<Primitive> evaluate (EvalContext &context);
+  // Same as evaluate, without allocating. This is what expressions use to
+  // evaluate each other.
+  virtual Value evaluateValue (EvalContext &context) = 0;
+  // Appends the cells this expression may read while evaluating as part of
+  // the cell at (row, col)
+  virtual void collectReferences (std::vector<CellRange> &references,
+                                  int row, int col);
+  // Appends the bytecode that evaluates this expression, see compiler.h
+  virtual void compile (Compiler &compiler) = 0;
+  // The type this expression evaluates to if that is known without
+  // evaluating it, EMPTY otherwise
+  virtual ValueType staticType ();
+  // The Effects of evaluating this expression and everything under it
+  virtual unsigned effects ();
+  bool
+  isPure ()
+  {
+    return effects () == NO_EFFECTS;
+  }
+  // Calls f with each operand, in the order they are evaluated
+  virtual void forEachOperand (const OperandFunction &f);
+  // Something simpler that evaluates the same way once the operands are
+  // optimized, null if there is nothing simpler
+  virtual std::unique_ptr<Expression> simplify ();
 
   int
   getStartIndex ()
@@ -44,6 +92,14 @@ public:
     return end;
   }
 
+  // For an expression that replaces another, so it covers the same source
+  void
+  setSpan (int start, int end)
+  {
+    this->start = start;
+    this->end = end;
+  }
+
   virtual ~Expression () {};
 };
 
@@ -58,6 +114,13 @@ public:
                    std::unique_ptr<Expression> right, int start, int end)
       : Expression (start, end), left (std::move (left)),
         right (std::move (right)) {};
+  void collectReferences (std::vector<CellRange> &references, int row,
+                          int col) override;
+  unsigned effects () override;
+  void forEachOperand (const OperandFunction &f) override;
+  // True (with the values) when both operands are known without evaluating
+  // them for the cell at (row, col), see Offset
+  bool literalOperands (int row, int col, int &leftVal, int &rightVal);
   virtual ~BinaryOperation () {}
 };
 
@@ -69,6 +132,10 @@ protected:
 public:
   UnaryOperation (std::unique_ptr<Expression> exp, int start, int end)
       : Expression (start, end), exp (std::move (exp)) {};
+  void collectReferences (std::vector<CellRange> &references, int row,
+                          int col) override;
+  unsigned effects () override;
+  void forEachOperand (const OperandFunction &f) override;
   virtual ~UnaryOperation () {}
 };
 
@@ -76,6 +143,10 @@ class Primitive : public Expression
 {
 public:
   Primitive (int start, int end) : Expression (start, end) {};
+  void compile (Compiler &compiler) override;
+  ValueType staticType () override;
+  // What the primitive evaluates to, which doesn't need a context
+  virtual Value toValue () = 0;
   ~Primitive () {};
 };
 
@@ -90,8 +161,8 @@ public:
   Integer (int val, int start, int end) : Primitive (start, end), val (val) {};
   int getVal ();
   std::string serialize () override;
-  std::unique_ptr<Primitive>
-  evaluate (std::shared_ptr<Runtime> runtime) override;
+  Value evaluateValue (EvalContext &context) override;
+  Value toValue () override;
 };
 
 class Float : public Primitive
@@ -103,8 +174,8 @@ public:
   Float (float val, int start, int end) : Primitive (start, end), val (val) {};
   float getVal ();
   std::string serialize () override;
-  std::unique_ptr<Primitive>
-  evaluate (std::shared_ptr<Runtime> runtime) override;
+  Value evaluateValue (EvalContext &context) override;
+  Value toValue () override;
 };
 
 class Boolean : public Primitive
@@ -117,8 +188,8 @@ public:
       : Primitive (start, end), val (val) {};
   bool getVal ();
   std::string serialize () override;
-  std::unique_ptr<Primitive>
-  evaluate (std::shared_ptr<Runtime> runtime) override;
+  Value evaluateValue (EvalContext &context) override;
+  Value toValue () override;
 };
 
 class String : public Primitive
@@ -130,8 +201,8 @@ public:
   String (std::string val, int start, int end);
   std::string getVal ();
   std::string serialize () override;
-  std::unique_ptr<Primitive>
-  evaluate (std::shared_ptr<Runtime> runtime) override;
+  Value evaluateValue (EvalContext &context) override;
+  Value toValue () override;
 };
 
 class CellAddress : public Primitive
@@ -146,8 +217,8 @@ public:
   int getRow ();
   int getCol ();
   std::string serialize () override;
-  std::unique_ptr<Primitive>
-  evaluate (std::shared_ptr<Runtime> runtime) override;
+  Value evaluateValue (EvalContext &context) override;
+  Value toValue () override;
 };
 
 // -------------------- Arithmetic Operations --------------------
@@ -160,8 +231,10 @@ public:
        int start, int end)
       : BinaryOperation (std::move (left), std::move (right), start, end) {};
   std::string serialize () override;
-  std::unique_ptr<Primitive>
-  evaluate (std::shared_ptr<Runtime> runtime) override;
+  Value evaluateValue (EvalContext &context) override;
+  void compile (Compiler &compiler) override;
+  ValueType staticType () override;
+  std::unique_ptr<Expression> simplify () override;
 };
 
 class Subtract : public BinaryOperation
@@ -171,8 +244,10 @@ public:
             std::unique_ptr<Expression> right, int start, int end)
       : BinaryOperation (std::move (left), std::move (right), start, end) {};
   std::string serialize () override;
-  std::unique_ptr<Primitive>
-  evaluate (std::shared_ptr<Runtime> runtime) override;
+  Value evaluateValue (EvalContext &context) override;
+  void compile (Compiler &compiler) override;
+  ValueType staticType () override;
+  std::unique_ptr<Expression> simplify () override;
 };
 
 class Multiply : public BinaryOperation
@@ -183,8 +258,10 @@ public:
             std::unique_ptr<Expression> right, int start, int end)
       : BinaryOperation (std::move (left), std::move (right), start, end) {};
   std::string serialize () override;
-  std::unique_ptr<Primitive>
-  evaluate (std::shared_ptr<Runtime> runtime) override;
+  Value evaluateValue (EvalContext &context) override;
+  void compile (Compiler &compiler) override;
+  ValueType staticType () override;
+  std::unique_ptr<Expression> simplify () override;
 };
 
 class Divide : public BinaryOperation
@@ -195,8 +272,10 @@ public:
       : BinaryOperation (std::move (left), std::move (right), start, end) {};
 
   std::string serialize () override;
-  std::unique_ptr<Primitive>
-  evaluate (std::shared_ptr<Runtime> runtime) override;
+  Value evaluateValue (EvalContext &context) override;
+  void compile (Compiler &compiler) override;
+  ValueType staticType () override;
+  std::unique_ptr<Expression> simplify () override;
 };
 
 class Modulo : public BinaryOperation
@@ -206,8 +285,9 @@ public:
           int start, int end)
       : BinaryOperation (std::move (left), std::move (right), start, end) {};
   std::string serialize () override;
-  std::unique_ptr<Primitive>
-  evaluate (std::shared_ptr<Runtime> runtime) override;
+  Value evaluateValue (EvalContext &context) override;
+  void compile (Compiler &compiler) override;
+  ValueType staticType () override;
 };
 
 class Exponentiation : public BinaryOperation
@@ -218,8 +298,9 @@ public:
                   std::unique_ptr<Expression> right, int start, int end)
       : BinaryOperation (std::move (left), std::move (right), start, end) {};
   std::string serialize () override;
-  std::unique_ptr<Primitive>
-  evaluate (std::shared_ptr<Runtime> runtime) override;
+  Value evaluateValue (EvalContext &context) override;
+  void compile (Compiler &compiler) override;
+  ValueType staticType () override;
 };
 
 class Negation : public UnaryOperation
@@ -229,8 +310,10 @@ public:
   Negation (std::unique_ptr<Expression> exp, int start, int end)
       : UnaryOperation (std::move (exp), start, end) {};
   std::string serialize () override;
-  std::unique_ptr<Primitive>
-  evaluate (std::shared_ptr<Runtime> runtime) override;
+  Value evaluateValue (EvalContext &context) override;
+  void compile (Compiler &compiler) override;
+  ValueType staticType () override;
+  std::unique_ptr<Expression> simplify () override;
 };
 
 //---------------------- Logical Operations --------------------------
@@ -242,8 +325,9 @@ public:
        int start, int end)
       : BinaryOperation (std::move (left), std::move (right), start, end) {};
   std::string serialize () override;
-  std::unique_ptr<Primitive>
-  evaluate (std::shared_ptr<Runtime> runtime) override;
+  Value evaluateValue (EvalContext &context) override;
+  void compile (Compiler &compiler) override;
+  ValueType staticType () override;
 };
 
 class Or : public BinaryOperation
@@ -254,8 +338,9 @@ public:
       int start, int end)
       : BinaryOperation (std::move (left), std::move (right), start, end) {};
   std::string serialize () override;
-  std::unique_ptr<Primitive>
-  evaluate (std::shared_ptr<Runtime> runtime) override;
+  Value evaluateValue (EvalContext &context) override;
+  void compile (Compiler &compiler) override;
+  ValueType staticType () override;
 };
 
 class Not : public UnaryOperation
@@ -264,11 +349,38 @@ public:
   Not (std::unique_ptr<Expression> exp, int start, int end)
       : UnaryOperation (std::move (exp), start, end) {};
   std::string serialize () override;
-  std::unique_ptr<Primitive>
-  evaluate (std::shared_ptr<Runtime> runtime) override;
+  Value evaluateValue (EvalContext &context) override;
+  void compile (Compiler &compiler) override;
+  ValueType staticType () override;
+  std::unique_ptr<Expression> simplify () override;
 };
 
 //--------------------------- Cell Values --------------------------
+// The row or column of a literal address, kept relative to the cell the
+// expression belongs to so cells with the same formula can share it, see
+// formula.h. Evaluates to the row (or column) being evaluated plus offset.
+class Offset : public Expression
+{
+private:
+  bool row;
+  int offset;
+
+public:
+  Offset (bool row, int offset, int start, int end)
+      : Expression (start, end), row (row), offset (offset) {};
+  std::string serialize () override;
+  Value evaluateValue (EvalContext &context) override;
+  void compile (Compiler &compiler) override;
+  ValueType staticType () override;
+  unsigned effects () override;
+  // The row or column it is for the cell at (row, col)
+  int
+  resolve (int row, int col)
+  {
+    return (this->row ? row : col) + offset;
+  }
+};
+
 class LValue : public BinaryOperation
 {
 public:
@@ -276,8 +388,9 @@ public:
           int start, int end)
       : BinaryOperation (std::move (row), std::move (col), start, end) {};
   std::string serialize () override;
-  std::unique_ptr<Primitive>
-  evaluate (std::shared_ptr<Runtime> runtime) override;
+  Value evaluateValue (EvalContext &context) override;
+  void compile (Compiler &compiler) override;
+  ValueType staticType () override;
 };
 
 class RValue : public BinaryOperation
@@ -288,8 +401,11 @@ public:
           int start, int end)
       : BinaryOperation (std::move (row), std::move (col), start, end) {};
   std::string serialize () override;
-  std::unique_ptr<Primitive>
-  evaluate (std::shared_ptr<Runtime> runtime) override;
+  Value evaluateValue (EvalContext &context) override;
+  void compile (Compiler &compiler) override;
+  void collectReferences (std::vector<CellRange> &references, int row,
+                          int col) override;
+  unsigned effects () override;
 };
 
 //--------------------------- Bitwise Operations --------------------------
@@ -303,8 +419,9 @@ public:
       : BinaryOperation (std::move (left), std::move (right), start, end) {};
 
   std::string serialize () override;
-  std::unique_ptr<Primitive>
-  evaluate (std::shared_ptr<Runtime> runtime) override;
+  Value evaluateValue (EvalContext &context) override;
+  void compile (Compiler &compiler) override;
+  ValueType staticType () override;
 };
 
 class BitOr : public BinaryOperation
@@ -315,8 +432,9 @@ public:
          int start, int end)
       : BinaryOperation (std::move (left), std::move (right), start, end) {};
   std::string serialize () override;
-  std::unique_ptr<Primitive>
-  evaluate (std::shared_ptr<Runtime> runtime) override;
+  Value evaluateValue (EvalContext &context) override;
+  void compile (Compiler &compiler) override;
+  ValueType staticType () override;
 };
 
 class BitXor : public BinaryOperation
@@ -327,8 +445,9 @@ public:
           int start, int end)
       : BinaryOperation (std::move (left), std::move (right), start, end) {};
   std::string serialize () override;
-  std::unique_ptr<Primitive>
-  evaluate (std::shared_ptr<Runtime> runtime) override;
+  Value evaluateValue (EvalContext &context) override;
+  void compile (Compiler &compiler) override;
+  ValueType staticType () override;
 };
 
 class BitNot : public UnaryOperation
@@ -337,8 +456,10 @@ public:
   BitNot (std::unique_ptr<Expression> exp, int start, int end)
       : UnaryOperation (std::move (exp), start, end) {};
   std::string serialize () override;
-  std::unique_ptr<Primitive>
-  evaluate (std::shared_ptr<Runtime> runtime) override;
+  Value evaluateValue (EvalContext &context) override;
+  void compile (Compiler &compiler) override;
+  ValueType staticType () override;
+  std::unique_ptr<Expression> simplify () override;
 };
 
 class LeftShift : public BinaryOperation
@@ -350,8 +471,9 @@ public:
       : BinaryOperation (std::move (left), std::move (right), start, end) {};
 
   std::string serialize () override;
-  std::unique_ptr<Primitive>
-  evaluate (std::shared_ptr<Runtime> runtime) override;
+  Value evaluateValue (EvalContext &context) override;
+  void compile (Compiler &compiler) override;
+  ValueType staticType () override;
 };
 
 class RightShift : public BinaryOperation
@@ -362,8 +484,9 @@ public:
       : BinaryOperation (std::move (left), std::move (right), start, end) {};
 
   std::string serialize () override;
-  std::unique_ptr<Primitive>
-  evaluate (std::shared_ptr<Runtime> runtime) override;
+  Value evaluateValue (EvalContext &context) override;
+  void compile (Compiler &compiler) override;
+  ValueType staticType () override;
 };
 
 //--------------------- Relational Operations --------------------------
@@ -377,8 +500,9 @@ public:
       : BinaryOperation (std::move (left), std::move (right), start, end) {};
 
   std::string serialize () override;
-  std::unique_ptr<Primitive>
-  evaluate (std::shared_ptr<Runtime> runtime) override;
+  Value evaluateValue (EvalContext &context) override;
+  void compile (Compiler &compiler) override;
+  ValueType staticType () override;
 };
 
 class NotEquals : public BinaryOperation
@@ -389,8 +513,9 @@ public:
              std::unique_ptr<Expression> right, int start, int end)
       : BinaryOperation (std::move (left), std::move (right), start, end) {};
   std::string serialize () override;
-  std::unique_ptr<Primitive>
-  evaluate (std::shared_ptr<Runtime> runtime) override;
+  Value evaluateValue (EvalContext &context) override;
+  void compile (Compiler &compiler) override;
+  ValueType staticType () override;
 };
 
 class LessThan : public BinaryOperation
@@ -401,8 +526,9 @@ public:
             std::unique_ptr<Expression> right, int start, int end)
       : BinaryOperation (std::move (left), std::move (right), start, end) {};
   std::string serialize () override;
-  std::unique_ptr<Primitive>
-  evaluate (std::shared_ptr<Runtime> runtime) override;
+  Value evaluateValue (EvalContext &context) override;
+  void compile (Compiler &compiler) override;
+  ValueType staticType () override;
 };
 
 class LessThanEqual : public BinaryOperation
@@ -413,8 +539,9 @@ public:
                  std::unique_ptr<Expression> right, int start, int end)
       : BinaryOperation (std::move (left), std::move (right), start, end) {};
   std::string serialize () override;
-  std::unique_ptr<Primitive>
-  evaluate (std::shared_ptr<Runtime> runtime) override;
+  Value evaluateValue (EvalContext &context) override;
+  void compile (Compiler &compiler) override;
+  ValueType staticType () override;
 };
 
 class GreaterThan : public BinaryOperation
@@ -425,8 +552,9 @@ public:
                std::unique_ptr<Expression> right, int start, int end)
       : BinaryOperation (std::move (left), std::move (right), start, end) {};
   std::string serialize () override;
-  std::unique_ptr<Primitive>
-  evaluate (std::shared_ptr<Runtime> runtime) override;
+  Value evaluateValue (EvalContext &context) override;
+  void compile (Compiler &compiler) override;
+  ValueType staticType () override;
 };
 
 class GreaterThanEqual : public BinaryOperation
@@ -437,8 +565,9 @@ public:
                     std::unique_ptr<Expression> right, int start, int end)
       : BinaryOperation (std::move (left), std::move (right), start, end) {};
   std::string serialize () override;
-  std::unique_ptr<Primitive>
-  evaluate (std::shared_ptr<Runtime> runtime) override;
+  Value evaluateValue (EvalContext &context) override;
+  void compile (Compiler &compiler) override;
+  ValueType staticType () override;
 };
 
 //--------------------------- Casting Operations --------------------------
@@ -450,8 +579,9 @@ public:
   FloatToInt (std::unique_ptr<Expression> exp, int start, int end)
       : UnaryOperation (std::move (exp), start, end) {};
   std::string serialize () override;
-  std::unique_ptr<Primitive>
-  evaluate (std::shared_ptr<Runtime> runtime) override;
+  Value evaluateValue (EvalContext &context) override;
+  void compile (Compiler &compiler) override;
+  ValueType staticType () override;
 };
 
 class IntToFloat : public UnaryOperation
@@ -461,8 +591,9 @@ public:
   IntToFloat (std::unique_ptr<Expression> exp, int start, int end)
       : UnaryOperation (std::move (exp), start, end) {};
   std::string serialize () override;
-  std::unique_ptr<Primitive>
-  evaluate (std::shared_ptr<Runtime> runtime) override;
+  Value evaluateValue (EvalContext &context) override;
+  void compile (Compiler &compiler) override;
+  ValueType staticType () override;
 };
 
 //----------------------- Statistical Functions--------------------------
@@ -477,8 +608,12 @@ public:
                          end) {};
 
   std::string serialize () override;
-  std::unique_ptr<Primitive>
-  evaluate (std::shared_ptr<Runtime> runtime) override;
+  Value evaluateValue (EvalContext &context) override;
+  void compile (Compiler &compiler) override;
+  ValueType staticType () override;
+  void collectReferences (std::vector<CellRange> &references, int row,
+                          int col) override;
+  unsigned effects () override;
 };
 
 class Min : public BinaryOperation
@@ -491,8 +626,12 @@ public:
                          end) {};
 
   std::string serialize () override;
-  std::unique_ptr<Primitive>
-  evaluate (std::shared_ptr<Runtime> runtime) override;
+  Value evaluateValue (EvalContext &context) override;
+  void compile (Compiler &compiler) override;
+  ValueType staticType () override;
+  void collectReferences (std::vector<CellRange> &references, int row,
+                          int col) override;
+  unsigned effects () override;
 };
 
 class Mean : public BinaryOperation
@@ -505,8 +644,12 @@ public:
                          end) {};
 
   std::string serialize () override;
-  std::unique_ptr<Primitive>
-  evaluate (std::shared_ptr<Runtime> runtime) override;
+  Value evaluateValue (EvalContext &context) override;
+  void compile (Compiler &compiler) override;
+  ValueType staticType () override;
+  void collectReferences (std::vector<CellRange> &references, int row,
+                          int col) override;
+  unsigned effects () override;
 };
 
 class Sum : public BinaryOperation
@@ -519,8 +662,12 @@ public:
                          end) {};
 
   std::string serialize () override;
-  std::unique_ptr<Primitive>
-  evaluate (std::shared_ptr<Runtime> runtime) override;
+  Value evaluateValue (EvalContext &context) override;
+  void compile (Compiler &compiler) override;
+  ValueType staticType () override;
+  void collectReferences (std::vector<CellRange> &references, int row,
+                          int col) override;
+  unsigned effects () override;
 };
 
 // --------------------- Blocks, Variables, and Assignments -------------------
@@ -535,23 +682,35 @@ public:
       : Expression (start, end), statements (std::move (statements)) {};
 
   std::string serialize () override;
-  std::unique_ptr<Primitive>
-  evaluate (std::shared_ptr<Runtime> runtime) override;
+  Value evaluateValue (EvalContext &context) override;
+  void compile (Compiler &compiler) override;
+  void collectReferences (std::vector<CellRange> &references, int row,
+                          int col) override;
+  unsigned effects () override;
+  void forEachOperand (const OperandFunction &f) override;
+  std::unique_ptr<Expression> simplify () override;
 };
 
 class Variable : public Expression
 {
 private:
   std::string name;
+  // Where the variable is kept in a Frame, given by the compiler
+  int slot;
 
 public:
   Variable (std::string name, int start, int end)
-      : Expression (start, end), name (name) {};
+      : Expression (start, end), name (name), slot (-1) {};
 
   std::string serialize () override;
-  std::unique_ptr<Primitive>
-  evaluate (std::shared_ptr<Runtime> runtime) override;
+  Value evaluateValue (EvalContext &context) override;
+  void compile (Compiler &compiler) override;
+  unsigned effects () override;
   std::string getName ();
+  // Asks the compiler for the variable's slot and returns it. Evaluating
+  // needs this done first, which compiling the expression does.
+  int resolve (Compiler &compiler);
+  int getSlot ();
 };
 
 class Assignment : public BinaryOperation
@@ -562,8 +721,9 @@ public:
       : BinaryOperation (std::move (left), std::move (right), start, end) {};
 
   std::string serialize () override;
-  std::unique_ptr<Primitive>
-  evaluate (std::shared_ptr<Runtime> runtime) override;
+  Value evaluateValue (EvalContext &context) override;
+  void compile (Compiler &compiler) override;
+  unsigned effects () override;
 };
 
 class IfExpr : public Expression
@@ -581,8 +741,39 @@ public:
         ifTrue (std::move (ifTrue)), ifFalse (std::move (ifFalse)) {};
 
   std::string serialize () override;
-  std::unique_ptr<Primitive>
-  evaluate (std::shared_ptr<Runtime> runtime) override;
+  Value evaluateValue (EvalContext &context) override;
+  void compile (Compiler &compiler) override;
+  void collectReferences (std::vector<CellRange> &references, int row,
+                          int col) override;
+  unsigned effects () override;
+  void forEachOperand (const OperandFunction &f) override;
+  std::unique_ptr<Expression> simplify () override;
+};
+
+// Part of a loop body that evaluates the same on every iteration, see
+// ForExpr::hoistInvariants. It is only evaluated the first time the loop
+// reaches it, then kept in a hidden variable for the rest of the loop. A
+// second hidden variable says whether it has been, since any value
+// including an empty one can be what it evaluates to.
+class Hoisted : public Expression
+{
+private:
+  std::unique_ptr<Expression> exp;
+  std::unique_ptr<Variable> variable;
+  std::unique_ptr<Variable> computed;
+
+public:
+  Hoisted (std::unique_ptr<Expression> exp, std::string name,
+           std::string computed_name);
+
+  std::string serialize () override;
+  Value evaluateValue (EvalContext &context) override;
+  void compile (Compiler &compiler) override;
+  void collectReferences (std::vector<CellRange> &references, int row,
+                          int col) override;
+  ValueType staticType () override;
+  unsigned effects () override;
+  void forEachOperand (const OperandFunction &f) override;
 };
 
 class ForExpr : public Expression
@@ -592,6 +783,11 @@ private:
   std::unique_ptr<Expression> left;
   std::unique_ptr<Expression> right;
   std::unique_ptr<Expression> block;
+  // Whether each Hoisted expression in block has been evaluated, set to
+  // false each time the loop starts
+  std::vector<std::unique_ptr<Variable> > hidden;
+
+  void hoist (std::unique_ptr<Expression> &exp, Optimizer &optimizer);
 
 public:
   ForExpr (std::unique_ptr<Expression> variable,
@@ -602,8 +798,16 @@ public:
         block (std::move (block)) {};
 
   std::string serialize () override;
-  std::unique_ptr<Primitive>
-  evaluate (std::shared_ptr<Runtime> runtime) override;
+  Value evaluateValue (EvalContext &context) override;
+  void compile (Compiler &compiler) override;
+  void collectReferences (std::vector<CellRange> &references, int row,
+                          int col) override;
+  unsigned effects () override;
+  void forEachOperand (const OperandFunction &f) override;
+  // Moves what only reads cells out of the loop, by wrapping it in Hoisted.
+  // Cells don't change while a formula is evaluated, so it evaluates the
+  // same on every iteration.
+  void hoistInvariants (Optimizer &optimizer);
 };
 
 #endif
@@ -0,0 +1,119 @@
+#include "formula.h"
+#include "compiler.h"
+#include "parser.h"
+#include <algorithm>
+#include <charconv>
+
+bool
+FormulaTable::shape (std::vector<Token> &tokens, int row, int col)
+{
+  auto isType = [&] (size_t k, TokenType type) {
+    return k < tokens.size () && tokens[k].getType () == type;
+  };
+  auto append = [&] (long val) {
+    char digits[24];
+    char *last = std::to_chars (digits, digits + sizeof digits, val).ptr;
+    key.append (digits, last);
+    key += ':';
+  };
+  // The length keeps the text of one token from running into the next.
+  // The position is there so a shared tree has the spans of each source.
+  auto keyToken = [&] (size_t k) {
+    std::string_view text = tokens[k].getText ();
+    key += static_cast<char> (tokens[k].getType ());
+    append (tokens[k].getStartIndex ());
+    append (static_cast<long> (text.size ()));
+    key += text;
+  };
+  // The offset stands in for the literal. One too large for an int is left
+  // as it is for the parser to report.
+  auto relative = [&] (size_t k, TokenType type, int origin) {
+    std::string_view text = tokens[k].getText ();
+    int val;
+    auto result
+        = std::from_chars (text.data (), text.data () + text.size (), val);
+    if (result.ec != std::errc () || result.ptr != text.data () + text.size ())
+      {
+        keyToken (k);
+        return;
+      }
+    tokens[k] = Token (text, type, tokens[k].getStartIndex (),
+                       tokens[k].getEndIndex ());
+    key += static_cast<char> (type);
+    append (tokens[k].getStartIndex ());
+    append (tokens[k].getEndIndex ());
+    append (static_cast<long> (val) - origin);
+  };
+
+  key.clear ();
+  bool addresses = false;
+  for (size_t k = 0; k < tokens.size (); k++)
+    {
+      // [ INTEGER , INTEGER ] is always an address, whether or not a # is in
+      // front of it
+      if (isType (k, TokenType::LEFTBRACKET)
+          && isType (k + 1, TokenType::INTEGER)
+          && isType (k + 2, TokenType::COMMA)
+          && isType (k + 3, TokenType::INTEGER)
+          && isType (k + 4, TokenType::RIGHTBRACKET))
+        {
+          keyToken (k);
+          relative (k + 1, TokenType::ROW_OFFSET, row);
+          keyToken (k + 2);
+          relative (k + 3, TokenType::COL_OFFSET, col);
+          keyToken (k + 4);
+          addresses = true;
+          k += 4;
+        }
+      else
+        {
+          keyToken (k);
+        }
+    }
+  return addresses;
+}
+
+std::shared_ptr<Formula>
+FormulaTable::intern (const std::string &src, int row, int col)
+{
+  lexer.reset (src);
+  std::vector<Token> &tokens = lexer.lex ();
+
+  auto parse = [&] () {
+    Parser parser (tokens, row, col);
+    std::shared_ptr<Formula> formula = std::make_shared<Formula> ();
+    formula->exp = parser.parse ();
+    formula->program = Compiler::compile (*formula->exp);
+    return formula;
+  };
+  if (!shape (tokens, row, col))
+    {
+      return parse ();
+    }
+
+  // Only a new shape copies the key
+  auto found = formulas.find (key);
+  if (found != formulas.end ())
+    {
+      std::shared_ptr<Formula> formula = found->second.lock ();
+      if (formula != nullptr)
+        {
+          return formula;
+        }
+    }
+  std::shared_ptr<Formula> formula = parse ();
+  if (found != formulas.end ())
+    {
+      found->second = formula;
+      return formula;
+    }
+  formulas.emplace (key, formula);
+
+  if (formulas.size () >= sweep_at)
+    {
+      std::erase_if (formulas,
+                     [] (auto &item) { return item.second.expired (); });
+      sweep_at = std::max<size_t> (1024, formulas.size () * 2);
+    }
+  return formula;
+}
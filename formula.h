@@ -0,0 +1,59 @@
+#ifndef formula_H
+#define formula_H
+
+#include "bytecode.h"
+#include "expression.h"
+#include "lexer.h"
+#include "token.h"
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// A parsed and compiled formula that any number of cells can share. The
+// rows and columns of its literal addresses are Offsets from the cell being
+// evaluated, so it evaluates the same as the source it was parsed from in
+// each of them.
+struct Formula
+{
+  std::unique_ptr<Expression> exp;
+  std::shared_ptr<Program> program;
+};
+
+/* FormulaTable interns formulas by their shape, the source with the rows
+ * and columns of literal addresses made relative to the cell. A column
+ * filled down with #[0,0] * 2, #[1,0] * 2, ... is parsed and compiled once.
+ *
+ * Only addresses written as two integers ([r,c] or #[r,c]) are made
+ * relative, anything else in the brackets is kept as written, and a source
+ * without any is not interned. The position of each token is part of the
+ * shape, so the start and end of the shared expressions are right for
+ * every source that has it. Rows or columns with more digits move the
+ * tokens after them, so a column filled down has one shape for each width.
+ */
+class FormulaTable
+{
+private:
+  // Entries go once every cell using them has been changed, expired ones
+  // are swept whenever the table has doubled in size.
+  std::unordered_map<std::string, std::weak_ptr<Formula> > formulas;
+  size_t sweep_at;
+
+  // Kept between calls so interning a shape already seen doesn't allocate
+  Lexer lexer;
+  std::string key;
+
+  // Retypes the literal addresses of tokens as offsets from (row, col) and
+  // sets key to the shape they have then. False for tokens without literal
+  // addresses, a constant is cheap to parse and the shape would seldom
+  // repeat.
+  bool shape (std::vector<Token> &tokens, int row, int col);
+
+public:
+  FormulaTable () : sweep_at (1024) {}
+  // The formula of src for the cell at (row, col), shared with every cell
+  // that has had the same shape interned. Throws like Parser::parse.
+  std::shared_ptr<Formula> intern (const std::string &src, int row, int col);
+};
+
+#endif
@@ -7,5 +7,11 @@ class CellAddress;
 class Expression;
 class Runtime;
 class Cell;
+class Compiler;
+class Optimizer;
+class SheetFile;
+class ThreadPool;
+struct EvalContext;
+struct Formula;
 
 #endif
\ No newline at end of file
@@ -1,115 +1,743 @@
 #include "grid.h"
+#include "formula.h"
+#include "sheetfile.h"
+#include "threadpool.h"
+#include <cmath>
 
-// Currently, cells are initialized to have a src of the empty string, a
-// nullptr for an expression, and a nullptr for the primitive.
-Grid::Grid ()
+// Cells are created lazily. A cell that has never been written to is not
+// stored at all, and getCell returns nullptr for it.
+Grid::Grid (int rows, int cols)
+    : rows (rows), cols (cols), last_key (0), last_tile (nullptr),
+      concurrent (false),
+      unread (0), file_dependencies (false), row_limit (0),
+      watching (false), changed_all (false), iterative (false),
+      max_iterations (100), epsilon (0.001) {};
+
+void
+Grid::setIterativeCalculation (bool enabled, int max_iterations,
+                               double epsilon)
+{
+  this->iterative = enabled;
+  this->max_iterations = max_iterations;
+  this->epsilon = epsilon;
+}
+
+void
+Grid::watchChanges ()
+{
+  watching = true;
+}
+
+bool
+Grid::takeChanges (std::vector<uint64_t> &out)
+{
+  out.clear ();
+  std::swap (out, changes);
+  bool all = changed_all;
+  changed_all = false;
+  return !all;
+}
+
+void
+Grid::checkBounds (int row, int col)
+{
+  if (row < 0 || row >= rows || col < 0 || col >= cols)
+    throw std::runtime_error (
+        "Cell address out of range, sorry user, code is wrong.");
+}
+
+Grid::Tile *
+Grid::findTile (int row, int col)
+{
+  uint64_t key = tileKey (row / tile_rows, col / tile_cols);
+  if (concurrent)
+    {
+      auto found = tiles.find (key);
+      return found != tiles.end () ? found->second.get () : nullptr;
+    }
+  if (last_tile != nullptr && key == last_key)
+    {
+      return last_tile;
+    }
+  auto found = tiles.find (key);
+  if (found == tiles.end ())
+    {
+      return nullptr;
+    }
+  last_key = key;
+  last_tile = found->second.get ();
+  return last_tile;
+}
+
+Grid::Tile *
+Grid::makeTile (int row, int col)
+{
+  Tile *tile = findTile (row, col);
+  if (tile == nullptr)
+    {
+      std::unique_ptr<Tile> created = std::make_unique<Tile> ();
+      tile = created.get ();
+      tiles[tileKey (row / tile_rows, col / tile_cols)] = std::move (created);
+      last_tile = nullptr;
+    }
+  row_limit = std::max (row_limit, row + 1);
+  return tile;
+}
+
+void
+Grid::open (std::shared_ptr<SheetFile> file)
+{
+  tiles.clear ();
+  last_tile = nullptr;
+  dependencies = DependencyGraph ();
+  {
+    std::lock_guard<std::mutex> lock (columns_mutex);
+    columns.clear ();
+  }
+  // Cells are sorted row-major, so the last one is on the last row
+  row_limit = file->size () > 0 ? keyRow (file->key (file->size () - 1)) + 1
+                                : 0;
+  changed_all = watching;
+  changes.clear ();
+  this->file = file;
+  read.assign (file->size (), false);
+  unread = file->size ();
+  file_dependencies = false;
+  releaseFile ();
+}
+
+Cell *
+Grid::readFromFile (int row, int col)
+{
+  long index = file->find (row, col);
+  if (index < 0 || read[index])
+    {
+      return nullptr;
+    }
+  read[index] = true;
+  unread--;
+
+  // The file has the compiled program and the value it had when it was
+  // saved, so nothing is parsed or evaluated here.
+  std::shared_ptr<Cell> cell = std::make_shared<Cell> (
+      file->source (index), nullptr, file->value (index),
+      file->error (index));
+  cell->setProgram (file->program (index));
+  Tile *tile = makeTile (row, col);
+  tile->cells[row % tile_rows][col % tile_cols] = cell;
+  tile->populated++;
+  releaseFile ();
+  return cell.get ();
+}
+
+void
+Grid::readAllFromFile ()
+{
+  for (size_t i = 0; file != nullptr && i < read.size (); i++)
+    {
+      if (!read[i])
+        {
+          uint64_t key = file->key (i);
+          readFromFile (keyRow (key), keyCol (key));
+        }
+    }
+}
+
+void
+Grid::readFileDependencies ()
+{
+  if (file_dependencies)
+    {
+      return;
+    }
+  // Read straight out of the references column, nothing has been edited
+  // yet so every cell still reads what it did when the file was saved.
+  for (size_t i = 0; i < file->size (); i++)
+    {
+      std::vector<CellRange> references;
+      file->references (i, references);
+      if (!references.empty ())
+        {
+          uint64_t key = file->key (i);
+          dependencies.setPrecedents (keyRow (key), keyCol (key),
+                                      std::move (references));
+        }
+    }
+  file_dependencies = true;
+  releaseFile ();
+}
+
+// Once everything has been read out of the file it can be unmapped
+void
+Grid::releaseFile ()
 {
+  if (unread == 0 && (file_dependencies || file->size () == 0))
+    {
+      file = nullptr;
+      read.clear ();
+    }
+}
+
+// Whatever the file has for a cell that is about to be replaced must not come
+// back the next time the cell is looked up.
+void
+Grid::replaceFromFile (int row, int col)
+{
+  readFileDependencies ();
+  if (file != nullptr)
+    {
+      readFromFile (row, col);
+    }
+}
+
+const NumericColumn &
+Grid::getNumericColumn (int col)
+{
+  std::lock_guard<std::mutex> lock (columns_mutex);
+  auto found = columns.find (col);
+  if (found != columns.end ())
+    {
+      return found->second;
+    }
 
-  for (int i = 0; i < rows; ++i)
+  // Everything has to be in the tiles to be copied
+  if (file != nullptr)
+    {
+      readAllFromFile ();
+    }
+  NumericColumn &column = columns[col];
+  column.resize (row_limit);
+  for (int first_row = 0; first_row < row_limit; first_row += tile_rows)
     {
-      for (int j = 0; j < cols; ++j)
+      Tile *tile = findTile (first_row, col);
+      if (tile == nullptr)
+        continue;
+      for (int i = 0; i < tile_rows; i++)
         {
-          std::unique_ptr<Expression> exp
-              = std::make_unique<String> ("", -1, -1);
-          cells[i][j] = std::make_shared<Cell> ("", std::move (exp),
-                                                exp->evaluate (nullptr), "");
+          Cell *cell = tile->cells[i][col % tile_cols].get ();
+          if (cell != nullptr)
+            column.set (first_row + i, cell->getValue ());
         }
     }
-};
+  return column;
+}
+
+const std::vector<CellRange> *
+Grid::getPrecedents (int row, int col)
+{
+  if (file != nullptr)
+    {
+      readFileDependencies ();
+    }
+  return dependencies.precedentsOf (row, col);
+}
+
+size_t
+Grid::size ()
+{
+  size_t count = unread;
+  for (auto &entry : tiles)
+    {
+      count += entry.second->populated;
+    }
+  return count;
+}
 
 void
 Grid::setCell (int row, int col, std::string src,
-               std::unique_ptr<Expression> exp,
-               std::shared_ptr<Runtime> runtime, std::string error)
+               std::unique_ptr<Expression> exp, Runtime &runtime,
+               std::string error)
 {
-  std::shared_ptr<Cell> cell = cells[row][col];
+  loadCell (row, col, std::move (src), std::move (exp), runtime,
+            std::move (error));
+  recalculate ({ cellKey (row, col) }, runtime);
+}
 
-  if (cell != nullptr)
+Cell *
+Grid::placeCell (int row, int col, std::string src, std::string error)
+{
+  checkBounds (row, col);
+  if (file != nullptr)
     {
-      cell->setPrimitive (exp->evaluate (runtime));
-      cell->setExpression (std::move (exp), runtime);
-      cell->setStr (src);
-      cell->setError (error);
+      replaceFromFile (row, col);
+    }
+  Tile *tile = findTile (row, col);
+  std::shared_ptr<Cell> cell
+      = tile != nullptr ? tile->cells[row % tile_rows][col % tile_cols]
+                        : nullptr;
+
+  if (src.empty () && error.empty ())
+    {
+      // Clearing a cell gives its memory back, along with its tile once the
+      // tile is empty.
+      dependencies.removeCell (row, col);
+      if (cell != nullptr)
+        {
+          noteValue (row, col, Value ());
+          tile->cells[row % tile_rows][col % tile_cols] = nullptr;
+          if (--tile->populated == 0)
+            {
+              last_tile = nullptr;
+              tiles.erase (tileKey (row / tile_rows, col / tile_cols));
+            }
+        }
+      return nullptr;
+    }
+
+  if (cell == nullptr)
+    {
+      tile = makeTile (row, col);
+      cell = std::make_shared<Cell> (src, nullptr, Value (), error);
+      tile->cells[row % tile_rows][col % tile_cols] = cell;
+      tile->populated++;
+    }
+
+  cell->setStr (std::move (src));
+  cell->setError (std::move (error));
+  return cell.get ();
+}
+
+void
+Grid::loadCell (int row, int col, std::string src,
+                std::unique_ptr<Expression> exp, Runtime &runtime,
+                std::string error)
+{
+  bool failed = !error.empty ();
+  Cell *cell = placeCell (row, col, std::move (src), std::move (error));
+  if (cell == nullptr)
+    {
+      return;
+    }
+  if (failed)
+    {
+      // A source that didn't parse has nothing to recalculate, it just shows
+      // the placeholder value it was given.
+      EvalContext context = { runtime, row, col, runtime.getFrame () };
+      cell->setPrimitive (exp->evaluate (context));
+      noteValue (row, col, cell->getValue ());
+      cell->setExpression (nullptr);
+      dependencies.removeCell (row, col);
     }
   else
     {
-      cells[row][col] = std::make_shared<Cell> ("", std::move (exp),
-                                                exp->evaluate (runtime), "");
+      std::vector<CellRange> references;
+      exp->collectReferences (references, row, col);
+      dependencies.setPrecedents (row, col, std::move (references));
+      cell->setExpression (std::move (exp));
     }
 }
 
-std::unique_ptr<Primitive>
-Grid::getValue (CellAddress *address, std::shared_ptr<Runtime> runtime)
+void
+Grid::setFormula (int row, int col, std::string src,
+                  std::shared_ptr<Formula> formula, Runtime &runtime)
 {
-  if (address->getRow () < 0 || address->getRow () >= rows
-      || address->getCol () < 0 || address->getCol () >= cols)
-    throw std::runtime_error (
-        "Cell address out of range, sorry user, code is wrong.");
-  std::shared_ptr<Cell> cell = cells[address->getRow ()][address->getCol ()];
+  loadFormula (row, col, std::move (src), std::move (formula), runtime);
+  recalculate ({ cellKey (row, col) }, runtime);
+}
+
+void
+Grid::loadFormula (int row, int col, std::string src,
+                   std::shared_ptr<Formula> formula, Runtime &runtime)
+{
+  Cell *cell = placeCell (row, col, std::move (src), "");
   if (cell == nullptr)
-    return nullptr; // Cell is empty
-  std::unique_ptr<Primitive> ret = cell->getPrimitive (runtime);
-  return ret;
+    {
+      return;
+    }
+  std::vector<CellRange> references;
+  formula->exp->collectReferences (references, row, col);
+  dependencies.setPrecedents (row, col, std::move (references));
+  cell->setFormula (std::move (formula));
 }
 
-std::shared_ptr<Cell>
-Grid::getCell (int row, int col)
+void
+Grid::loadValue (int row, int col, std::string src, Value value)
 {
-  return cells[row][col];
+  checkBounds (row, col);
+  if (file != nullptr)
+    {
+      replaceFromFile (row, col);
+    }
+  dependencies.removeCell (row, col);
+  Tile *tile = makeTile (row, col);
+  std::shared_ptr<Cell> &cell = tile->cells[row % tile_rows][col % tile_cols];
+  noteValue (row, col, value);
+  if (cell == nullptr)
+    {
+      cell = std::make_shared<Cell> (std::move (src), nullptr,
+                                     std::move (value), "");
+      tile->populated++;
+      return;
+    }
+  cell->setStr (std::move (src));
+  cell->setExpression (nullptr);
+  cell->setValue (std::move (value));
+  cell->setError ("");
+}
+
+bool
+Grid::evaluate (Cell *cell, uint64_t key, Runtime &runtime, unsigned worker,
+                Value &value, std::string &error)
+{
+  const std::shared_ptr<Program> &program = cell->getProgram ();
+  if (program == nullptr)
+    {
+      return false;
+    }
+  // Errors stay with the cell that caused them instead of stopping the rest
+  // of the recalculation.
+  try
+    {
+      EvalContext context
+          = { runtime, keyRow (key), keyCol (key), runtime.getFrame (worker) };
+      value = runtime.getMachine (worker).run (*program, context);
+      error.clear ();
+    }
+  catch (std::exception &e)
+    {
+      value = Value::fromString ("NULL");
+      error = e.what ();
+    }
+  return true;
 }
 
 void
-Grid::printGrid (std::shared_ptr<Runtime> runtime)
+Grid::evaluateCell (Cell *cell, uint64_t key, Runtime &runtime)
+{
+  Value value;
+  std::string error;
+  if (evaluate (cell, key, runtime, 0, value, error))
+    {
+      cell->setValue (std::move (value));
+      cell->setError (std::move (error));
+      noteValue (keyRow (key), keyCol (key), cell->getValue ());
+    }
+}
+
+// Evaluates the levels of plan on every worker of pool, and returns where
+// the cells to evaluate one at a time begin. The values of a level are only
+// written once the whole level has been evaluated, so the grid doesn't
+// change while it is read. Volatile cells are never in a level, reading a
+// cell of the same level would depend on which was written first.
+size_t
+Grid::recalculateLevels (const Recalculation &plan, Runtime &runtime,
+                         ThreadPool &pool)
 {
-  for (int i = 0; i < rows; ++i)
+  // Small levels aren't worth waking the other threads for
+  constexpr size_t parallel_cells = 64;
+
+  // Evaluating must not read cells out of a file, since that adds them
+  if (file != nullptr)
     {
-      for (int j = 0; j < cols; ++j)
+      readAllFromFile ();
+    }
+  std::vector<Cell *> cells;
+  std::vector<Value> values;
+  std::vector<std::string> errors;
+  std::vector<char> evaluated;
+  for (size_t level = 0; level + 1 < plan.levels.size (); level++)
+    {
+      size_t first = plan.levels[level];
+      size_t count = plan.levels[level + 1] - first;
+      if (count < parallel_cells)
         {
-          std::cout << "| ";
-          if (cells[i][j] != nullptr)
+          for (size_t i = first; i < first + count; i++)
             {
-              std::unique_ptr<Primitive> prim
-                  = cells[i][j]->getPrimitive (runtime);
-              if (prim != nullptr)
-                {
-                  std::cout << cells[i][j]->getString () << " = "
-                            << prim->serialize () << " |";
-                }
+              Cell *cell
+                  = findCell (keyRow (plan.order[i]), keyCol (plan.order[i]));
+              if (cell != nullptr)
+                evaluateCell (cell, plan.order[i], runtime);
+            }
+          continue;
+        }
+
+      cells.resize (count);
+      for (size_t i = 0; i < count; i++)
+        {
+          uint64_t key = plan.order[first + i];
+          cells[i] = findCell (keyRow (key), keyCol (key));
+        }
+      values.assign (count, Value ());
+      errors.assign (count, "");
+      evaluated.assign (count, false);
+
+      concurrent = true;
+      try
+        {
+          pool.parallelFor (count, [&] (unsigned worker, size_t i) {
+            if (cells[i] != nullptr)
+              evaluated[i] = evaluate (cells[i], plan.order[first + i],
+                                       runtime, worker, values[i],
+                                       errors[i]);
+          });
+        }
+      catch (...)
+        {
+          concurrent = false;
+          throw;
+        }
+      concurrent = false;
+
+      for (size_t i = 0; i < count; i++)
+        {
+          if (!evaluated[i])
+            continue;
+          uint64_t key = plan.order[first + i];
+          cells[i]->setValue (std::move (values[i]));
+          cells[i]->setError (std::move (errors[i]));
+          noteValue (keyRow (key), keyCol (key), cells[i]->getValue ());
+        }
+    }
+  return plan.levels.back ();
+}
+
+void
+Grid::recalculate (const std::vector<uint64_t> &roots, Runtime &runtime)
+{
+  if (file != nullptr)
+    {
+      readFileDependencies ();
+    }
+  Recalculation plan = dependencies.recalculationOrder (roots);
+  size_t next_cycle = 0;
+  size_t i = 0;
+  if (runtime.getPool () != nullptr)
+    {
+      i = recalculateLevels (plan, runtime, *runtime.getPool ());
+    }
+  while (i < plan.order.size ())
+    {
+      if (next_cycle < plan.cycles.size ()
+          && plan.cycles[next_cycle].first == i)
+        {
+          size_t last = plan.cycles[next_cycle].second;
+          recalculateCycle (
+              std::vector<uint64_t> (plan.order.begin () + i,
+                                     plan.order.begin () + last),
+              runtime);
+          next_cycle++;
+          i = last;
+          continue;
+        }
+      Cell *cell = findCell (keyRow (plan.order[i]), keyCol (plan.order[i]));
+      if (cell != nullptr)
+        {
+          evaluateCell (cell, plan.order[i], runtime);
+        }
+      i++;
+    }
+}
+
+void
+Grid::recalculateCycle (const std::vector<uint64_t> &cycle,
+                        Runtime &runtime)
+{
+  std::vector<std::pair<Cell *, uint64_t> > cells;
+  for (uint64_t key : cycle)
+    {
+      Cell *cell = findCell (keyRow (key), keyCol (key));
+      if (cell != nullptr)
+        cells.push_back ({ cell, key });
+    }
+
+  if (!iterative)
+    {
+      for (auto &[cell, key] : cells)
+        {
+          cell->setValue (Value::fromString ("NULL"));
+          cell->setError ("Circular reference");
+          noteValue (keyRow (key), keyCol (key), cell->getValue ());
+        }
+      return;
+    }
+
+  // Cells that don't hold a number yet start the iteration at 0
+  for (auto &[cell, key] : cells)
+    {
+      if (!cell->getValue ().isNumeric ())
+        {
+          cell->setValue (Value::fromInt (0));
+          noteValue (keyRow (key), keyCol (key), cell->getValue ());
+        }
+    }
+
+  double change = INFINITY;
+  for (int iteration = 0; iteration < max_iterations; iteration++)
+    {
+      change = 0;
+      for (auto &[cell, key] : cells)
+        {
+          Value before = cell->getValue ();
+          evaluateCell (cell, key, runtime);
+          const Value &after = cell->getValue ();
+
+          if (before.isNumeric () && after.isNumeric ())
+            {
+              change = std::max (
+                  change, std::fabs (after.toDouble () - before.toDouble ()));
             }
           else
             {
-              std::cout << "NULL |";
+              // Anything that isn't a number can't converge
+              change = INFINITY;
             }
         }
-      std::cout << std::endl;
+      if (change < epsilon)
+        {
+          break;
+        }
+    }
+
+  // Still moving after the last pass, the values are kept but marked so
+  // they can't be taken for converged ones. An error from evaluating the
+  // cell itself says more and is left as it is.
+  if (change >= epsilon)
+    {
+      for (auto &[cell, key] : cells)
+        {
+          if (cell->getError ().empty ())
+            cell->setError ("Circular reference did not converge");
+        }
     }
 }
 
+std::unique_ptr<Primitive>
+Grid::getValue (CellAddress *address)
+{
+  std::shared_ptr<Cell> cell
+      = getCell (address->getRow (), address->getCol ());
+  if (cell == nullptr)
+    return nullptr; // Cell is empty
+  std::unique_ptr<Primitive> ret = cell->getPrimitive ();
+  return ret;
+}
+
+const Value &
+Grid::getCellValue (int row, int col)
+{
+  static const Value empty;
+  Cell *cell = findCell (row, col);
+  if (cell == nullptr)
+    return empty;
+  return cell->getValue ();
+}
+
 void
-Grid::updateGrid (std::shared_ptr<Runtime> runtime)
+Grid::getValues (CellRange range, std::vector<Value> &out)
 {
-  for (int i = 0; i < rows; ++i)
+  out.clear ();
+  // Clipped to what comes before the first cell outside the sheet in
+  // row-major order
+  if (range.top < 0 || range.top >= rows || range.left < 0)
+    return;
+  if (range.right >= cols)
+    {
+      range.bottom = range.top;
+      range.right = cols - 1;
+    }
+  range.bottom = std::min (range.bottom, rows - 1);
+  if (range.right < range.left)
+    return;
+
+  size_t width = range.right - range.left + 1;
+  out.resize (width * (range.bottom - range.top + 1));
+  if (file != nullptr)
     {
-      for (int j = 0; j < cols; ++j)
+      // Cells still in the file are read one at a time
+      for (int i = range.top; i <= range.bottom; i++)
+        for (int j = range.left; j <= range.right; j++)
+          out[(i - range.top) * width + (j - range.left)]
+              = getCellValue (i, j);
+      return;
+    }
+
+  // A tile at a time, so each is only looked up once and empty ones are
+  // skipped
+  for (int tile_top = range.top - range.top % tile_rows;
+       tile_top <= range.bottom; tile_top += tile_rows)
+    {
+      int first_row = std::max (tile_top, range.top);
+      int last_row = std::min (tile_top + tile_rows - 1, range.bottom);
+      for (int tile_left = range.left - range.left % tile_cols;
+           tile_left <= range.right; tile_left += tile_cols)
         {
-          std::shared_ptr<Cell> cell = cells[i][j];
-          if (cell != nullptr)
+          Tile *tile = findTile (tile_top, tile_left);
+          if (tile == nullptr)
+            continue;
+          int first_col = std::max (tile_left, range.left);
+          int last_col = std::min (tile_left + tile_cols - 1, range.right);
+          for (int i = first_row; i <= last_row; i++)
             {
-              std::shared_ptr<Expression> exp = cell->getExpression ();
-              if (exp != nullptr)
+              for (int j = first_col; j <= last_col; j++)
                 {
-                  cell->setPrimitive (exp->evaluate (runtime));
+                  Cell *cell
+                      = tile->cells[i - tile_top][j - tile_left].get ();
+                  if (cell != nullptr)
+                    out[(i - range.top) * width + (j - range.left)]
+                        = cell->getValue ();
                 }
             }
         }
     }
 }
 
-Grid::~Grid () {}
+std::shared_ptr<Cell>
+Grid::getCell (int row, int col)
+{
+  checkBounds (row, col);
+  if (file != nullptr)
+    {
+      findCell (row, col);
+    }
+  Tile *tile = findTile (row, col);
+  if (tile == nullptr)
+    return nullptr;
+  return tile->cells[row % tile_rows][col % tile_cols];
+}
+
+Cell *
+Grid::findCell (int row, int col)
+{
+  checkBounds (row, col);
+  Tile *tile = findTile (row, col);
+  Cell *cell = tile != nullptr
+                   ? tile->cells[row % tile_rows][col % tile_cols].get ()
+                   : nullptr;
+  if (cell == nullptr && file != nullptr)
+    {
+      return readFromFile (row, col);
+    }
+  return cell;
+}
 
-// Function to get a reference to the cells array
-std::shared_ptr<Cell> **
-Grid::getCells ()
+void
+Grid::printGrid ()
 {
-  return reinterpret_cast<std::shared_ptr<Cell> **> (cells);
-}
\ No newline at end of file
+  forEachCell ([&] (int row, int col, std::shared_ptr<Cell> &cell) {
+    std::cout << "| [" << row << ", " << col << "] ";
+    const Value &value = cell->getValue ();
+    if (!value.isEmpty ())
+      {
+        std::cout << cell->getString () << " = " << value.serialize ()
+                  << " |";
+      }
+    else
+      {
+        std::cout << "NULL |";
+      }
+    std::cout << std::endl;
+  });
+}
+
+void
+Grid::updateGrid (Runtime &runtime)
+{
+  std::vector<uint64_t> roots;
+  roots.reserve (size ());
+  forEachCell ([&] (int row, int col, std::shared_ptr<Cell> &cell) {
+    roots.push_back (cellKey (row, col));
+  });
+  recalculate (roots, runtime);
+}
+
+Grid::~Grid () {}
@@ -2,15 +2,25 @@
 #define grid_H
 
 #include "cell.h"
+#include "column.h"
+#include "dependency.h"
 #include "expression.h"
 #include "forward_declarations.h"
+#include "value.h"
+#include <algorithm>
+#include <cstdint>
 #include <iostream>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <unordered_map>
+#include <vector>
 
-/* The Grid class holds a 2D array of pointers to Cells. The rows and columns
- * are specifically hardcoded to fit my screen on a linux system (NOT
- * PORTABLE).
+/* The Grid class is a sparse store of pointers to Cells. Cells are kept in
+ * fixed size tiles (a block of tile_rows x tile_cols cells) that are only
+ * allocated once something is written into them, so memory follows the
+ * number of populated cells rather than the size of the sheet. Unpopulated
+ * cells are nullptr.
  *
  * @author Josh Makela
  * @date 12-17-2024
@@ -18,13 +28,114 @@
 class Grid
 {
 private:
-  // Data structure to store multiple cells
-  static constexpr int rows = 20;
-  static constexpr int cols = 13;
-  std::shared_ptr<Cell> cells[rows][cols];
+  // A tile is small enough to stay in cache while a range is walked, and a
+  // row of a tile is contiguous so row-major traversal stays sequential.
+  static constexpr int tile_rows = 16;
+  static constexpr int tile_cols = 8;
+
+  struct Tile
+  {
+    std::shared_ptr<Cell> cells[tile_rows][tile_cols];
+    int populated = 0;
+  };
+
+  int rows;
+  int cols;
+  std::unordered_map<uint64_t, std::unique_ptr<Tile> > tiles;
+
+  // The last tile looked up, ranges hit the same tile many times in a row.
+  // Not used while concurrent is set, when cells are being evaluated on
+  // several threads and the grid must only be read.
+  uint64_t last_key;
+  Tile *last_tile;
+  bool concurrent;
+
+  static uint64_t
+  tileKey (int tile_row, int tile_col)
+  {
+    return (static_cast<uint64_t> (tile_row) << 32)
+           | static_cast<uint32_t> (tile_col);
+  }
+
+  // What every formula reads, so edits only recalculate what they affect
+  DependencyGraph dependencies;
+
+  // The sheet file the grid was opened from, until every cell has been read
+  // out of it. read marks the cells that have been, unread counts the rest.
+  // What the file's cells reference is only added to dependencies once
+  // something is edited or recalculated.
+  std::shared_ptr<SheetFile> file;
+  std::vector<bool> read;
+  size_t unread;
+  bool file_dependencies;
+
+  // Numeric copies of the columns range functions have read, kept in step
+  // with every value written from then on. row_limit is past the last row
+  // that has ever been populated, a column never needs to be longer.
+  std::unordered_map<int, NumericColumn> columns;
+  int row_limit;
+  // Evaluating on several threads can build columns
+  std::mutex columns_mutex;
+
+  // The cells written since changes were last taken, once watchChanges has
+  // been called. Past max_changes only changed_all is kept.
+  static constexpr size_t max_changes = 4096;
+  bool watching;
+  bool changed_all;
+  std::vector<uint64_t> changes;
+
+  void
+  noteValue (int row, int col, const Value &value)
+  {
+    if (watching && !changed_all)
+      {
+        changes.push_back (cellKey (row, col));
+        if (changes.size () > max_changes)
+          {
+            changed_all = true;
+            changes.clear ();
+          }
+      }
+    if (!columns.empty ())
+      {
+        auto found = columns.find (col);
+        if (found != columns.end ())
+          found->second.set (row, value);
+      }
+  }
+
+  // Circular references are errors unless iterative calculation is on, then
+  // each cycle is evaluated repeatedly until no value in it moves more than
+  // epsilon, or max_iterations passes have been made. A cycle that is still
+  // moving then keeps its last values with an error.
+  bool iterative;
+  int max_iterations;
+  double epsilon;
+
+  Tile *findTile (int row, int col);
+  Tile *makeTile (int row, int col);
+  Cell *readFromFile (int row, int col);
+  void readAllFromFile ();
+  void readFileDependencies ();
+  void releaseFile ();
+  void replaceFromFile (int row, int col);
+  // Finds or makes the cell at (row, col) with its source and error set,
+  // or clears it and returns null if both are empty
+  Cell *placeCell (int row, int col, std::string src, std::string error);
+  // Evaluates without changing the grid, false if the cell has nothing to
+  // evaluate. Safe to call from several workers at once.
+  bool evaluate (Cell *cell, uint64_t key, Runtime &runtime, unsigned worker,
+                 Value &value, std::string &error);
+  void evaluateCell (Cell *cell, uint64_t key, Runtime &runtime);
+  void recalculate (const std::vector<uint64_t> &roots, Runtime &runtime);
+  size_t recalculateLevels (const Recalculation &plan, Runtime &runtime,
+                            ThreadPool &pool);
+  void recalculateCycle (const std::vector<uint64_t> &cycle,
+                         Runtime &runtime);
 
 public:
-  Grid ();
+  // Defaults match the addressable size of common desktop spreadsheets.
+  Grid (int rows = 1 << 20, int cols = 1 << 14);
   int
   getRows ()
   {
@@ -35,24 +146,135 @@ public:
   {
     return cols;
   }
+  // Number of populated cells in the sheet
+  size_t size ();
+  // Throws if (row, col) is outside the sheet
+  void checkBounds (int row, int col);
+
+  // Replaces every cell with the cells of a sheet file. Nothing is read
+  // until it is needed, each cell is read the first time it is looked up.
+  void open (std::shared_ptr<SheetFile> file);
+
+  // Returns null if the cell is unpopulated
   std::shared_ptr<Cell> getCell (int row, int col);
+  // Same as getCell without taking a reference. The cell is borrowed and
+  // only valid until it is next removed.
+  Cell *findCell (int row, int col);
+  // An empty source removes the cell from the grid. The cell and everything
+  // that depends on it are recalculated. A non-empty error marks a source
+  // that failed to parse, exp is then only used for the displayed value.
   void setCell (int row, int col, std::string src,
-                std::unique_ptr<Expression> exp,
-                std::shared_ptr<Runtime> runtime, std::string error);
+                std::unique_ptr<Expression> exp, Runtime &runtime,
+                std::string error);
+  // Same as setCell without recalculating anything, for loading many cells
+  // at once. Call updateGrid when they are all in.
+  void loadCell (int row, int col, std::string src,
+                 std::unique_ptr<Expression> exp, Runtime &runtime,
+                 std::string error);
+  // Same as setCell and loadCell for a source that parsed into an interned
+  // formula, see FormulaTable. The formula is shared, not copied.
+  void setFormula (int row, int col, std::string src,
+                   std::shared_ptr<Formula> formula, Runtime &runtime);
+  void loadFormula (int row, int col, std::string src,
+                    std::shared_ptr<Formula> formula, Runtime &runtime);
+  // Stores a literal value without parsing src, which should be source that
+  // evaluates to it. Also needs updateGrid afterwards.
+  void loadValue (int row, int col, std::string src, Value value);
 
   // Returns null if cell is uninitialized, Primitive otherwise
-  std::unique_ptr<Primitive> getValue (CellAddress *address,
-                                       std::shared_ptr<Runtime> runtime);
+  std::unique_ptr<Primitive> getValue (CellAddress *address);
+  // Same as getValue without allocating or copying, empty if uninitialized.
+  // Reading a cell while evaluating or drawing should go through here. The
+  // value is borrowed and only valid until the cell is next written.
+  const Value &getCellValue (int row, int col);
 
   // Function to print the grid for debugging
-  void printGrid (std::shared_ptr<Runtime> runtime);
+  void printGrid ();
+
+  // Recalculates every cell, in dependency order
+  void updateGrid (Runtime &runtime);
+
+  // Opt in to evaluating circular references iteratively. Takes effect on
+  // the next recalculation.
+  void setIterativeCalculation (bool enabled, int max_iterations = 100,
+                                double epsilon = 0.001);
 
-  void updateGrid (std::shared_ptr<Runtime> runtime);
+  // The numbers in col, for reading many rows of it at once. Borrowed, the
+  // column is only valid until the next cell is written. Safe to call while
+  // cells are evaluated on several threads.
+  const NumericColumn &getNumericColumn (int col);
 
-  // Function to get a reference to the cells array
-  std::shared_ptr<Cell> **getCells ();
+  // Replaces out with the values of range in row-major order, empty for
+  // unpopulated cells. Stops short at the first cell outside the sheet.
+  // Safe to call while cells are evaluated on several threads.
+  void getValues (CellRange range, std::vector<Value> &out);
+
+  // Starts keeping track of which cells are written, for redrawing only the
+  // ones that changed
+  void watchChanges ();
+  // Replaces out with the cellKey of every cell written since the last call,
+  // a cell may be in it more than once. False if too many were written to
+  // keep track of, then every cell should be taken as changed.
+  bool takeChanges (std::vector<uint64_t> &out);
+
+  // The ranges the cell reads, null if it reads nothing
+  const std::vector<CellRange> *getPrecedents (int row, int col);
+
+  // Calls f (row, col, cell) for every populated cell in row-major order.
+  // f must not add or remove cells.
+  template <typename F> void forEachCell (F f);
 
   ~Grid ();
 };
 
+template <typename F>
+void
+Grid::forEachCell (F f)
+{
+  if (file != nullptr)
+    {
+      readAllFromFile ();
+    }
+  std::vector<uint64_t> keys;
+  keys.reserve (tiles.size ());
+  for (auto &entry : tiles)
+    {
+      keys.push_back (entry.first);
+    }
+  // Tile rows sort first since they are in the high bits of the key
+  std::sort (keys.begin (), keys.end ());
+
+  std::vector<Tile *> band;
+  size_t k = 0;
+  while (k < keys.size ())
+    {
+      // Gather every tile in this tile row, then walk them a row at a time
+      uint64_t tile_row = keys[k] >> 32;
+      size_t band_start = k;
+      band.clear ();
+      while (k < keys.size () && keys[k] >> 32 == tile_row)
+        {
+          band.push_back (tiles[keys[k]].get ());
+          k++;
+        }
+      int first_row = static_cast<int> (tile_row) * tile_rows;
+      for (int i = 0; i < tile_rows; i++)
+        {
+          for (size_t t = 0; t < band.size (); t++)
+            {
+              int first_col
+                  = static_cast<int> (keys[band_start + t] & 0xffffffff)
+                    * tile_cols;
+              for (int j = 0; j < tile_cols; j++)
+                {
+                  if (band[t]->cells[i][j] != nullptr)
+                    {
+                      f (first_row + i, first_col + j, band[t]->cells[i][j]);
+                    }
+                }
+            }
+        }
+    }
+}
+
 #endif
@@ -1,10 +1,12 @@
 #include "interface.h"
-#include "lexer.h"
+#include "formula.h"
 #include "parser.h"
 #include "runtime.h"
+#include <algorithm>
 #include <memory>
 #include <ncurses.h>
 #include <string>
+#include <vector>
 
 Interface::Interface ()
 {
@@ -21,6 +23,14 @@ Interface::Interface ()
   cur_col = 0; // Current column
   cur_x = 0;   // Current x position
   cur_y = 0;   // Current y position
+  top_row = 0;
+  left_col = 0;
+  view_rows = 0;
+  view_cols = 0;
+  shown_top = 0;
+  shown_left = 0;
+  shown_row = 0;
+  shown_col = 0;
 }
 
 Interface::~Interface () { this->deleteWindows (); }
@@ -62,6 +72,8 @@ Interface::makeWindows ()
   error_win
       = newwin (error_dim.height, error_dim.width, error_dim.y, error_dim.x);
   grid_win = newwin (grid_dim.height, grid_dim.width, grid_dim.y, grid_dim.x);
+  // Nothing is drawn in the new grid window yet
+  shown.clear ();
 }
 
 void
@@ -107,6 +119,29 @@ Interface::shrinkWindows ()
   error_dim.x += 1;
 
   this->makeWindows ();
+
+  // Each row takes two lines (value and separator) and each column 16
+  // characters, so this is how much of the sheet fits on screen.
+  view_rows = (grid_dim.height + 1) / 2;
+  view_cols = (grid_dim.width + 1) / 16;
+}
+
+// Moves the viewport just far enough that the cursor is visible.
+void
+Interface::scrollToCursor ()
+{
+  if (cur_row < top_row)
+    top_row = cur_row;
+  else if (cur_row >= top_row + view_rows)
+    top_row = cur_row - view_rows + 1;
+
+  if (cur_col < left_col)
+    left_col = cur_col;
+  else if (cur_col >= left_col + view_cols)
+    left_col = cur_col - view_cols + 1;
+
+  cur_y = (cur_row - top_row) * 2;
+  cur_x = (cur_col - left_col) * 16;
 }
 
 void
@@ -133,43 +168,39 @@ Interface::drawGridLines ()
 void
 Interface::gridLoop ()
 {
-  // Declared in grid.h, I don't think C allows variables to be taken when
-  // making a a 2D array, which is what would be made if I called Grid() with
-  // row and column parameters. These are also arbitrary to make it look good
-  // on my screen size. Possibly improve in the future?
-  int grid_row_len = 20;
-  int grid_col_len = 13;
   int c;
 
+  // The runtime lives as long as the grid, so moving around the sheet only
+  // costs a redraw.
   std::shared_ptr<Grid> grid = std::make_shared<Grid> ();
   std::shared_ptr<Runtime> runtime = std::make_shared<Runtime> (grid);
-  std::unique_ptr<CellAddress> cur_celladdr
-      = std::make_unique<CellAddress> (cur_row, cur_col, -1, -1);
+  FormulaTable formulas;
+  grid->watchChanges ();
 
   while (true)
     {
       // Print current cell in output
-      cur_celladdr = std::make_unique<CellAddress> (cur_row, cur_col, -1, -1);
-      runtime = nullptr;
-      runtime = std::make_shared<Runtime> (grid);
-
       werase (editor_win);
       werase (output_win);
       werase (error_win);
 
-      std::shared_ptr<Cell> cell = grid->getCell (cur_row, cur_col);
-      std::string output = cell->getPrimitive (runtime)->serialize ();
-      std::string current_source = cell->getString ();
-      std::string error = cell->getError ();
+      std::string output = "";
+      std::string current_source = "";
+      std::string error = "";
+      Cell *cell = grid->findCell (cur_row, cur_col);
+      if (cell != nullptr)
+        {
+          output = cell->getValue ().serialize ();
+          current_source = cell->getString ();
+          error = cell->getError ();
+        }
 
       waddstr (editor_win, current_source.c_str ());
       waddstr (output_win, output.c_str ());
       waddstr (error_win, error.c_str ());
 
-      cur_x = getcurx (grid_win);
-      cur_y = getcury (grid_win);
-
-      this->drawGridPrimitives (grid, runtime);
+      this->scrollToCursor ();
+      this->drawGridPrimitives (grid);
 
       wmove (grid_win, cur_y, cur_x);
 
@@ -182,23 +213,19 @@ Interface::gridLoop ()
       switch (c)
         {
         case KEY_UP:
-          wmove (grid_win, getcury (grid_win) - 2, getcurx (grid_win));
           if (cur_row > 0)
             cur_row--;
           break;
         case KEY_DOWN:
-          wmove (grid_win, getcury (grid_win) + 2, getcurx (grid_win));
-          if (cur_row < grid_row_len - 1)
+          if (cur_row < grid->getRows () - 1)
             cur_row++;
           break;
         case KEY_LEFT:
-          wmove (grid_win, getcury (grid_win), getcurx (grid_win) - 16);
           if (cur_col > 0)
             cur_col--;
           break;
         case KEY_RIGHT:
-          wmove (grid_win, getcury (grid_win), getcurx (grid_win) + 16);
-          if (cur_col < grid_col_len - 1)
+          if (cur_col < grid->getCols () - 1)
             cur_col++;
           break;
         case KEY_ENTER:
@@ -209,18 +236,16 @@ Interface::gridLoop ()
             std::string source = this->editorLoop (current_source);
             try
               {
-                Lexer lexer = Lexer (source);
-                Parser parser = Parser (*(lexer.lex ()));
-                grid->setCell (cur_row, cur_col, source, parser.parse (),
-                               runtime, "");
+                grid->setFormula (cur_row, cur_col, source,
+                                  formulas.intern (source, cur_row, cur_col),
+                                  *runtime);
               }
             catch (std::exception &e)
               {
                 grid->setCell (cur_row, cur_col, source,
                                std::make_unique<String> ("NULL", 0, 0),
-                               runtime, e.what ());
+                               *runtime, e.what ());
               }
-            grid->updateGrid (runtime);
           }
           break;
         default:
@@ -241,9 +266,23 @@ Interface::editorLoop (std::string source)
   std::string new_source = source;
   int c;
   bool exit = false;
+  // Syntax errors are shown as the source is typed. Only the end of the
+  // source is ever edited, so that is where it changed.
+  IncrementalParser syntax;
+  size_t changed = 0;
+  bool edited = true;
   while (!exit)
     {
+      if (edited)
+        {
+          werase (error_win);
+          wprintw (error_win, "%s",
+                   syntax.check (new_source, changed).c_str ());
+          wrefresh (error_win);
+          edited = false;
+        }
       c = getch ();
+      changed = new_source.size ();
       switch (c)
         {
           // NOT IMPLEMENTED
@@ -269,6 +308,7 @@ Interface::editorLoop (std::string source)
             {
               new_source += '\n';
               waddch (editor_win, c);
+              edited = true;
             }
           break;
         case KEY_DC: // May choose to not support this later
@@ -298,6 +338,11 @@ Interface::editorLoop (std::string source)
                      getcurx (editor_win) - 1);
               wdelch (editor_win);
             }
+          if (new_source.size () < changed)
+            {
+              changed = new_source.size ();
+              edited = true;
+            }
 
           break;
         case KEY_END:
@@ -306,6 +351,7 @@ Interface::editorLoop (std::string source)
         default:
           new_source += c;
           waddch (editor_win, c);
+          edited = true;
           break;
         }
 
@@ -316,44 +362,103 @@ Interface::editorLoop (std::string source)
   return new_source;
 }
 
+// Formats a value as it is shown in the grid, cut or padded with spaces to
+// 15 characters. The padding also clears whatever was drawn there before.
+static void
+formatCell (const Value &value, std::string &out)
+{
+  out = value.serialize ();
+  out.resize (15, ' ');
+}
+
 void
-Interface::drawGridPrimitives (std::shared_ptr<Grid> grid,
-                               std::shared_ptr<Runtime> runtime)
+Interface::drawGridPrimitives (std::shared_ptr<Grid> grid)
 {
-  int i = 0;
-  int y = 0;
-  while (i < grid->getRows ())
+  // Only the cells inside the viewport are drawn, the sheet itself may be
+  // far larger than the window. Of those, only the ones that changed value
+  // and the old and new cursor cells are drawn again, unless it scrolled.
+  int rows = std::min (view_rows, grid->getRows () - top_row);
+  int cols = std::min (view_cols, grid->getCols () - left_col);
+  size_t count = static_cast<size_t> (view_rows) * view_cols;
+  auto draw = [&] (int r, int c) {
+    mvwaddnstr (grid_win, r * 2, c * 16, shown[r * view_cols + c].c_str (),
+                15);
+  };
+
+  bool scrolled = shown.size () != count || top_row != shown_top
+                  || left_col != shown_left;
+  if (scrolled)
     {
-      int j = 0;
-      int x = 0;
-      while (j < grid->getCols ())
+      // The cells that stay in view just move, only the ones scrolled into
+      // it are formatted
+      std::vector<std::string> moved (count);
+      for (int r = 0; r < rows; r++)
         {
-          CellAddress address (i, j, -1, -1);
-          std::unique_ptr<Primitive> value
-              = grid->getValue (&address, runtime);
-
-          if (value)
+          for (int c = 0; c < cols; c++)
             {
-              std::string str = value->serialize ().substr (
-                  0, 15); // Limit to 15 characters
-                          // If primitive is empty string, just draw spaces
-              str += std::string (15 - str.length (),
-                                  ' '); // Pad with spaces
-              mvwprintw (grid_win, y, x, "%s", str.c_str ());
+              int old_r = r + top_row - shown_top;
+              int old_c = c + left_col - shown_left;
+              std::string &cell = moved[r * view_cols + c];
+              if (shown.size () == count && old_r >= 0 && old_r < view_rows
+                  && old_c >= 0 && old_c < view_cols
+                  && !shown[old_r * view_cols + old_c].empty ())
+                cell = std::move (shown[old_r * view_cols + old_c]);
+              else
+                formatCell (grid->getCellValue (top_row + r, left_col + c),
+                            cell);
             }
-          x += 16; // Move to the next column
-          ++j;
         }
-      y += 2; // Move to the next row
-      ++i;
+      shown.swap (moved);
+      shown_top = top_row;
+      shown_left = left_col;
+    }
+
+  // A cell that was written but shows the same isn't drawn again
+  auto update = [&] (int r, int c) {
+    formatCell (grid->getCellValue (top_row + r, left_col + c), text);
+    std::string &cell = shown[r * view_cols + c];
+    if (cell != text)
+      {
+        cell.swap (text);
+        if (!scrolled)
+          draw (r, c);
+      }
+  };
+  if (grid->takeChanges (changes))
+    {
+      for (uint64_t key : changes)
+        {
+          int r = keyRow (key) - top_row;
+          int c = keyCol (key) - left_col;
+          if (r >= 0 && r < rows && c >= 0 && c < cols)
+            update (r, c);
+        }
+    }
+  else
+    {
+      for (int r = 0; r < rows; r++)
+        for (int c = 0; c < cols; c++)
+          update (r, c);
     }
+
+  if (scrolled)
+    {
+      for (int r = 0; r < rows; r++)
+        for (int c = 0; c < cols; c++)
+          draw (r, c);
+    }
+  else if (shown_row != cur_row || shown_col != cur_col)
+    {
+      // Takes the reverse video off the old cursor cell, which is still in
+      // view since the viewport didn't move
+      draw (shown_row - top_row, shown_col - left_col);
+    }
+  shown_row = cur_row;
+  shown_col = cur_col;
+
   // Move cursor to cur_x and cur_y, then print the cell primitive in reverse
   // video attribute.
   wattr_on (grid_win, A_REVERSE, NULL);
-  CellAddress curaddr (cur_row, cur_col, -1, -1);
-  std::unique_ptr<Primitive> cur_value = grid->getValue (&curaddr, runtime);
-  std::string cur_str = cur_value->serialize ().substr (0, 15);
-  cur_str += std::string (15 - cur_str.length (), ' ');
-  mvwprintw (grid_win, cur_y, cur_x, "%s", cur_str.c_str ());
+  draw (cur_row - top_row, cur_col - left_col);
   wattr_off (grid_win, A_REVERSE, NULL);
-}
\ No newline at end of file
+}
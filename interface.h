@@ -2,6 +2,7 @@
 #include <memory>
 #include <ncurses.h>
 #include <string>
+#include <vector>
 
 typedef struct Dimension_t
 {
@@ -26,10 +27,27 @@ private:
   int cur_col;
   int cur_x;
   int cur_y;
+  // First row and column shown in the grid window, and how many fit
+  int top_row;
+  int left_col;
+  int view_rows;
+  int view_cols;
+
+  // What is drawn in each cell of the viewport, row-major and padded to the
+  // width of a cell, with the viewport and cursor it was drawn for. Only
+  // cells the grid reports as changed are formatted again.
+  std::vector<std::string> shown;
+  int shown_top;
+  int shown_left;
+  int shown_row;
+  int shown_col;
+  std::vector<uint64_t> changes;
+  std::string text;
+
+  void scrollToCursor ();
 
   std::string editorLoop (std::string source);
-  void drawGridPrimitives (std::shared_ptr<Grid> grid,
-                           std::shared_ptr<Runtime> runtime);
+  void drawGridPrimitives (std::shared_ptr<Grid> grid);
   void makeWindows ();
   void deleteWindows ();
 
@@ -0,0 +1,574 @@
+#ifndef kernels_H
+#define kernels_H
+
+#include "value.h"
+#include <array>
+#include <cmath>
+#include <cstddef>
+#include <stdexcept>
+#include <string>
+#include <utility>
+
+/* Kernels implement an operator for one combination of operand types, which
+ * are template parameters so each kernel compiles down to just the work for
+ * those types. Operations dispatches to them through tables indexed by the
+ * operand types, the virtual machine calls them directly when the compiler
+ * already knows the types.
+ */
+
+using BinaryKernel = Value (*) (const Value &leftval, const Value &rightval);
+using UnaryKernel = Value (*) (const Value &val);
+
+// The tables have an entry for every ValueType
+constexpr size_t value_types
+    = static_cast<size_t> (ValueType::CELLADDRESS) + 1;
+
+constexpr bool
+isNumericType (ValueType type)
+{
+  return type == ValueType::INTEGER || type == ValueType::FLOAT;
+}
+
+// A number whose type is known, widened the same way C++ arithmetic would
+template <ValueType T>
+float
+asFloat (const Value &val)
+{
+  if constexpr (T == ValueType::INTEGER)
+    return static_cast<float> (val.getInt ());
+  else
+    return val.getFloat ();
+}
+
+//--------------- Arithmetic Operations -------------------
+
+// Add, Subtract and Multiply. Integers stay Integers, any other mix of
+// numbers is a Float.
+template <typename Op> struct Arithmetic
+{
+  template <ValueType L, ValueType R>
+  static Value
+  apply (const Value &leftval, const Value &rightval)
+  {
+    if constexpr (L == ValueType::INTEGER && R == ValueType::INTEGER)
+      {
+        return Value::fromInt (
+            Op::apply (leftval.getInt (), rightval.getInt ()));
+      }
+    else if constexpr (isNumericType (L) && isNumericType (R))
+      {
+        return Value::fromFloat (
+            Op::apply (asFloat<L> (leftval), asFloat<R> (rightval)));
+      }
+    else if constexpr (Op::joins_strings && L == ValueType::STRING
+                       && R == ValueType::STRING)
+      {
+        std::string joined (leftval.getString ());
+        joined += rightval.getString ();
+        return Value::fromString (joined);
+      }
+    else
+      {
+        throw std::runtime_error (Op::unsupported);
+      }
+  }
+};
+
+struct AddOp
+{
+  static constexpr bool joins_strings = true;
+  static constexpr const char *unsupported
+      = "Unsupported types for Add operation";
+  template <typename T>
+  static T
+  apply (T left, T right)
+  {
+    return left + right;
+  }
+};
+
+struct SubtractOp
+{
+  static constexpr bool joins_strings = false;
+  static constexpr const char *unsupported
+      = "Unsupported types for Subtract operation";
+  template <typename T>
+  static T
+  apply (T left, T right)
+  {
+    return left - right;
+  }
+};
+
+struct MultiplyOp
+{
+  static constexpr bool joins_strings = false;
+  static constexpr const char *unsupported
+      = "Unsupported types for Multiply operation";
+  template <typename T>
+  static T
+  apply (T left, T right)
+  {
+    return left * right;
+  }
+};
+
+struct DivideKernel
+{
+  template <ValueType L, ValueType R>
+  static Value
+  apply (const Value &leftval, const Value &rightval)
+  {
+    if constexpr (L == ValueType::INTEGER && R == ValueType::INTEGER)
+      {
+        // C++ defines integer division as truncation toward zero, so this
+        // works well enough.
+        if (rightval.getInt () == 0)
+          {
+            throw std::runtime_error ("Division by zero error");
+          }
+        return Value::fromInt (leftval.getInt () / rightval.getInt ());
+      }
+    else if constexpr (isNumericType (L) && isNumericType (R))
+      {
+        if (asFloat<R> (rightval) == 0.0f)
+          {
+            throw std::runtime_error ("Division by zero error");
+          }
+        return Value::fromFloat (asFloat<L> (leftval) / asFloat<R> (rightval));
+      }
+    else
+      {
+        throw std::runtime_error ("Unsupported types for Divide operation");
+      }
+  }
+};
+
+struct ModuloKernel
+{
+  template <ValueType L, ValueType R>
+  static Value
+  apply (const Value &leftval, const Value &rightval)
+  {
+    if constexpr (L == ValueType::INTEGER && R == ValueType::INTEGER)
+      {
+        if (rightval.getInt () == 0)
+          {
+            throw std::runtime_error ("Modulo by zero error");
+          }
+        return Value::fromInt (leftval.getInt () % rightval.getInt ());
+      }
+    else
+      {
+        throw std::runtime_error ("Unsupported types for Modulo operation");
+      }
+  }
+};
+
+// Both operands must be the same type, Integer or Float
+struct ExponentiateKernel
+{
+  template <ValueType L, ValueType R>
+  static Value
+  apply (const Value &leftval, const Value &rightval)
+  {
+    if constexpr (L != R)
+      {
+        throw std::runtime_error ("Type mismatch in Exponentiation operation");
+      }
+    else if constexpr (L == ValueType::INTEGER)
+      {
+        return Value::fromInt (static_cast<int> (
+            std::pow (leftval.getInt (), rightval.getInt ())));
+      }
+    else if constexpr (L == ValueType::FLOAT)
+      {
+        return Value::fromFloat (
+            std::pow (leftval.getFloat (), rightval.getFloat ()));
+      }
+    else
+      {
+        throw std::runtime_error (
+            "Unsupported types for Exponentiation operation");
+      }
+  }
+};
+
+struct NegateKernel
+{
+  template <ValueType T>
+  static Value
+  apply (const Value &val)
+  {
+    if constexpr (T == ValueType::INTEGER)
+      return Value::fromInt (-val.getInt ());
+    else if constexpr (T == ValueType::FLOAT)
+      return Value::fromFloat (-val.getFloat ());
+    else
+      throw std::runtime_error ("Unsupported type for Negation operation");
+  }
+};
+
+//--------------- Logical Operations -------------------
+// A false left operand of And (or a true one of Or) decides the result
+// whatever the right operand is.
+
+struct AndKernel
+{
+  template <ValueType L, ValueType R>
+  static Value
+  apply (const Value &leftval, const Value &rightval)
+  {
+    if constexpr (L != ValueType::BOOLEAN)
+      {
+        throw std::runtime_error ("Unsupported type for And operation");
+      }
+    else
+      {
+        if (leftval.getBool () == false)
+          {
+            return Value::fromBool (false);
+          }
+        if constexpr (R == ValueType::BOOLEAN)
+          return Value::fromBool (rightval.getBool ());
+        else
+          throw std::runtime_error ("Unsupported type for And operation");
+      }
+  }
+};
+
+struct OrKernel
+{
+  template <ValueType L, ValueType R>
+  static Value
+  apply (const Value &leftval, const Value &rightval)
+  {
+    if constexpr (L != ValueType::BOOLEAN)
+      {
+        throw std::runtime_error ("Unsupported type for Or operation");
+      }
+    else
+      {
+        if (leftval.getBool () == true)
+          {
+            return Value::fromBool (true);
+          }
+        if constexpr (R == ValueType::BOOLEAN)
+          return Value::fromBool (rightval.getBool ());
+        else
+          throw std::runtime_error ("Unsupported type for Or operation");
+      }
+  }
+};
+
+struct NotKernel
+{
+  template <ValueType T>
+  static Value
+  apply (const Value &val)
+  {
+    if constexpr (T == ValueType::BOOLEAN)
+      return Value::fromBool (!val.getBool ());
+    else
+      throw std::runtime_error ("Unsupported types for Not operation");
+  }
+};
+
+//--------------- Bitwise Operations -------------------
+
+template <typename Op> struct Bitwise
+{
+  template <ValueType L, ValueType R>
+  static Value
+  apply (const Value &leftval, const Value &rightval)
+  {
+    if constexpr (L == ValueType::INTEGER && R == ValueType::INTEGER)
+      return Value::fromInt (
+          Op::apply (leftval.getInt (), rightval.getInt ()));
+    else
+      throw std::runtime_error (Op::unsupported);
+  }
+};
+
+struct BitAndOp
+{
+  static constexpr const char *unsupported
+      = "Unsupported types for BitAnd operation";
+  static int
+  apply (int left, int right)
+  {
+    return left & right;
+  }
+};
+
+struct BitOrOp
+{
+  static constexpr const char *unsupported
+      = "Unsupported types for BitOr operation";
+  static int
+  apply (int left, int right)
+  {
+    return left | right;
+  }
+};
+
+struct BitXorOp
+{
+  static constexpr const char *unsupported
+      = "Unsupported types for BitXor operation";
+  static int
+  apply (int left, int right)
+  {
+    return left ^ right;
+  }
+};
+
+struct LeftShiftOp
+{
+  static constexpr const char *unsupported
+      = "Unsupported types for LeftShift operation";
+  static int
+  apply (int left, int right)
+  {
+    return left << right;
+  }
+};
+
+struct RightShiftOp
+{
+  static constexpr const char *unsupported
+      = "Unsupported types for RightShift operation";
+  static int
+  apply (int left, int right)
+  {
+    return left >> right;
+  }
+};
+
+struct BitNotKernel
+{
+  template <ValueType T>
+  static Value
+  apply (const Value &val)
+  {
+    if constexpr (T == ValueType::INTEGER)
+      return Value::fromInt (~val.getInt ());
+    else
+      throw std::runtime_error ("Unsupported types for BitNot operation");
+  }
+};
+
+//--------------- Relational Operations -------------------
+// Operands must be the same type. Equality also compares Booleans and
+// Strings, ordering is only for numbers.
+
+template <typename Op> struct Equality
+{
+  template <ValueType L, ValueType R>
+  static Value
+  apply (const Value &leftval, const Value &rightval)
+  {
+    if constexpr (L != R)
+      throw std::runtime_error (Op::mismatch);
+    else if constexpr (L == ValueType::INTEGER)
+      return Value::fromBool (
+          Op::apply (leftval.getInt (), rightval.getInt ()));
+    else if constexpr (L == ValueType::FLOAT)
+      return Value::fromBool (
+          Op::apply (leftval.getFloat (), rightval.getFloat ()));
+    else if constexpr (L == ValueType::BOOLEAN)
+      return Value::fromBool (
+          Op::apply (leftval.getBool (), rightval.getBool ()));
+    else if constexpr (L == ValueType::STRING)
+      return Value::fromBool (
+          Op::apply (leftval.getString (), rightval.getString ()));
+    else
+      throw std::runtime_error (Op::unsupported);
+  }
+};
+
+template <typename Op> struct Ordering
+{
+  template <ValueType L, ValueType R>
+  static Value
+  apply (const Value &leftval, const Value &rightval)
+  {
+    if constexpr (L != R)
+      throw std::runtime_error (Op::mismatch);
+    else if constexpr (L == ValueType::INTEGER)
+      return Value::fromBool (
+          Op::apply (leftval.getInt (), rightval.getInt ()));
+    else if constexpr (L == ValueType::FLOAT)
+      return Value::fromBool (
+          Op::apply (leftval.getFloat (), rightval.getFloat ()));
+    else
+      throw std::runtime_error (Op::unsupported);
+  }
+};
+
+struct EqualsOp
+{
+  static constexpr const char *mismatch = "Type mismatch in Equals operation";
+  static constexpr const char *unsupported
+      = "Unsupported types for Equals operation";
+  template <typename T>
+  static bool
+  apply (T left, T right)
+  {
+    return left == right;
+  }
+};
+
+struct NotEqualsOp
+{
+  static constexpr const char *mismatch
+      = "Type mismatch in NotEquals operation";
+  static constexpr const char *unsupported
+      = "Unsupported types for NotEqual operation";
+  template <typename T>
+  static bool
+  apply (T left, T right)
+  {
+    return left != right;
+  }
+};
+
+struct LessThanOp
+{
+  static constexpr const char *mismatch
+      = "Type mismatch in LessThan operation";
+  static constexpr const char *unsupported
+      = "Unsupported types for LessThan operation";
+  template <typename T>
+  static bool
+  apply (T left, T right)
+  {
+    return left < right;
+  }
+};
+
+struct LessThanEqualOp
+{
+  static constexpr const char *mismatch
+      = "Type mismatch in LessThanEqual operation";
+  static constexpr const char *unsupported
+      = "Unsupported types for LessThanEqual operation";
+  template <typename T>
+  static bool
+  apply (T left, T right)
+  {
+    return left <= right;
+  }
+};
+
+struct GreaterThanOp
+{
+  static constexpr const char *mismatch
+      = "Type mismatch in GreaterThan operation";
+  static constexpr const char *unsupported
+      = "Unsupported types for GreaterThan operation";
+  template <typename T>
+  static bool
+  apply (T left, T right)
+  {
+    return left > right;
+  }
+};
+
+struct GreaterThanEqualOp
+{
+  static constexpr const char *mismatch
+      = "Type mismatch in GreaterThanEqual operation";
+  static constexpr const char *unsupported
+      = "Unsupported types for GreaterThanEqual operation";
+  template <typename T>
+  static bool
+  apply (T left, T right)
+  {
+    return left >= right;
+  }
+};
+
+//--------------- Casting Operations -------------------
+
+struct FloatToIntKernel
+{
+  template <ValueType T>
+  static Value
+  apply (const Value &val)
+  {
+    if constexpr (T == ValueType::FLOAT)
+      return Value::fromInt (static_cast<int> (val.getFloat ()));
+    else if constexpr (T == ValueType::INTEGER)
+      return val;
+    else
+      throw std::runtime_error ("Unsupported types for FloatToInt operation");
+  }
+};
+
+struct IntToFloatKernel
+{
+  template <ValueType T>
+  static Value
+  apply (const Value &val)
+  {
+    if constexpr (T == ValueType::INTEGER)
+      return Value::fromFloat (static_cast<float> (val.getInt ()));
+    else if constexpr (T == ValueType::FLOAT)
+      return val;
+    else
+      throw std::runtime_error ("Unsupported types for IntToFloatoperation");
+  }
+};
+
+//--------------- Tables -------------------
+// Entry left * value_types + right of a binary table is the kernel for that
+// pair of types, entry type of a unary table the kernel for that type.
+
+template <typename Kernel, size_t... I>
+constexpr std::array<BinaryKernel, sizeof...(I)>
+makeBinaryTable (std::index_sequence<I...>)
+{
+  return { &Kernel::template apply<static_cast<ValueType> (I / value_types),
+                                   static_cast<ValueType> (
+                                       I % value_types)>... };
+}
+
+template <typename Kernel>
+constexpr std::array<BinaryKernel, value_types * value_types>
+binaryTable ()
+{
+  return makeBinaryTable<Kernel> (
+      std::make_index_sequence<value_types * value_types> ());
+}
+
+template <typename Kernel, size_t... I>
+constexpr std::array<UnaryKernel, sizeof...(I)>
+makeUnaryTable (std::index_sequence<I...>)
+{
+  return { &Kernel::template apply<static_cast<ValueType> (I)>... };
+}
+
+template <typename Kernel>
+constexpr std::array<UnaryKernel, value_types>
+unaryTable ()
+{
+  return makeUnaryTable<Kernel> (std::make_index_sequence<value_types> ());
+}
+
+inline Value
+dispatch (const std::array<BinaryKernel, value_types * value_types> &table,
+          const Value &leftval, const Value &rightval)
+{
+  return table[static_cast<size_t> (leftval.getType ()) * value_types
+               + static_cast<size_t> (rightval.getType ())](leftval,
+                                                             rightval);
+}
+
+inline Value
+dispatch (const std::array<UnaryKernel, value_types> &table, const Value &val)
+{
+  return table[static_cast<size_t> (val.getType ())](val);
+}
+
+#endif
@@ -1,25 +1,102 @@
 #include "lexer.h"
 #include <iostream>
-#include <memory>
+#include <stdexcept>
+
+void
+Lexer::reset (std::string_view source)
+{
+  this->source = source;
+  i = 0;
+  tokens.clear ();
+}
+
+size_t
+Lexer::resume (std::string_view source, size_t changed)
+{
+  // The source moves when an edit makes its buffer grow, which happens
+  // rarely enough that the kept tokens can be moved with it
+  if (source.data () != this->source.data ())
+    {
+      for (Token &token : tokens)
+        {
+          token = Token (source.substr (token.getStartIndex (),
+                                        token.getText ().size ()),
+                         token.getType (), token.getStartIndex (),
+                         token.getEndIndex ());
+        }
+    }
+  this->source = source;
+
+  // A token depends on its own characters and the one after it, which
+  // could have joined it (12 and 3, < and =). A string ends at its closing
+  // quote, one past its text.
+  auto last = [] (const Token &token) {
+    return static_cast<size_t> (token.getEndIndex ())
+           + (token.getType () == TokenType::STRING ? 1 : 0);
+  };
+  while (!tokens.empty () && last (tokens.back ()) + 1 >= changed)
+    {
+      tokens.pop_back ();
+    }
+  i = tokens.empty () ? 0 : last (tokens.back ()) + 1;
+  return tokens.size ();
+}
 
 bool
 Lexer::has (char target)
 {
-  return source[i] == target;
+  return i < source.size () && source[i] == target;
 }
 
 void
 Lexer::capture ()
 {
-  token_so_far += source[i];
   i++;
 }
 
 void
 Lexer::emit_token (TokenType type)
 {
-  tokens.emplace_back (token_so_far, type, i - token_so_far.size (), i - 1);
-  token_so_far.clear ();
+  tokens.emplace_back (source.substr (token_start, i - token_start), type,
+                       token_start, i - 1);
+}
+
+// Keywords are told apart by length and first letter, so an identifier is
+// compared with at most two of them
+static TokenType
+keyword (std::string_view word)
+{
+  auto is = [&] (std::string_view name, TokenType type) {
+    return word == name ? type : TokenType::VARIABLE;
+  };
+  switch (word.size () * 128 + word[0])
+    {
+    case 2 * 128 + 'i':
+      return word[1] == 'f' ? is ("if", TokenType::IF)
+                            : is ("in", TokenType::IN);
+    case 3 * 128 + 'e':
+      return is ("end", TokenType::END);
+    case 3 * 128 + 'f':
+      return is ("for", TokenType::FOR);
+    case 3 * 128 + 'i':
+      return is ("int", TokenType::FLOATTOINT);
+    case 3 * 128 + 'm':
+      return word[1] == 'i' ? is ("min", TokenType::MIN)
+                            : is ("max", TokenType::MAX);
+    case 3 * 128 + 's':
+      return is ("sum", TokenType::SUM);
+    case 4 * 128 + 'e':
+      return is ("else", TokenType::ELSE);
+    case 4 * 128 + 'm':
+      return is ("mean", TokenType::MEAN);
+    case 4 * 128 + 't':
+      return is ("true", TokenType::BOOLEAN);
+    case 5 * 128 + 'f':
+      return word[1] == 'a' ? is ("false", TokenType::BOOLEAN)
+                            : is ("float", TokenType::INTTOFLOAT);
+    default:
+      return TokenType::VARIABLE;
+    }
 }
 
 bool
@@ -63,11 +140,12 @@ Lexer::has_newline ()
   return source[i] == '\n';
 }
 
-std::unique_ptr<std::vector<Token> >
+std::vector<Token> &
 Lexer::lex ()
 {
   while (i < source.size ())
     {
+      token_start = i;
       if (has_whitespace ())
         {
           i++;
@@ -103,58 +181,7 @@ Lexer::lex ()
             {
               capture ();
             }
-          if (token_so_far == "true" || token_so_far == "false")
-            {
-              emit_token (TokenType::BOOLEAN);
-            }
-          else if (token_so_far == "sum")
-            {
-              emit_token (TokenType::SUM);
-            }
-          else if (token_so_far == "mean")
-            {
-              emit_token (TokenType::MEAN);
-            }
-          else if (token_so_far == "min")
-            {
-              emit_token (TokenType::MIN);
-            }
-          else if (token_so_far == "max")
-            {
-              emit_token (TokenType::MAX);
-            }
-          else if (token_so_far == "float")
-            {
-              emit_token (TokenType::INTTOFLOAT);
-            }
-          else if (token_so_far == "int")
-            {
-              emit_token (TokenType::FLOATTOINT);
-            }
-          else if (token_so_far == "if")
-            {
-              emit_token (TokenType::IF);
-            }
-          else if (token_so_far == "else")
-            {
-              emit_token (TokenType::ELSE);
-            }
-          else if (token_so_far == "for")
-            {
-              emit_token (TokenType::FOR);
-            }
-          else if (token_so_far == "in")
-            {
-              emit_token (TokenType::IN);
-            }
-          else if (token_so_far == "end")
-            {
-              emit_token (TokenType::END);
-            }
-          else
-            {
-              emit_token (TokenType::VARIABLE);
-            }
+          emit_token (keyword (source.substr (token_start, i - token_start)));
         }
       else if (has ('+'))
         {
@@ -320,7 +347,8 @@ Lexer::lex ()
       else if (has ('\"'))
         {
           capture ();
-          while (!has ('\"'))
+          token_start = i; // The quotes aren't part of the text
+          while (i < source.size () && !has ('\"'))
             {
               capture ();
             }
@@ -328,12 +356,8 @@ Lexer::lex ()
             {
               throw std::runtime_error ("Unterminated string");
             }
-          capture ();
-          token_so_far = token_so_far.substr (
-              1,
-              token_so_far.size () - 2); // Trim quotes, maybe change so that
-                                         // there is an advance() method?
           emit_token (TokenType::STRING);
+          capture ();
         }
       else if (has ('.'))
         {
@@ -366,5 +390,5 @@ Lexer::lex ()
                                     + "\' at index = " + std::to_string (i));
         }
     }
-  return std::make_unique<std::vector<Token> > (tokens);
+  return tokens;
 }
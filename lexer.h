@@ -4,19 +4,30 @@
 #include "token.h"
 #include <cctype>
 #include <iostream>
-#include <memory>
+#include <string_view>
 #include <vector>
 
+// Splits source into Tokens. Tokens are views into the source, nothing is
+// copied, so the source must outlive them.
 class Lexer
 {
 private:
-  std::string source;
+  std::string_view source;
   size_t i;
-  std::string token_so_far;
+  size_t token_start; // Where the token being lexed begins
   std::vector<Token> tokens;
 
 public:
-  Lexer (std::string source) : source (source), i (0), token_so_far ("") {}
+  Lexer (std::string_view source = "")
+      : source (source), i (0), token_start (0)
+  {
+  }
+  // Starts over on another source, keeping the memory for its tokens
+  void reset (std::string_view source);
+  // For source that is the source last lexed with everything from offset
+  // changed on edited. The tokens that end before the edit are kept and lex
+  // carries on after them. Returns how many were kept.
+  size_t resume (std::string_view source, size_t changed);
   bool has (char target);
   void capture ();
   void emit_token (TokenType type);
@@ -25,7 +36,9 @@ public:
   bool has_digit ();
   bool has_whitespace ();
   bool has_newline ();
-  std::unique_ptr<std::vector<Token> > lex ();
+  // Borrowed, valid until the lexer is reset, resumed or destroyed. Tokens
+  // lexed before an error are still there afterwards.
+  std::vector<Token> &lex ();
 };
 
 #endif
\ No newline at end of file
@@ -1,9 +1,15 @@
+#include "batch.h"
 #include "interface.h"
 #include <ncurses.h>
+#include <string>
 
 int
-main ()
+main (int argc, char **argv)
 {
+  if (argc > 1 && std::string (argv[1]) == "--batch")
+    {
+      return Batch::run (argc, argv);
+    }
 
   initscr ();
   cbreak (); // Explicitly disable IO buffering
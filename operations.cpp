@@ -0,0 +1,453 @@
+/* Contains the semantics of every operator, see operations.h. Anything an
+ * operator doesn't support throws a runtime_error.
+ */
+
+#include "operations.h"
+#include "kernels.h"
+#include "runtime.h"
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+#include <string>
+
+//--------------- Operators -------------------
+// Each operator looks up the kernel for its operand types in a table that
+// is generated at compile time, see kernels.h.
+
+static constexpr auto add_table = binaryTable<Arithmetic<AddOp>> ();
+
+Value
+Operations::add (const Value &leftval, const Value &rightval)
+{
+  return dispatch (add_table, leftval, rightval);
+}
+
+static constexpr auto subtract_table = binaryTable<Arithmetic<SubtractOp>> ();
+
+Value
+Operations::subtract (const Value &leftval, const Value &rightval)
+{
+  return dispatch (subtract_table, leftval, rightval);
+}
+
+static constexpr auto multiply_table = binaryTable<Arithmetic<MultiplyOp>> ();
+
+Value
+Operations::multiply (const Value &leftval, const Value &rightval)
+{
+  return dispatch (multiply_table, leftval, rightval);
+}
+
+static constexpr auto divide_table = binaryTable<DivideKernel> ();
+
+Value
+Operations::divide (const Value &leftval, const Value &rightval)
+{
+  return dispatch (divide_table, leftval, rightval);
+}
+
+static constexpr auto modulo_table = binaryTable<ModuloKernel> ();
+
+Value
+Operations::modulo (const Value &leftval, const Value &rightval)
+{
+  return dispatch (modulo_table, leftval, rightval);
+}
+
+static constexpr auto exponentiate_table = binaryTable<ExponentiateKernel> ();
+
+Value
+Operations::exponentiate (const Value &leftval, const Value &rightval)
+{
+  return dispatch (exponentiate_table, leftval, rightval);
+}
+
+static constexpr auto logical_and_table = binaryTable<AndKernel> ();
+
+Value
+Operations::logicalAnd (const Value &leftval, const Value &rightval)
+{
+  return dispatch (logical_and_table, leftval, rightval);
+}
+
+static constexpr auto logical_or_table = binaryTable<OrKernel> ();
+
+Value
+Operations::logicalOr (const Value &leftval, const Value &rightval)
+{
+  return dispatch (logical_or_table, leftval, rightval);
+}
+
+static constexpr auto bit_and_table = binaryTable<Bitwise<BitAndOp>> ();
+
+Value
+Operations::bitAnd (const Value &leftval, const Value &rightval)
+{
+  return dispatch (bit_and_table, leftval, rightval);
+}
+
+static constexpr auto bit_or_table = binaryTable<Bitwise<BitOrOp>> ();
+
+Value
+Operations::bitOr (const Value &leftval, const Value &rightval)
+{
+  return dispatch (bit_or_table, leftval, rightval);
+}
+
+static constexpr auto bit_xor_table = binaryTable<Bitwise<BitXorOp>> ();
+
+Value
+Operations::bitXor (const Value &leftval, const Value &rightval)
+{
+  return dispatch (bit_xor_table, leftval, rightval);
+}
+
+static constexpr auto left_shift_table = binaryTable<Bitwise<LeftShiftOp>> ();
+
+Value
+Operations::leftShift (const Value &leftval, const Value &rightval)
+{
+  return dispatch (left_shift_table, leftval, rightval);
+}
+
+static constexpr auto right_shift_table
+    = binaryTable<Bitwise<RightShiftOp>> ();
+
+Value
+Operations::rightShift (const Value &leftval, const Value &rightval)
+{
+  return dispatch (right_shift_table, leftval, rightval);
+}
+
+static constexpr auto equals_table = binaryTable<Equality<EqualsOp>> ();
+
+Value
+Operations::equals (const Value &leftval, const Value &rightval)
+{
+  return dispatch (equals_table, leftval, rightval);
+}
+
+static constexpr auto not_equals_table = binaryTable<Equality<NotEqualsOp>> ();
+
+Value
+Operations::notEquals (const Value &leftval, const Value &rightval)
+{
+  return dispatch (not_equals_table, leftval, rightval);
+}
+
+static constexpr auto less_than_table = binaryTable<Ordering<LessThanOp>> ();
+
+Value
+Operations::lessThan (const Value &leftval, const Value &rightval)
+{
+  return dispatch (less_than_table, leftval, rightval);
+}
+
+static constexpr auto less_than_equal_table
+    = binaryTable<Ordering<LessThanEqualOp>> ();
+
+Value
+Operations::lessThanEqual (const Value &leftval, const Value &rightval)
+{
+  return dispatch (less_than_equal_table, leftval, rightval);
+}
+
+static constexpr auto greater_than_table
+    = binaryTable<Ordering<GreaterThanOp>> ();
+
+Value
+Operations::greaterThan (const Value &leftval, const Value &rightval)
+{
+  return dispatch (greater_than_table, leftval, rightval);
+}
+
+static constexpr auto greater_than_equal_table
+    = binaryTable<Ordering<GreaterThanEqualOp>> ();
+
+Value
+Operations::greaterThanEqual (const Value &leftval, const Value &rightval)
+{
+  return dispatch (greater_than_equal_table, leftval, rightval);
+}
+
+static constexpr auto negate_table = unaryTable<NegateKernel> ();
+
+Value
+Operations::negate (const Value &val)
+{
+  return dispatch (negate_table, val);
+}
+
+static constexpr auto logical_not_table = unaryTable<NotKernel> ();
+
+Value
+Operations::logicalNot (const Value &val)
+{
+  return dispatch (logical_not_table, val);
+}
+
+static constexpr auto bit_not_table = unaryTable<BitNotKernel> ();
+
+Value
+Operations::bitNot (const Value &val)
+{
+  return dispatch (bit_not_table, val);
+}
+
+static constexpr auto float_to_int_table = unaryTable<FloatToIntKernel> ();
+
+Value
+Operations::floatToInt (const Value &val)
+{
+  return dispatch (float_to_int_table, val);
+}
+
+static constexpr auto int_to_float_table = unaryTable<IntToFloatKernel> ();
+
+Value
+Operations::intToFloat (const Value &val)
+{
+  return dispatch (int_to_float_table, val);
+}
+
+//--------------------------- Cell Values --------------------------
+
+// Row and column MUST evaluate to Integers
+Value
+Operations::address (const Value &rowval, const Value &colval)
+{
+  if (rowval.getType () == ValueType::INTEGER
+      && colval.getType () == ValueType::INTEGER)
+    {
+      return Value::fromAddress (rowval.getInt (), colval.getInt ());
+    }
+  else
+    {
+      throw std::runtime_error ("Unsupported types for LValue");
+    }
+}
+
+Value
+Operations::cell (Runtime &runtime, const Value &rowval,
+                  const Value &colval)
+{
+  if (rowval.getType () == ValueType::INTEGER
+      && colval.getType () == ValueType::INTEGER)
+    {
+      return readCell (runtime, rowval.getInt (), colval.getInt ());
+    }
+  else
+    {
+      throw std::runtime_error ("Unsupported types for RValue");
+    }
+}
+
+Value
+Operations::readCell (Runtime &runtime, int row, int col)
+{
+  const Value &cellval = runtime.getCell (row, col);
+  if (cellval.isEmpty ())
+    {
+      // Unpopulated cells read as the empty string
+      return Value::fromString ("");
+    }
+  return cellval;
+}
+
+// Enough cells to make reading them at once worth it, few enough that the
+// values stay in cache
+static constexpr int batch_cells = 4096;
+
+int
+Operations::readRows (Runtime &runtime, CellRange range, int row,
+                      std::vector<Value> &out)
+{
+  long width = static_cast<long> (range.right) - range.left + 1;
+  int rows = static_cast<int> (std::max (batch_cells / width, 1L));
+  range.top = row;
+  if (range.bottom - row >= rows)
+    range.bottom = row + rows - 1;
+  runtime.getGrid ().getValues (range, out);
+  for (Value &cellval : out)
+    {
+      if (cellval.isEmpty ())
+        cellval = Value::fromString ("");
+    }
+  return range.bottom + 1;
+}
+
+//--------------------- Statistical Functions --------------------------
+// All of them iterate in row-major order and skip empty and non-numeric
+// cells, design choice.
+
+CellRange
+Operations::range (const Value &topLeft, const Value &bottomRight)
+{
+  if (topLeft.getType () != ValueType::CELLADDRESS)
+    {
+      throw std::runtime_error ("Invalid left address");
+    }
+
+  if (bottomRight.getType () != ValueType::CELLADDRESS)
+    {
+      throw std::runtime_error ("Invalid right address");
+    }
+
+  CellRange range = { topLeft.getRow (), topLeft.getCol (),
+                      bottomRight.getRow (), bottomRight.getCol () };
+  if (range.top > range.bottom || range.left > range.right)
+    {
+      throw std::runtime_error (
+          "Cells must be ordered (topLeft, bottomRight)");
+    }
+  return range;
+}
+
+// Ranges with fewer rows than this are read a cell at a time, they aren't
+// worth copying a column for.
+static constexpr int column_rows = 64;
+
+// Calls f (column, first, last) with the rows [first, last) of each column
+// of range, if range is tall enough to read through NumericColumns. Returns
+// false if it isn't and the cells need to be read one at a time.
+template <typename F>
+static bool
+forEachColumn (Runtime &runtime, CellRange range, F f)
+{
+  if (range.bottom - range.top < column_rows)
+    {
+      return false;
+    }
+  // The same errors as reading every cell
+  Grid &grid = runtime.getGrid ();
+  grid.checkBounds (range.top, range.left);
+  grid.checkBounds (range.bottom, range.right);
+  for (int col = range.left; col <= range.right; col++)
+    {
+      f (grid.getNumericColumn (col), range.top, range.bottom + 1);
+    }
+  return true;
+}
+
+Value
+Operations::max (Runtime &runtime, CellRange range)
+{
+  double max = -INFINITY;
+  if (forEachColumn (runtime, range,
+                     [&] (const NumericColumn &column, int first, int last) {
+                       max = std::max (max, column.max (first, last));
+                     }))
+    {
+      return Value::fromFloat (max);
+    }
+
+  for (int i = range.top; i <= range.bottom; i++)
+    {
+      for (int j = range.left; j <= range.right; j++)
+        {
+          const Value &cellval = runtime.getCell (i, j);
+          if (!cellval.isNumeric ())
+            {
+              continue;
+            }
+          if (cellval.toDouble () > max)
+            {
+              max = cellval.toDouble ();
+            }
+        }
+    }
+
+  return Value::fromFloat (max);
+}
+
+Value
+Operations::min (Runtime &runtime, CellRange range)
+{
+  double min = INFINITY;
+  if (forEachColumn (runtime, range,
+                     [&] (const NumericColumn &column, int first, int last) {
+                       min = std::min (min, column.min (first, last));
+                     }))
+    {
+      return Value::fromFloat (min);
+    }
+
+  for (int i = range.top; i <= range.bottom; i++)
+    {
+      for (int j = range.left; j <= range.right; j++)
+        {
+          const Value &cellval = runtime.getCell (i, j);
+          if (!cellval.isNumeric ())
+            {
+              continue;
+            }
+          if (cellval.toDouble () < min)
+            {
+              min = cellval.toDouble ();
+            }
+        }
+    }
+
+  return Value::fromFloat (min);
+}
+
+Value
+Operations::mean (Runtime &runtime, CellRange range)
+{
+  int count = 0;
+  double sum = 0;
+  if (!forEachColumn (runtime, range, [&] (const NumericColumn &column,
+                                           int first, int last) {
+        count += column.count (first, last);
+        sum += column.sum (first, last);
+      }))
+    {
+      for (int i = range.top; i <= range.bottom; i++)
+        {
+          for (int j = range.left; j <= range.right; j++)
+            {
+              const Value &cellval = runtime.getCell (i, j);
+              if (!cellval.isNumeric ())
+                {
+                  continue;
+                }
+              count += 1;
+              sum += cellval.toDouble ();
+            }
+        }
+    }
+
+  if (count == 0)
+    {
+      return Value::fromFloat (0); // Avoid division by zero
+    }
+
+  return Value::fromFloat (sum / count);
+}
+
+Value
+Operations::sum (Runtime &runtime, CellRange range)
+{
+  double sum = 0;
+  if (forEachColumn (runtime, range,
+                     [&] (const NumericColumn &column, int first, int last) {
+                       sum += column.sum (first, last);
+                     }))
+    {
+      return Value::fromFloat (sum);
+    }
+
+  for (int i = range.top; i <= range.bottom; i++)
+    {
+      for (int j = range.left; j <= range.right; j++)
+        {
+          const Value &cellval = runtime.getCell (i, j);
+          if (!cellval.isNumeric ())
+            {
+              continue;
+            }
+          sum += cellval.toDouble ();
+        }
+    }
+  return Value::fromFloat (sum);
+}
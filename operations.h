@@ -0,0 +1,71 @@
+#ifndef operations_H
+#define operations_H
+
+#include "dependency.h"
+#include "forward_declarations.h"
+#include "value.h"
+#include <vector>
+
+/* Operations holds what every operator does to the Values it is given. The
+ * expression tree and the virtual machine both evaluate through here, so the
+ * two always agree on types, results and error messages.
+ */
+class Operations
+{
+public:
+  // Arithmetic
+  static Value add (const Value &leftval, const Value &rightval);
+  static Value subtract (const Value &leftval, const Value &rightval);
+  static Value multiply (const Value &leftval, const Value &rightval);
+  static Value divide (const Value &leftval, const Value &rightval);
+  static Value modulo (const Value &leftval, const Value &rightval);
+  static Value exponentiate (const Value &leftval, const Value &rightval);
+  static Value negate (const Value &val);
+
+  // Logical
+  static Value logicalAnd (const Value &leftval, const Value &rightval);
+  static Value logicalOr (const Value &leftval, const Value &rightval);
+  static Value logicalNot (const Value &val);
+
+  // Bitwise
+  static Value bitAnd (const Value &leftval, const Value &rightval);
+  static Value bitOr (const Value &leftval, const Value &rightval);
+  static Value bitXor (const Value &leftval, const Value &rightval);
+  static Value bitNot (const Value &val);
+  static Value leftShift (const Value &leftval, const Value &rightval);
+  static Value rightShift (const Value &leftval, const Value &rightval);
+
+  // Relational
+  static Value equals (const Value &leftval, const Value &rightval);
+  static Value notEquals (const Value &leftval, const Value &rightval);
+  static Value lessThan (const Value &leftval, const Value &rightval);
+  static Value lessThanEqual (const Value &leftval, const Value &rightval);
+  static Value greaterThan (const Value &leftval, const Value &rightval);
+  static Value greaterThanEqual (const Value &leftval,
+                                 const Value &rightval);
+
+  // Casting
+  static Value floatToInt (const Value &val);
+  static Value intToFloat (const Value &val);
+
+  // Cells. address and cell take the row and column an LValue or RValue
+  // evaluated to, readCell gives unpopulated cells as the empty string.
+  static Value address (const Value &rowval, const Value &colval);
+  static Value cell (Runtime &runtime, const Value &rowval,
+                     const Value &colval);
+  static Value readCell (Runtime &runtime, int row, int col);
+  // readCell of each cell of range in row-major order, for loops. Reads as
+  // many rows from row on as make a batch and returns the row after them.
+  // out stops short where the range leaves the sheet, see Grid::getValues.
+  static int readRows (Runtime &runtime, CellRange range, int row,
+                       std::vector<Value> &out);
+
+  // Statistical functions over the rectangle between two addresses
+  static CellRange range (const Value &topLeft, const Value &bottomRight);
+  static Value max (Runtime &runtime, CellRange range);
+  static Value min (Runtime &runtime, CellRange range);
+  static Value mean (Runtime &runtime, CellRange range);
+  static Value sum (Runtime &runtime, CellRange range);
+};
+
+#endif
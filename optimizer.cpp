@@ -0,0 +1,78 @@
+#include "optimizer.h"
+#include "expression.h"
+#include "runtime.h"
+#include <exception>
+
+// Evaluates an expression without Effects, which never looks at the grid or
+// the frame it is given. Null if it throws or evaluates to nothing.
+static std::unique_ptr<Primitive>
+fold (Expression &exp)
+{
+  static Runtime nothing (nullptr);
+  Frame frame;
+  EvalContext context{ nothing, -1, -1, frame };
+  std::unique_ptr<Primitive> ret;
+  try
+    {
+      ret = exp.evaluateValue (context).toPrimitive ();
+    }
+  catch (const std::exception &)
+    {
+      return nullptr;
+    }
+  if (ret != nullptr)
+    {
+      ret->setSpan (exp.getStartIndex (), exp.getEndIndex ());
+    }
+  return ret;
+}
+
+Optimizer::Optimizer () : hidden (0) {}
+
+std::unique_ptr<Expression>
+Optimizer::optimize (std::unique_ptr<Expression> exp)
+{
+  Optimizer optimizer;
+  return optimizer.visit (std::move (exp));
+}
+
+std::string
+Optimizer::hiddenName ()
+{
+  return "$h" + std::to_string (hidden++);
+}
+
+std::unique_ptr<Expression>
+Optimizer::visit (std::unique_ptr<Expression> exp)
+{
+  exp->forEachOperand ([this] (std::unique_ptr<Expression> &operand) {
+    operand = visit (std::move (operand));
+  });
+  if (dynamic_cast<Primitive *> (exp.get ()) != nullptr)
+    {
+      return exp;
+    }
+
+  if (exp->isPure ())
+    {
+      std::unique_ptr<Primitive> folded = fold (*exp);
+      if (folded != nullptr)
+        {
+          return folded;
+        }
+    }
+
+  std::unique_ptr<Expression> simpler = exp->simplify ();
+  if (simpler != nullptr)
+    {
+      simpler->setSpan (exp->getStartIndex (), exp->getEndIndex ());
+      return simpler;
+    }
+
+  ForExpr *loop = dynamic_cast<ForExpr *> (exp.get ());
+  if (loop != nullptr)
+    {
+      loop->hoistInvariants (*this);
+    }
+  return exp;
+}
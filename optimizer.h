@@ -0,0 +1,38 @@
+#ifndef optimizer_H
+#define optimizer_H
+
+#include "forward_declarations.h"
+#include <memory>
+#include <string>
+
+/* Optimizer rewrites a parsed Expression tree into a simpler one that
+ * evaluates the same way. Subtrees without Effects are evaluated once and
+ * replaced with the Primitive they evaluate to, which also turns literal
+ * addresses like [1,2] into CellAddresses. Identities like x*1 are removed
+ * where the static types show the result is unchanged, see
+ * Expression::simplify, and loops have what only reads cells hoisted out of
+ * them, see ForExpr::hoistInvariants.
+ *
+ * A replacement keeps the start and end of what it replaced. Subtrees that
+ * throw are left as they are, so the error still comes from evaluating the
+ * cell.
+ */
+class Optimizer
+{
+private:
+  // Hidden variables handed out so far
+  int hidden;
+
+  Optimizer ();
+  std::unique_ptr<Expression> visit (std::unique_ptr<Expression> exp);
+
+public:
+  static std::unique_ptr<Expression>
+  optimize (std::unique_ptr<Expression> exp);
+
+  // A variable name that can't be written in a formula, different every
+  // time it is called
+  std::string hiddenName ();
+};
+
+#endif
@@ -1,4 +1,6 @@
 #include "parser.h"
+#include "optimizer.h"
+#include <charconv>
 
 bool
 Parser::has (TokenType type)
@@ -8,14 +10,50 @@ Parser::has (TokenType type)
   return i < tokens.size () && tokens.at (i).getType () == type;
 };
 
+// The number a token's text is, read without copying it
+template <typename T>
+static T
+number (const Token &token)
+{
+  std::string_view text = token.getText ();
+  T val;
+  auto result = std::from_chars (text.data (), text.data () + text.size (),
+                                 val);
+  if (result.ec != std::errc () || result.ptr != text.data () + text.size ())
+    {
+      throw std::runtime_error (
+          "Number out of range at index "
+          + std::to_string (token.getStartIndex ()));
+    }
+  return val;
+}
+
 void
 Parser::advance ()
 {
   i++;
 }
 
+std::string
+Parser::position ()
+{
+  if (i < tokens.size ())
+    {
+      return std::to_string (tokens[i].getStartIndex ());
+    }
+  // Past the last token, as while a formula is still being typed
+  return std::to_string (tokens.empty () ? 0 : tokens.back ().getEndIndex ()
+                                                   + 1);
+}
+
 std::unique_ptr<Expression>
 Parser::parse ()
+{
+  return Optimizer::optimize (parseTree ());
+}
+
+std::unique_ptr<Expression>
+Parser::parseTree ()
 {
   if (tokens.empty ())
     {
@@ -28,10 +66,10 @@ Parser::parse ()
   // tokens after the expression.
   if (i < tokens.size ())
     {
-      std::string text = tokens.at (i).getText ();
+      std::string text (tokens.at (i).getText ());
       // Turn tokens vector into a debug format with Token strings
 
-      std::string index = std::to_string (tokens.at (i).getStartIndex ());
+      std::string index = position ();
       throw std::runtime_error ("Syntax error around " + text + " at index "
                                 + index);
     }
@@ -46,7 +84,9 @@ Parser::block ()
   while (i < tokens.size ())
     {
 
-      std::unique_ptr<Expression> statement = assignment ();
+      std::unique_ptr<Expression> statement
+          = incremental != nullptr ? incremental->statement (*this)
+                                   : assignment ();
       statements.push_back (std::move (statement));
       while (has (TokenType::NEWLINE) || has (TokenType::SEMICOLON))
         {
@@ -372,21 +412,29 @@ Parser::level12 ()
       ret = level0 ();
       if (!has (TokenType::RIGHTPARENTHESIS))
         {
-          std::string index = std::to_string (tokens[i].getStartIndex ());
+          std::string index = position ();
           throw std::runtime_error ("Expected right parenthesis at index "
                                     + index);
         }
     }
   else if (has (TokenType::INTEGER))
     {
-      int val = std::stoi (tokens[i].getText ());
+      int val = number<int> (tokens[i]);
       int start_index = tokens[i].getStartIndex ();
       int end_index = tokens[i].getEndIndex ();
       ret = std::make_unique<Integer> (val, start_index, end_index);
     }
+  else if (has (TokenType::ROW_OFFSET) || has (TokenType::COL_OFFSET))
+    {
+      bool isRow = has (TokenType::ROW_OFFSET);
+      int offset = number<int> (tokens[i]) - (isRow ? row : col);
+      int start_index = tokens[i].getStartIndex ();
+      int end_index = tokens[i].getEndIndex ();
+      ret = std::make_unique<Offset> (isRow, offset, start_index, end_index);
+    }
   else if (has (TokenType::FLOAT))
     {
-      float val = std::stof (tokens[i].getText ());
+      float val = number<float> (tokens[i]);
       int start_index = tokens[i].getStartIndex ();
       int end_index = tokens[i].getEndIndex ();
       ret = std::make_unique<Float> (val, start_index, end_index);
@@ -400,7 +448,7 @@ Parser::level12 ()
     }
   else if (has (TokenType::STRING))
     {
-      std::string val = tokens[i].getText ();
+      std::string val (tokens[i].getText ());
       int start_index = tokens[i].getStartIndex ();
       int end_index = tokens[i].getEndIndex ();
       ret = std::make_unique<String> (val, start_index, end_index);
@@ -411,14 +459,14 @@ Parser::level12 ()
       std::unique_ptr<Expression> left = level0 ();
       if (!has (TokenType::COMMA))
         {
-          std::string index = std::to_string (tokens.at (i).getStartIndex ());
+          std::string index = position ();
           throw std::runtime_error ("Expected comma at index " + index);
         }
       advance (); // Consume comma
       std::unique_ptr<Expression> right = level0 ();
       if (!has (TokenType::RIGHTBRACKET))
         {
-          std::string index = std::to_string (tokens.at (i).getStartIndex ());
+          std::string index = position ();
           throw std::runtime_error ("Expected right bracket at index "
                                     + index);
         }
@@ -435,16 +483,14 @@ Parser::level12 ()
           std::unique_ptr<Expression> left = level0 ();
           if (!has (TokenType::COMMA))
             {
-              std::string index
-                  = std::to_string (tokens.at (i).getStartIndex ());
+              std::string index = position ();
               throw std::runtime_error ("Expected comma at index " + index);
             }
           advance (); // Consume comma
           std::unique_ptr<Expression> right = level0 ();
           if (!has (TokenType::RIGHTBRACKET))
             {
-              std::string index
-                  = std::to_string (tokens.at (i).getStartIndex ());
+              std::string index = position ();
               throw std::runtime_error ("Expected right bracket at index "
                                         + index);
             }
@@ -454,14 +500,14 @@ Parser::level12 ()
         }
       else
         {
-          std::string index = std::to_string (tokens.at (i).getStartIndex ());
+          std::string index = position ();
           throw std::runtime_error (
               "Expected left bracket after hashtag at index " + index);
         }
     }
   else if (has (TokenType::VARIABLE))
     { // TODO
-      std::string val = tokens.at (i).getText ();
+      std::string val (tokens.at (i).getText ());
       int start_index = tokens.at (i).getStartIndex ();
       int end_index = tokens.at (i).getEndIndex ();
       // advance ();
@@ -473,7 +519,7 @@ Parser::level12 ()
       advance ();
       if (!has (TokenType::LEFTPARENTHESIS))
         {
-          std::string index = std::to_string (tokens.at (i).getStartIndex ());
+          std::string index = position ();
           throw std::runtime_error ("Expected left parenthesis at index "
                                     + index);
         }
@@ -481,7 +527,7 @@ Parser::level12 ()
       std::unique_ptr<Expression> exp = level0 ();
       if (!has (TokenType::RIGHTPARENTHESIS))
         {
-          std::string index = std::to_string (tokens.at (i).getStartIndex ());
+          std::string index = position ();
           throw std::runtime_error ("Expected right parenthesis at index "
                                     + index);
         }
@@ -506,7 +552,7 @@ Parser::level12 ()
       advance ();
       if (!has (TokenType::LEFTPARENTHESIS))
         {
-          std::string index = std::to_string (tokens.at (i).getStartIndex ());
+          std::string index = position ();
           throw std::runtime_error ("Expected left parenthesis at index "
                                     + index);
         }
@@ -514,14 +560,14 @@ Parser::level12 ()
       std::unique_ptr<Expression> left = level0 ();
       if (!has (TokenType::COMMA))
         {
-          std::string index = std::to_string (tokens.at (i).getStartIndex ());
+          std::string index = position ();
           throw std::runtime_error ("Expected comma at index " + index);
         }
       advance (); // Consume comma
       std::unique_ptr<Expression> right = level0 ();
       if (!has (TokenType::RIGHTPARENTHESIS))
         {
-          std::string index = std::to_string (tokens.at (i).getStartIndex ());
+          std::string index = position ();
           throw std::runtime_error ("Expected right parenthesis at index "
                                     + index);
         }
@@ -557,7 +603,7 @@ Parser::level12 ()
       std::unique_ptr<Expression> condition = level0 ();
       if (!has (TokenType::NEWLINE))
         {
-          std::string index = std::to_string (tokens.at (i).getStartIndex ());
+          std::string index = position ();
           throw std::runtime_error ("Expected newline in if statement");
         }
       // Consume NEWLINE
@@ -592,14 +638,14 @@ Parser::level12 ()
       std::unique_ptr<Expression> variable = level0 ();
       if (!has (TokenType::IN))
         {
-          std::string index = std::to_string (tokens.at (i).getStartIndex ());
+          std::string index = position ();
           throw std::runtime_error ("Expected 'in' after 'for' variable");
         }
       advance ();
       std::unique_ptr<Expression> left = level0 ();
       if (!has (TokenType::DOTDOT))
         {
-          std::string index = std::to_string (tokens.at (i).getStartIndex ());
+          std::string index = position ();
           throw std::runtime_error ("Expected .. at index " + index);
         }
       advance ();
@@ -607,7 +653,7 @@ Parser::level12 ()
 
       if (!has (TokenType::NEWLINE))
         {
-          std::string index = std::to_string (tokens.at (i).getStartIndex ());
+          std::string index = position ();
           throw std::runtime_error ("Expected newline in for statement");
         }
 
@@ -627,8 +673,12 @@ Parser::level12 ()
   else
     {
       // Should not be reached if lexer works correctly and all token types are
-      // handled
-      std::string token = tokens.at (i).getText ();
+      // handled. Reached all the time while a formula is being typed.
+      if (i >= tokens.size ())
+        {
+          throw std::runtime_error ("Unexpected end of formula");
+        }
+      std::string token (tokens.at (i).getText ());
       throw std::runtime_error ("Syntax error on token: \"" + token + "\"");
     }
 
@@ -636,3 +686,62 @@ Parser::level12 ()
 
   return ret;
 }
+
+// ---------------- IncrementalParser ----------------
+std::unique_ptr<Expression>
+IncrementalParser::statement (Parser &parser)
+{
+  size_t first = parser.i;
+  if (starts[first] >= 0)
+    {
+      Statement &parsed = statements[starts[first]];
+      if (!parsed.error.empty ())
+        {
+          throw std::runtime_error (parsed.error);
+        }
+      parser.i = parsed.next;
+      return std::make_unique<String> ("", parsed.start, parsed.end);
+    }
+
+  auto record = [&] (int start, int end, std::string error) {
+    starts[first] = static_cast<int> (statements.size ());
+    statements.push_back ({ first, parser.i, start, end, std::move (error) });
+  };
+  try
+    {
+      std::unique_ptr<Expression> exp = parser.assignment ();
+      record (exp->getStartIndex (), exp->getEndIndex (), "");
+      return exp;
+    }
+  catch (std::exception &e)
+    {
+      record (0, 0, e.what ());
+      throw;
+    }
+}
+
+std::string
+IncrementalParser::check (std::string_view source, size_t changed)
+{
+  // What looked at a token from the edit on has to be parsed again
+  size_t kept = lexer.resume (source, changed);
+  while (!statements.empty () && statements.back ().next >= kept)
+    {
+      starts[statements.back ().first] = -1;
+      statements.pop_back ();
+    }
+
+  try
+    {
+      const std::vector<Token> &tokens = lexer.lex ();
+      starts.resize (tokens.size () + 1, -1);
+      Parser parser (tokens);
+      parser.incremental = this;
+      parser.parseTree ();
+    }
+  catch (std::exception &e)
+    {
+      return e.what ();
+    }
+  return "";
+}
@@ -2,26 +2,47 @@
 #define parser_H
 
 #include "expression.h"
+#include "lexer.h"
 #include "token.h"
 #include <memory>
 #include <stack>
 #include <string>
 #include <vector>
 
+class IncrementalParser;
+
 class Parser
 {
 private:
-  std::vector<Token> tokens;
+  const std::vector<Token> &tokens;
   size_t i;
+  // The cell ROW_OFFSET and COL_OFFSET tokens are relative to
+  int row;
+  int col;
+  // Set while checking a source that is being edited, see below
+  IncrementalParser *incremental;
+
+  friend class IncrementalParser;
 
 public:
-  Parser (std::vector<Token> tokens) : tokens (tokens), i (0) {}
+  // The tokens are borrowed, they have to outlive the parser but not what
+  // it parses. (row, col) is only needed for tokens from FormulaTable.
+  Parser (const std::vector<Token> &tokens, int row = 0, int col = 0)
+      : tokens (tokens), i (0), row (row), col (col), incremental (nullptr)
+  {
+  }
 
   bool has (TokenType type);
   void advance ();
+  // The source index of the current token for error messages, or the one
+  // after the last token at the end of them
+  std::string position ();
 
-  // See grammar.txt for the grammar
+  // See grammar.txt for the grammar. The tree is already optimized, see
+  // optimizer.h.
   std::unique_ptr<Expression> parse ();
+  // Same as parse without optimizing the tree
+  std::unique_ptr<Expression> parseTree ();
   std::unique_ptr<Expression> block ();
   std::unique_ptr<Expression> assignment ();
   std::unique_ptr<Expression> level0 ();
@@ -39,4 +60,45 @@ public:
   std::unique_ptr<Expression> level12 ();
 };
 
+/* IncrementalParser checks the syntax of a source as it is edited. The
+ * tokens before an edit are kept, see Lexer::resume, and so is what parsing
+ * each statement that only looked at those tokens came to: the span it
+ * covered, or the error it threw. Parsing again skips over them, so only
+ * the statements around the edit are parsed, along with the blocks that
+ * hold them.
+ */
+class IncrementalParser
+{
+private:
+  // A statement parsed from token first up to token next, where it ended
+  // or threw error. Nothing past next was looked at.
+  struct Statement
+  {
+    size_t first;
+    size_t next;
+    int start;
+    int end;
+    std::string error;
+  };
+
+  Lexer lexer;
+  // In the order they were parsed in, which is also the order of next since
+  // parsing never goes back
+  std::vector<Statement> statements;
+  // The index in statements of the statement starting at each token, -1 if
+  // there isn't one
+  std::vector<int> starts;
+
+  friend class Parser;
+  // Parses the statement at the parser's position, or skips it if it was
+  // parsed before. A skipped statement is a placeholder with its span.
+  std::unique_ptr<Expression> statement (Parser &parser);
+
+public:
+  // source is the source last checked with everything from offset changed
+  // on edited, 0 the first time. It has to stay alive until the next check.
+  // Returns the syntax error, empty if there isn't one.
+  std::string check (std::string_view source, size_t changed);
+};
+
 #endif
\ No newline at end of file
@@ -1,61 +1,79 @@
 #include "runtime.h"
+#include <algorithm>
 #include <memory>
+#include <thread>
 
-Runtime::Runtime (std::shared_ptr<Grid> grid) : grid (grid) {};
-
-std::unique_ptr<Primitive>
-Runtime::getCell (CellAddress *address, std::shared_ptr<Runtime> runtime)
+void
+Frame::reset (size_t count)
 {
-  return grid->getValue (address, runtime);
+  slots.assign (count, Value::fromInt (0));
 }
 
 void
-Runtime::setVariable (std::string name, std::unique_ptr<Primitive> value)
+Frame::set (int slot, Value value)
 {
-  variables[name] = std::move (value);
+  if (static_cast<size_t> (slot) >= slots.size ())
+    {
+      slots.resize (slot + 1, Value::fromInt (0));
+    }
+  slots[slot] = std::move (value);
 }
 
-std::unique_ptr<Primitive>
-Runtime::getVariable (std::string name)
+Runtime::Runtime (std::shared_ptr<Grid> grid) : grid (grid)
 {
-  // Weirdness follows
-  // Make a copy of the variable based on the type of variables[name]
+  setThreads (1);
+}
 
-  if (variables[name] == nullptr)
-    {
-      return std::make_unique<Integer> (0, -1, -1);
-    }
+const Value &
+Runtime::getCell (int row, int col)
+{
+  return grid->getCellValue (row, col);
+}
 
-  if (typeid (*(variables[name])) == typeid (Integer))
-    {
-      return std::make_unique<Integer> (
-          dynamic_cast<Integer &> (*variables[name]).getVal (), -1, -1);
-    }
-  else if (typeid (*(variables[name])) == typeid (Float))
-    {
-      return std::make_unique<Float> (
-          dynamic_cast<Float &> (*variables[name]).getVal (), -1, -1);
-    }
-  else if (typeid (*(variables[name])) == typeid (Boolean))
-    {
-      return std::make_unique<Boolean> (
-          dynamic_cast<Boolean &> (*variables[name]).getVal (), -1, -1);
-    }
-  else if (typeid (*(variables[name])) == typeid (String))
-    {
-      return std::make_unique<String> (
-          dynamic_cast<String &> (*variables[name]).getVal (), -1, -1);
-    }
-  else if (typeid (*(variables[name])) == typeid (CellAddress))
+Grid &
+Runtime::getGrid ()
+{
+  return *grid;
+}
+
+void
+Runtime::setThreads (unsigned threads)
+{
+  if (threads == 0)
     {
-      return std::make_unique<CellAddress> (
-          dynamic_cast<CellAddress &> (*variables[name]).getRow (),
-          dynamic_cast<CellAddress &> (*variables[name]).getCol (), -1, -1);
+      threads = std::max (1u, std::thread::hardware_concurrency ());
     }
-  else
+  pool = threads > 1 ? std::make_unique<ThreadPool> (threads) : nullptr;
+  workers.resize (threads);
+  for (std::unique_ptr<Worker> &worker : workers)
     {
-      throw std::runtime_error ("Unsupported type in getVariable");
+      if (worker == nullptr)
+        worker = std::make_unique<Worker> ();
     }
 }
 
-Runtime::~Runtime () {}
\ No newline at end of file
+unsigned
+Runtime::getThreads ()
+{
+  return workers.size ();
+}
+
+ThreadPool *
+Runtime::getPool ()
+{
+  return pool.get ();
+}
+
+VirtualMachine &
+Runtime::getMachine (unsigned worker)
+{
+  return workers[worker]->machine;
+}
+
+Frame &
+Runtime::getFrame (unsigned worker)
+{
+  return workers[worker]->frame;
+}
+
+Runtime::~Runtime () {}
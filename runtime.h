@@ -3,28 +3,87 @@
 
 #include "forward_declarations.h"
 #include "grid.h"
+#include "threadpool.h"
+#include "value.h"
+#include "vm.h"
 #include <memory>
-#include <unordered_map>
+#include <vector>
 
-// Runtime contains a pointer to a Grid object, and will contain more
-// information in the future.
+// The variables of one evaluation. The compiler gives each variable name
+// of a formula a slot, and the frame holds the slots in an array, so reading
+// and writing a variable is just indexing. Each cell is evaluated in a frame
+// of its own, so cells evaluated at the same time on different threads never
+// see each other's variables.
+class Frame
+{
+private:
+  std::vector<Value> slots;
+
+public:
+  // Starts an evaluation with count slots, all 0. Doesn't allocate once
+  // the frame has held that many.
+  void reset (size_t count);
+  // Variables that were never assigned read as 0
+  const Value &
+  get (int slot)
+  {
+    static const Value zero = Value::fromInt (0);
+    return static_cast<size_t> (slot) < slots.size () ? slots[slot] : zero;
+  }
+  void set (int slot, Value value);
+};
+
+// Runtime is the evaluation engine for a Grid. It is created once with the
+// grid and keeps what evaluation needs from one edit to the next, a virtual
+// machine and a scope for each thread that evaluates formulas.
 class Runtime
 {
 private:
   // This could probably be a shared_ptr since you want just one grid passed
   // around.
   std::shared_ptr<Grid> grid;
-  std::unordered_map<std::string, std::unique_ptr<Primitive> > variables;
+
+  // What each thread needs for itself. Worker 0 is the calling thread, and
+  // the only one when recalculating on a single thread.
+  struct Worker
+  {
+    // Runs the compiled formulas, its stack is reused between cells
+    VirtualMachine machine;
+    Frame frame;
+  };
+  std::vector<std::unique_ptr<Worker> > workers;
+  // Null when recalculating on a single thread
+  std::unique_ptr<ThreadPool> pool;
 
 public:
   Runtime (std::shared_ptr<Grid> grid);
-  std::unique_ptr<Primitive> getCell (CellAddress *address,
-                                      std::shared_ptr<Runtime> runtime);
+  // Empty for an unpopulated cell. Borrowed from the grid, see
+  // Grid::getCellValue.
+  const Value &getCell (int row, int col);
+  Grid &getGrid ();
+
+  // Number of threads recalculation runs on, 0 for one per core. Starts at
+  // 1.
+  void setThreads (unsigned threads);
+  unsigned getThreads ();
+  ThreadPool *getPool ();
 
-  void setVariable (std::string name, std::unique_ptr<Primitive> value);
-  std::unique_ptr<Primitive> getVariable (std::string name);
+  VirtualMachine &getMachine (unsigned worker = 0);
+  Frame &getFrame (unsigned worker = 0);
 
   ~Runtime ();
 };
 
+// What evaluating a formula is given besides the formula itself. The
+// runtime is borrowed for the evaluation, row and col are the cell being
+// evaluated (-1 when it isn't a cell). Variables are read from and assigned
+// to frame.
+struct EvalContext
+{
+  Runtime &runtime;
+  int row;
+  int col;
+  Frame &frame;
+};
+
 #endif
@@ -0,0 +1,639 @@
+#include "sheetfile.h"
+#include "cell.h"
+#include "grid.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <type_traits>
+#include <unistd.h>
+
+static constexpr char magic[8] = { 'S', 'P', 'R', 'D', 'S', 'H', 'T', '\0' };
+
+struct Header
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t section_count;
+  uint64_t cell_count;
+};
+
+struct SectionEntry
+{
+  uint32_t kind;
+  uint32_t reserved;
+  uint64_t offset;
+  uint64_t size;
+};
+
+// How a Value is stored. Strings keep their characters elsewhere, length
+// is their size and payload where they start.
+struct ValueRecord
+{
+  uint8_t type;
+  uint8_t reserved[3];
+  uint32_t length;
+  uint64_t payload;
+};
+
+static_assert (sizeof (Header) == 24 && sizeof (SectionEntry) == 24
+               && sizeof (ValueRecord) == 16 && sizeof (CellRange) == 16);
+
+static std::runtime_error
+corrupt ()
+{
+  return std::runtime_error ("Corrupt sheet file");
+}
+
+// Appends plain data to a buffer
+class Writer
+{
+public:
+  std::string bytes;
+
+  template <typename T>
+  void
+  put (const T &val)
+  {
+    static_assert (std::is_trivially_copyable_v<T>);
+    bytes.append (reinterpret_cast<const char *> (&val), sizeof (T));
+  }
+
+  void
+  text (std::string_view text)
+  {
+    bytes.append (text);
+  }
+
+  void
+  align ()
+  {
+    bytes.resize ((bytes.size () + 7) & ~size_t (7), '\0');
+  }
+};
+
+// Reads plain data back out of a buffer, checking that it is there
+class Reader
+{
+public:
+  std::string_view bytes;
+  size_t position = 0;
+
+  template <typename T>
+  T
+  get ()
+  {
+    if (bytes.size () - position < sizeof (T))
+      throw corrupt ();
+    T val;
+    std::memcpy (&val, bytes.data () + position, sizeof (T));
+    position += sizeof (T);
+    return val;
+  }
+
+  std::string_view
+  get (size_t length)
+  {
+    if (bytes.size () - position < length)
+      throw corrupt ();
+    std::string_view ret = bytes.substr (position, length);
+    position += length;
+    return ret;
+  }
+};
+
+// Strings are written to strings, the record points at them
+static ValueRecord
+encode (const Value &value, Writer &strings)
+{
+  ValueRecord record = {};
+  record.type = static_cast<uint8_t> (value.getType ());
+  switch (value.getType ())
+    {
+    case ValueType::INTEGER:
+      record.payload = static_cast<uint32_t> (value.getInt ());
+      break;
+    case ValueType::FLOAT:
+      {
+        float val = value.getFloat ();
+        uint32_t bits;
+        std::memcpy (&bits, &val, sizeof (bits));
+        record.payload = bits;
+        break;
+      }
+    case ValueType::BOOLEAN:
+      record.payload = value.getBool ();
+      break;
+    case ValueType::STRING:
+      record.length = value.getString ().size ();
+      record.payload = strings.bytes.size ();
+      strings.text (value.getString ());
+      break;
+    case ValueType::CELLADDRESS:
+      record.payload = static_cast<uint32_t> (value.getRow ())
+                       | static_cast<uint64_t> (
+                             static_cast<uint32_t> (value.getCol ()))
+                             << 32;
+      break;
+    case ValueType::EMPTY:
+      break;
+    }
+  return record;
+}
+
+static Value
+decode (const ValueRecord &record, std::string_view strings)
+{
+  switch (static_cast<ValueType> (record.type))
+    {
+    case ValueType::EMPTY:
+      return Value ();
+    case ValueType::INTEGER:
+      return Value::fromInt (static_cast<int32_t> (record.payload));
+    case ValueType::FLOAT:
+      {
+        uint32_t bits = record.payload;
+        float val;
+        std::memcpy (&val, &bits, sizeof (val));
+        return Value::fromFloat (val);
+      }
+    case ValueType::BOOLEAN:
+      return Value::fromBool (record.payload != 0);
+    case ValueType::STRING:
+      if (record.payload > strings.size ()
+          || strings.size () - record.payload < record.length)
+        throw corrupt ();
+      return Value::fromString (
+          strings.substr (record.payload, record.length));
+    case ValueType::CELLADDRESS:
+      return Value::fromAddress (static_cast<int32_t> (record.payload),
+                                 static_cast<int32_t> (record.payload >> 32));
+    }
+  throw corrupt ();
+}
+
+/* A Program is written as the sizes of its three parts followed by the
+ * instructions, the constants and the names. The strings of constants and
+ * names follow directly after their record or length.
+ */
+static void
+encodeProgram (const Program &program, Writer &out)
+{
+  out.put (static_cast<uint32_t> (program.code.size ()));
+  out.put (static_cast<uint32_t> (program.constants.size ()));
+  out.put (static_cast<uint32_t> (program.names.size ()));
+  for (const Instruction &instruction : program.code)
+    {
+      out.put (static_cast<uint32_t> (instruction.op));
+      out.put (instruction.arg);
+    }
+  for (const Value &constant : program.constants)
+    {
+      Writer characters;
+      out.put (encode (constant, characters));
+      out.text (characters.bytes);
+    }
+  for (const std::string &name : program.names)
+    {
+      out.put (static_cast<uint32_t> (name.size ()));
+      out.text (name);
+    }
+}
+
+/* Follows every path through a program with the depth of the stack and the
+ * exits of the loops it is in, so a program that would pop an empty stack
+ * or use a loop it never entered is caught here instead of in the virtual
+ * machine. Every instruction has to be reached in the same state on each
+ * path to it, which the compiler's programs always are.
+ */
+static void
+checkFlow (const Program &program)
+{
+  struct State
+  {
+    bool reached = false;
+    int depth = 0;
+    std::vector<int32_t> exits;
+  };
+  size_t size = program.code.size ();
+  std::vector<State> states (size + 1);
+  std::vector<size_t> work;
+  auto reach = [&] (size_t pc, int depth, const std::vector<int32_t> &exits) {
+    State &state = states[pc];
+    if (!state.reached)
+      {
+        state = { true, depth, exits };
+        work.push_back (pc);
+      }
+    else if (state.depth != depth || state.exits != exits)
+      throw corrupt ();
+  };
+
+  reach (0, 0, {});
+  while (!work.empty ())
+    {
+      size_t pc = work.back ();
+      work.pop_back ();
+      if (pc == size)
+        continue;
+      const Instruction &instruction = program.code[pc];
+      int depth = states[pc].depth;
+      std::vector<int32_t> exits = states[pc].exits;
+      // How many values the instruction takes off the stack and puts back
+      int pops;
+      int pushes;
+      switch (instruction.op)
+        {
+        case OpCode::CONSTANT:
+        case OpCode::LOAD:
+        case OpCode::ROW:
+        case OpCode::COLUMN:
+          pops = 0;
+          pushes = 1;
+          break;
+        case OpCode::STORE:
+        case OpCode::NEGATE:
+        case OpCode::NOT:
+        case OpCode::BITNOT:
+        case OpCode::FLOATTOINT:
+        case OpCode::INTTOFLOAT:
+          pops = 1;
+          pushes = 1;
+          break;
+        case OpCode::POP:
+          pops = 1;
+          pushes = 0;
+          break;
+        case OpCode::JUMP:
+          reach (instruction.arg, depth, exits);
+          continue;
+        case OpCode::JUMP_IF_FALSE:
+        case OpCode::JUMP_IF_TRUE:
+          if (depth < 1)
+            throw corrupt ();
+          reach (instruction.arg, depth - 1, exits);
+          pops = 1;
+          pushes = 0;
+          break;
+        case OpCode::FAIL:
+          continue;
+        case OpCode::FOR_ENTER:
+          if (depth < 2)
+            throw corrupt ();
+          exits.push_back (instruction.arg);
+          reach (pc + 1, depth - 2, exits);
+          continue;
+        case OpCode::FOR_NEXT:
+          if (exits.empty ())
+            throw corrupt ();
+          reach (exits.back (), depth, exits);
+          reach (pc + 1, depth, exits);
+          continue;
+        case OpCode::FOR_CONTINUE:
+          if (exits.empty () || depth < 1)
+            throw corrupt ();
+          reach (instruction.arg, depth - 1, exits);
+          continue;
+        case OpCode::FOR_EXIT:
+          if (exits.empty ())
+            throw corrupt ();
+          exits.pop_back ();
+          reach (pc + 1, depth + 1, exits);
+          continue;
+        default:
+          // The binary operators, CELL and the statistical functions
+          pops = 2;
+          pushes = 1;
+          break;
+        }
+      if (depth < pops)
+        throw corrupt ();
+      reach (pc + 1, depth - pops + pushes, exits);
+    }
+  if (states[size].reached && states[size].depth < 1)
+    throw corrupt ();
+}
+
+static std::shared_ptr<Program>
+decodeProgram (std::string_view bytes)
+{
+  Reader in = { bytes };
+  std::shared_ptr<Program> program = std::make_shared<Program> ();
+  uint32_t code = in.get<uint32_t> ();
+  uint32_t constants = in.get<uint32_t> ();
+  uint32_t names = in.get<uint32_t> ();
+  // Every instruction takes 8 bytes, so a count bigger than that is corrupt
+  // and shouldn't be allowed to reserve memory.
+  if (code > bytes.size () / 8)
+    throw corrupt ();
+  program->code.reserve (code);
+  for (uint32_t i = 0; i < code; i++)
+    {
+      uint32_t op = in.get<uint32_t> ();
+      int32_t arg = in.get<int32_t> ();
+      if (op > static_cast<uint32_t> (OpCode::COLUMN))
+        throw corrupt ();
+      program->code.push_back ({ static_cast<OpCode> (op), arg });
+    }
+  for (uint32_t i = 0; i < constants; i++)
+    {
+      ValueRecord record = in.get<ValueRecord> ();
+      std::string_view characters;
+      if (record.type == static_cast<uint8_t> (ValueType::STRING))
+        characters = in.get (record.length);
+      program->constants.push_back (decode (record, characters));
+    }
+  for (uint32_t i = 0; i < names; i++)
+    {
+      uint32_t length = in.get<uint32_t> ();
+      program->names.emplace_back (in.get (length));
+    }
+  if (in.position != bytes.size ())
+    throw corrupt ();
+
+  // Operands are only checked here so the virtual machine doesn't have to
+  for (const Instruction &instruction : program->code)
+    {
+      size_t limit;
+      switch (instruction.op)
+        {
+        case OpCode::CONSTANT:
+        case OpCode::FAIL:
+          limit = program->constants.size ();
+          break;
+        case OpCode::LOAD:
+        case OpCode::STORE:
+        case OpCode::FOR_NEXT:
+          limit = program->names.size ();
+          break;
+        case OpCode::JUMP:
+        case OpCode::JUMP_IF_FALSE:
+        case OpCode::JUMP_IF_TRUE:
+        case OpCode::FOR_ENTER:
+        case OpCode::FOR_CONTINUE:
+          limit = program->code.size () + 1;
+          break;
+        default:
+          continue;
+        }
+      if (instruction.arg < 0
+          || static_cast<size_t> (instruction.arg) >= limit)
+        throw corrupt ();
+      if (instruction.op == OpCode::FAIL
+          && program->constants[instruction.arg].getType ()
+                 != ValueType::STRING)
+        throw corrupt ();
+    }
+  checkFlow (*program);
+  return program;
+}
+
+SheetFile::SheetFile (const char *data, size_t length)
+    : data (data), length (length), cells (0)
+{
+}
+
+std::shared_ptr<SheetFile>
+SheetFile::open (const std::string &path)
+{
+  int fd = ::open (path.c_str (), O_RDONLY);
+  if (fd < 0)
+    throw std::runtime_error ("Can't open " + path);
+  struct stat status;
+  if (fstat (fd, &status) != 0 || status.st_size < (off_t)sizeof (Header))
+    {
+      close (fd);
+      throw std::runtime_error (path + " is not a sheet file");
+    }
+  size_t length = status.st_size;
+  void *mapped = mmap (nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+  // The mapping keeps the file open on its own
+  close (fd);
+  if (mapped == MAP_FAILED)
+    throw std::runtime_error ("Can't map " + path);
+
+  // Owned from here on, so the mapping is released if the header is bad
+  std::shared_ptr<SheetFile> file (
+      new SheetFile (static_cast<const char *> (mapped), length));
+
+  Header header;
+  std::memcpy (&header, file->data, sizeof (header));
+  if (std::memcmp (header.magic, magic, sizeof (magic)) != 0)
+    throw std::runtime_error (path + " is not a sheet file");
+  if (header.version != version)
+    throw std::runtime_error (path + " is version "
+                              + std::to_string (header.version)
+                              + " of the sheet format, only version "
+                              + std::to_string (version) + " is supported");
+  if (header.section_count
+      > (length - sizeof (Header)) / sizeof (SectionEntry))
+    throw corrupt ();
+  file->cells = header.cell_count;
+
+  for (uint32_t i = 0; i < header.section_count; i++)
+    {
+      SectionEntry entry;
+      std::memcpy (&entry,
+                   file->data + sizeof (Header) + i * sizeof (SectionEntry),
+                   sizeof (entry));
+      if (entry.offset > length || length - entry.offset < entry.size
+          || entry.offset % 8 != 0)
+        throw corrupt ();
+      // Sections this version doesn't know about are skipped
+      if (entry.kind > 0 && entry.kind < SECTION_COUNT)
+        file->sections[entry.kind]
+            = std::string_view (file->data + entry.offset, entry.size);
+    }
+
+  // Only the sizes of the fixed width columns are checked up front, the rest
+  // is checked as cells are read.
+  file->array<uint64_t> (CELLS, file->cells);
+  file->array<ValueRecord> (VALUES, file->cells);
+  file->array<uint64_t> (SOURCE_OFFSETS, file->cells + 1);
+  file->array<uint64_t> (ERROR_OFFSETS, file->cells + 1);
+  file->array<uint64_t> (PROGRAM_OFFSETS, file->cells + 1);
+  file->array<uint64_t> (REFERENCE_OFFSETS, file->cells + 1);
+
+  // Lookups search the cells, which only works if they really are sorted
+  const uint64_t *keys = file->array<uint64_t> (CELLS, file->cells);
+  for (size_t i = 1; i < file->cells; i++)
+    {
+      if (keys[i - 1] >= keys[i])
+        throw corrupt ();
+    }
+  return file;
+}
+
+bool
+SheetFile::isSheetFile (const std::string &path)
+{
+  std::ifstream in (path, std::ios::binary);
+  char start[sizeof (magic)];
+  return in.read (start, sizeof (start))
+         && std::memcmp (start, magic, sizeof (magic)) == 0;
+}
+
+template <typename T>
+const T *
+SheetFile::array (Section section, size_t count)
+{
+  if (sections[section].size () / sizeof (T) < count)
+    throw corrupt ();
+  return reinterpret_cast<const T *> (sections[section].data ());
+}
+
+std::string_view
+SheetFile::column (Section data, Section offsets, size_t index)
+{
+  const uint64_t *bounds = array<uint64_t> (offsets, cells + 1);
+  uint64_t start = bounds[index];
+  uint64_t end = bounds[index + 1];
+  if (start > end || end > sections[data].size ())
+    throw corrupt ();
+  return sections[data].substr (start, end - start);
+}
+
+uint64_t
+SheetFile::key (size_t index)
+{
+  return array<uint64_t> (CELLS, cells)[index];
+}
+
+long
+SheetFile::find (int row, int col)
+{
+  const uint64_t *keys = array<uint64_t> (CELLS, cells);
+  uint64_t key = cellKey (row, col);
+  const uint64_t *found = std::lower_bound (keys, keys + cells, key);
+  if (found == keys + cells || *found != key)
+    return -1;
+  return found - keys;
+}
+
+std::string
+SheetFile::source (size_t index)
+{
+  return std::string (column (SOURCE_DATA, SOURCE_OFFSETS, index));
+}
+
+Value
+SheetFile::value (size_t index)
+{
+  return decode (array<ValueRecord> (VALUES, cells)[index],
+                 sections[VALUE_DATA]);
+}
+
+std::string
+SheetFile::error (size_t index)
+{
+  return std::string (column (ERROR_DATA, ERROR_OFFSETS, index));
+}
+
+std::shared_ptr<Program>
+SheetFile::program (size_t index)
+{
+  std::string_view bytes = column (PROGRAM_DATA, PROGRAM_OFFSETS, index);
+  if (bytes.empty ())
+    return nullptr;
+  return decodeProgram (bytes);
+}
+
+void
+SheetFile::references (size_t index, std::vector<CellRange> &out)
+{
+  const uint64_t *bounds = array<uint64_t> (REFERENCE_OFFSETS, cells + 1);
+  uint64_t count = sections[REFERENCES].size () / sizeof (CellRange);
+  if (bounds[index] > bounds[index + 1] || bounds[index + 1] > count)
+    throw corrupt ();
+  const char *start
+      = sections[REFERENCES].data () + bounds[index] * sizeof (CellRange);
+  for (uint64_t i = bounds[index]; i < bounds[index + 1]; i++)
+    {
+      CellRange range;
+      std::memcpy (&range, start, sizeof (range));
+      out.push_back (range);
+      start += sizeof (range);
+    }
+}
+
+void
+SheetFile::save (const std::string &path, Grid &grid)
+{
+  Writer columns[SECTION_COUNT];
+  uint64_t references = 0;
+  auto offset = [&] (Section offsets, Section data) {
+    columns[offsets].put (static_cast<uint64_t> (columns[data].bytes.size ()));
+  };
+  uint64_t count = 0;
+  grid.forEachCell ([&] (int row, int col, std::shared_ptr<Cell> &cell) {
+    columns[CELLS].put (cellKey (row, col));
+    offset (SOURCE_OFFSETS, SOURCE_DATA);
+    columns[SOURCE_DATA].text (cell->getString ());
+    columns[VALUES].put (encode (cell->getValue (), columns[VALUE_DATA]));
+    offset (ERROR_OFFSETS, ERROR_DATA);
+    columns[ERROR_DATA].text (cell->getError ());
+    offset (PROGRAM_OFFSETS, PROGRAM_DATA);
+    if (cell->getProgram () != nullptr)
+      encodeProgram (*cell->getProgram (), columns[PROGRAM_DATA]);
+    columns[REFERENCE_OFFSETS].put (references);
+    if (const std::vector<CellRange> *read = grid.getPrecedents (row, col))
+      {
+        for (const CellRange &range : *read)
+          columns[REFERENCES].put (range);
+        references += read->size ();
+      }
+    count++;
+  });
+  offset (SOURCE_OFFSETS, SOURCE_DATA);
+  offset (ERROR_OFFSETS, ERROR_DATA);
+  offset (PROGRAM_OFFSETS, PROGRAM_DATA);
+  columns[REFERENCE_OFFSETS].put (references);
+
+  Header header = {};
+  std::memcpy (header.magic, magic, sizeof (magic));
+  header.version = version;
+  header.section_count = SECTION_COUNT - 1;
+  header.cell_count = count;
+
+  Writer out;
+  out.put (header);
+  uint64_t position = sizeof (Header)
+                      + header.section_count * sizeof (SectionEntry);
+  for (uint32_t kind = 1; kind < SECTION_COUNT; kind++)
+    {
+      position = (position + 7) & ~uint64_t (7);
+      out.put (SectionEntry{ kind, 0, position, columns[kind].bytes.size () });
+      position += columns[kind].bytes.size ();
+    }
+  for (uint32_t kind = 1; kind < SECTION_COUNT; kind++)
+    {
+      out.align ();
+      out.text (columns[kind].bytes);
+    }
+
+  // Written next to the old file and moved over it, so a failed save never
+  // leaves half a sheet behind. The last of the file is only written when
+  // it is closed, so that has to have worked too.
+  std::string temporary = path + ".tmp";
+  std::ofstream file (temporary, std::ios::binary | std::ios::trunc);
+  if (file)
+    {
+      file.write (out.bytes.data (), out.bytes.size ());
+      file.close ();
+    }
+  if (file.fail ()
+      || std::rename (temporary.c_str (), path.c_str ()) != 0)
+    {
+      std::remove (temporary.c_str ());
+      throw std::runtime_error ("Can't write " + path);
+    }
+}
+
+SheetFile::~SheetFile ()
+{
+  munmap (const_cast<char *> (data), length);
+}
@@ -0,0 +1,102 @@
+#ifndef sheetfile_H
+#define sheetfile_H
+
+#include "bytecode.h"
+#include "dependency.h"
+#include "forward_declarations.h"
+#include "value.h"
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+/* SheetFile is the binary format sheets are saved in. The file is memory
+ * mapped when it is opened and nothing is parsed up front. A Grid reads a
+ * cell out of the mapping the first time the cell is used, see Grid::open.
+ *
+ * Layout, all integers little-endian and every section 8 byte aligned:
+ *
+ *   header     magic "SPRDSHT", version, section count, cell count
+ *   sections   a table of (kind, offset, size), then the sections
+ *
+ * The sections are columns over the cells, which are sorted row-major:
+ *
+ *   CELLS              cellKey of each cell
+ *   SOURCE_OFFSETS     cell count + 1 offsets into SOURCE_DATA
+ *   SOURCE_DATA        the source text of every cell
+ *   VALUES             the cached value of each cell, 16 byte records
+ *   VALUE_DATA         characters of the String values
+ *   ERROR_OFFSETS      cell count + 1 offsets into ERROR_DATA
+ *   ERROR_DATA         the error text of every cell
+ *   PROGRAM_OFFSETS    cell count + 1 offsets into PROGRAM_DATA
+ *   PROGRAM_DATA       each cell's compiled Program, empty if it has none
+ *   REFERENCE_OFFSETS  cell count + 1 indexes into REFERENCES
+ *   REFERENCES         the CellRanges each cell reads
+ *
+ * Anything that doesn't fit the layout throws a runtime_error when it is
+ * opened or read.
+ */
+class SheetFile
+{
+private:
+  // Programs are stored compiled, so this changes with the bytecode too
+  static constexpr uint32_t version = 3;
+
+  enum Section : uint32_t
+  {
+    CELLS = 1,
+    SOURCE_OFFSETS,
+    SOURCE_DATA,
+    VALUES,
+    VALUE_DATA,
+    ERROR_OFFSETS,
+    ERROR_DATA,
+    PROGRAM_OFFSETS,
+    PROGRAM_DATA,
+    REFERENCE_OFFSETS,
+    REFERENCES,
+    SECTION_COUNT
+  };
+
+  const char *data;
+  size_t length;
+  size_t cells;
+  // Where each section starts and how long it is, indexed by Section
+  std::string_view sections[SECTION_COUNT];
+
+  SheetFile (const char *data, size_t length);
+
+  std::string_view column (Section data, Section offsets, size_t index);
+  template <typename T> const T *array (Section section, size_t count);
+
+public:
+  // Maps the file at path, reading only the header
+  static std::shared_ptr<SheetFile> open (const std::string &path);
+  // True if path starts like a sheet file
+  static bool isSheetFile (const std::string &path);
+  // Writes every cell of grid to path
+  static void save (const std::string &path, Grid &grid);
+
+  size_t
+  size ()
+  {
+    return cells;
+  }
+
+  uint64_t key (size_t index);
+  // Index of the cell at (row, col), -1 if the file doesn't have it
+  long find (int row, int col);
+
+  std::string source (size_t index);
+  Value value (size_t index);
+  std::string error (size_t index);
+  // Null for a cell without a formula
+  std::shared_ptr<Program> program (size_t index);
+  void references (size_t index, std::vector<CellRange> &out);
+
+  ~SheetFile ();
+};
+
+#endif
@@ -0,0 +1,50 @@
+// Loads a sheet, clears all but its first rows and checks the arena blocks
+// that held the cleared formulas went back to the heap.
+
+#include "../arena.h"
+#include "../batch.h"
+#include "../grid.h"
+#include "../runtime.h"
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <sstream>
+
+int
+main ()
+{
+  const int rows = 20000;
+  const int cols = 4;
+  const int kept = rows / 100;
+
+  std::shared_ptr<Grid> grid = std::make_shared<Grid> ();
+  std::shared_ptr<Runtime> runtime = std::make_shared<Runtime> (grid);
+
+  // Every formula differs, so none of them are shared between cells
+  std::ostringstream sheet;
+  for (int row = 0; row < rows; row++)
+    for (int col = 0; col < cols; col++)
+      sheet << row << '\t' << col << '\t' << "x = " << row * cols + col
+            << "\\nx * x + 1\n";
+  std::istringstream in (sheet.str ());
+  size_t before = Arena::blocks ();
+  Batch::load (in, *grid, *runtime);
+  grid->updateGrid (*runtime);
+  size_t loaded = Arena::blocks () - before;
+
+  for (int row = kept; row < rows; row++)
+    for (int col = 0; col < cols; col++)
+      grid->setCell (row, col, "", nullptr, *runtime, "");
+  size_t left = Arena::blocks () - before;
+
+  // What the kept rows need, plus the block each thread is still filling
+  size_t allowed = loaded * kept / rows + 2;
+  std::cout << "arena: " << loaded << " blocks loaded, " << left
+            << " left after clearing\n";
+  if (loaded == 0 || left > allowed)
+    {
+      std::cout << "arena: expected at most " << allowed << " blocks left\n";
+      return EXIT_FAILURE;
+    }
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,145 @@
+#include "threadpool.h"
+#include <algorithm>
+
+ThreadPool::ThreadPool (unsigned workers)
+    : job (nullptr), generation (0), stopping (false), remaining (0)
+{
+  workers = std::max (1u, workers);
+  for (unsigned i = 0; i < workers; i++)
+    {
+      queues.push_back (std::make_unique<Queue> ());
+    }
+  for (unsigned i = 1; i < workers; i++)
+    {
+      threads.emplace_back (&ThreadPool::loop, this, i);
+    }
+}
+
+bool
+ThreadPool::take (unsigned worker, Task &task)
+{
+  for (unsigned i = 0; i < queues.size (); i++)
+    {
+      Queue &queue = *queues[(worker + i) % queues.size ()];
+      std::lock_guard<std::mutex> lock (queue.mutex);
+      if (queue.tasks.empty ())
+        continue;
+      // Own work in order, stolen work from the other end
+      if (i == 0)
+        {
+          task = queue.tasks.front ();
+          queue.tasks.pop_front ();
+        }
+      else
+        {
+          task = queue.tasks.back ();
+          queue.tasks.pop_back ();
+        }
+      return true;
+    }
+  return false;
+}
+
+void
+ThreadPool::work (unsigned worker)
+{
+  Task task;
+  while (take (worker, task))
+    {
+      try
+        {
+          for (size_t i = task.first; i < task.second; i++)
+            {
+              (*job) (worker, i);
+            }
+        }
+      catch (...)
+        {
+          std::lock_guard<std::mutex> lock (mutex);
+          if (error == nullptr)
+            error = std::current_exception ();
+        }
+      if (--remaining == 0)
+        {
+          std::lock_guard<std::mutex> lock (mutex);
+          done.notify_all ();
+        }
+    }
+}
+
+void
+ThreadPool::loop (unsigned worker)
+{
+  uint64_t seen = 0;
+  while (true)
+    {
+      {
+        std::unique_lock<std::mutex> lock (mutex);
+        wake.wait (lock, [&] () { return stopping || generation != seen; });
+        if (stopping)
+          return;
+        seen = generation;
+      }
+      work (worker);
+    }
+}
+
+void
+ThreadPool::parallelFor (size_t count,
+                         const std::function<void (unsigned, size_t)> &f)
+{
+  if (count == 0)
+    {
+      return;
+    }
+  // A few tasks per worker so there is something left to steal
+  size_t per_task = std::max<size_t> (1, count / (queues.size () * 4));
+  size_t tasks = (count + per_task - 1) / per_task;
+
+  // The job is in place before any task can be taken, so a thread that
+  // wakes late for the last job can't run one of these with it.
+  {
+    std::lock_guard<std::mutex> lock (mutex);
+    job = &f;
+    error = nullptr;
+  }
+  remaining = tasks;
+  for (size_t t = 0; t < tasks; t++)
+    {
+      Queue &queue = *queues[t % queues.size ()];
+      std::lock_guard<std::mutex> lock (queue.mutex);
+      queue.tasks.push_back (
+          { t * per_task, std::min (count, (t + 1) * per_task) });
+    }
+  {
+    std::lock_guard<std::mutex> lock (mutex);
+    generation++;
+  }
+  wake.notify_all ();
+
+  work (0);
+  std::exception_ptr thrown;
+  {
+    std::unique_lock<std::mutex> lock (mutex);
+    done.wait (lock, [&] () { return remaining == 0; });
+    job = nullptr;
+    thrown = error;
+  }
+  if (thrown != nullptr)
+    {
+      std::rethrow_exception (thrown);
+    }
+}
+
+ThreadPool::~ThreadPool ()
+{
+  {
+    std::lock_guard<std::mutex> lock (mutex);
+    stopping = true;
+  }
+  wake.notify_all ();
+  for (std::thread &thread : threads)
+    {
+      thread.join ();
+    }
+}
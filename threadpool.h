@@ -0,0 +1,74 @@
+#ifndef threadpool_H
+#define threadpool_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+/* ThreadPool runs loops over many independent items on a fixed set of
+ * threads. The items are split into tasks that are dealt out to a queue per
+ * worker. A worker takes tasks from the front of its own queue, and when
+ * that runs dry steals from the back of another's, so a worker that drew
+ * slow items doesn't hold up the rest.
+ *
+ * The thread calling parallelFor is worker 0 and works alongside the
+ * others, so a pool of n workers starts n - 1 threads.
+ */
+class ThreadPool
+{
+private:
+  using Task = std::pair<size_t, size_t>; // Items [first, last)
+
+  struct Queue
+  {
+    std::mutex mutex;
+    std::deque<Task> tasks;
+  };
+
+  std::vector<std::unique_ptr<Queue> > queues;
+  std::vector<std::thread> threads;
+
+  // Guards everything below except remaining, and signals changes to it
+  std::mutex mutex;
+  std::condition_variable wake;
+  std::condition_variable done;
+  const std::function<void (unsigned, size_t)> *job;
+  uint64_t generation;
+  bool stopping;
+  std::exception_ptr error;
+  // Tasks of the current job that haven't finished
+  std::atomic<size_t> remaining;
+
+  bool take (unsigned worker, Task &task);
+  void work (unsigned worker);
+  void loop (unsigned worker);
+
+public:
+  ThreadPool (unsigned workers);
+
+  unsigned
+  size ()
+  {
+    return queues.size ();
+  }
+
+  // Calls f (worker, i) for every i in [0, count) and returns once all of
+  // them have. Calls with the same worker never run at the same time, so
+  // worker can index state that belongs to one thread. The first exception
+  // thrown by f is rethrown here once the rest have finished.
+  void parallelFor (size_t count,
+                    const std::function<void (unsigned, size_t)> &f);
+
+  ~ThreadPool ();
+};
+
+#endif
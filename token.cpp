@@ -1,30 +1,30 @@
 #include "token.h"
 
-std::string
-Token::getText ()
+std::string_view
+Token::getText () const
 {
   return text;
 }
 
 TokenType
-Token::getType ()
+Token::getType () const
 {
   return type;
 }
 int
-Token::getStartIndex ()
+Token::getStartIndex () const
 {
   return start_index;
 }
 
 int
-Token::getEndIndex ()
+Token::getEndIndex () const
 {
   return end_index;
 }
 
 std::string
-Token::getTypeString ()
+Token::getTypeString () const
 {
   return token_type_strings[static_cast<int> (type)];
 }
@@ -2,32 +2,35 @@
 #define token_H
 
 #include <iostream>
+#include <string_view>
 
 enum class TokenType;
 
 // Represents a token created by the lexer. A token stores the source text
 // that produces the token, the type of the token, and the starting and
-// ending indexes that it is at.
+// ending indexes that it is at. The text is a view into the source that was
+// lexed, which has to outlive the token.
 class Token
 {
 
 private:
-  std::string text;
+  std::string_view text;
   TokenType type;
   int start_index;
   int end_index;
 
 public:
-  Token (std::string text, TokenType type, int start_index, int end_index)
+  Token (std::string_view text, TokenType type, int start_index,
+         int end_index)
       : text (text), type (type), start_index (start_index),
         end_index (end_index)
   {
   }
-  std::string getText ();
-  TokenType getType ();
-  int getStartIndex ();
-  int getEndIndex ();
-  std::string getTypeString ();
+  std::string_view getText () const;
+  TokenType getType () const;
+  int getStartIndex () const;
+  int getEndIndex () const;
+  std::string getTypeString () const;
 
   // A friend method! I haven't seen one of these in a long time.
   friend std::ostream &operator<< (std::ostream &os, Token &token);
@@ -95,6 +98,10 @@ enum class TokenType
 
   ASSIGNMENT,
 
+  // Never lexed. FormulaTable retypes the row and column of a literal
+  // address as these, the parser makes them relative to the formula's cell.
+  ROW_OFFSET,
+  COL_OFFSET,
 };
 
 // Convert the token type to a string
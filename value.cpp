@@ -0,0 +1,198 @@
+#include "value.h"
+#include "expression.h"
+#include <cstdlib>
+#include <format>
+#include <new>
+
+// -------------------- Copying and Lifetime
+
+void
+Value::retain ()
+{
+  if (isHeapString ())
+    {
+      load<HeapString *> ()->refs.fetch_add (1, std::memory_order_relaxed);
+    }
+}
+
+void
+Value::release ()
+{
+  if (isHeapString ())
+    {
+      HeapString *heap = load<HeapString *> ();
+      if (heap->refs.fetch_sub (1, std::memory_order_acq_rel) == 1)
+        {
+          heap->~HeapString ();
+          std::free (heap);
+        }
+    }
+}
+
+Value::Value (const Value &other)
+{
+  std::memcpy (bytes, other.bytes, sizeof (bytes));
+  retain ();
+}
+
+Value::Value (Value &&other) noexcept
+{
+  std::memcpy (bytes, other.bytes, sizeof (bytes));
+  other.bytes[0] = static_cast<uint8_t> (ValueType::EMPTY);
+}
+
+Value &
+Value::operator= (const Value &other)
+{
+  if (this != &other)
+    {
+      // Retain first in case both share the same string
+      Value copy (other);
+      *this = std::move (copy);
+    }
+  return *this;
+}
+
+Value &
+Value::operator= (Value &&other) noexcept
+{
+  if (this != &other)
+    {
+      release ();
+      std::memcpy (bytes, other.bytes, sizeof (bytes));
+      other.bytes[0] = static_cast<uint8_t> (ValueType::EMPTY);
+    }
+  return *this;
+}
+
+// -------------------- Construction
+
+Value
+Value::fromInt (int val)
+{
+  Value ret;
+  ret.bytes[0] = static_cast<uint8_t> (ValueType::INTEGER);
+  ret.store (val);
+  return ret;
+}
+
+Value
+Value::fromFloat (float val)
+{
+  Value ret;
+  ret.bytes[0] = static_cast<uint8_t> (ValueType::FLOAT);
+  ret.store (val);
+  return ret;
+}
+
+Value
+Value::fromBool (bool val)
+{
+  Value ret;
+  ret.bytes[0] = static_cast<uint8_t> (ValueType::BOOLEAN);
+  ret.store (val);
+  return ret;
+}
+
+Value
+Value::fromString (std::string_view val)
+{
+  Value ret;
+  ret.bytes[0] = static_cast<uint8_t> (ValueType::STRING);
+  if (val.size () <= inline_capacity)
+    {
+      ret.bytes[1] = static_cast<uint8_t> (val.size ());
+      std::memcpy (ret.bytes + 2, val.data (), val.size ());
+      return ret;
+    }
+
+  void *memory = std::malloc (sizeof (HeapString) + val.size ());
+  if (memory == nullptr)
+    {
+      throw std::bad_alloc ();
+    }
+  HeapString *heap = new (memory) HeapString;
+  heap->refs.store (1, std::memory_order_relaxed);
+  heap->length = val.size ();
+  std::memcpy (heap->data, val.data (), val.size ());
+  heap->data[val.size ()] = '\0';
+  ret.bytes[1] = heap_marker;
+  ret.store (heap);
+  return ret;
+}
+
+Value
+Value::fromAddress (int row, int col)
+{
+  Value ret;
+  ret.bytes[0] = static_cast<uint8_t> (ValueType::CELLADDRESS);
+  ret.store (row);
+  std::memcpy (ret.bytes + 12, &col, sizeof (int));
+  return ret;
+}
+
+// -------------------- Access
+
+std::string_view
+Value::getString () const
+{
+  if (isHeapString ())
+    {
+      HeapString *heap = load<HeapString *> ();
+      return std::string_view (heap->data, heap->length);
+    }
+  return std::string_view (reinterpret_cast<const char *> (bytes + 2),
+                           bytes[1]);
+}
+
+std::string
+Value::serialize () const
+{
+  switch (getType ())
+    {
+    case ValueType::INTEGER:
+      return std::to_string (getInt ());
+    case ValueType::FLOAT:
+      return std::format ("{:.2f}", getFloat ());
+    case ValueType::BOOLEAN:
+      return getBool () ? "true" : "false";
+    case ValueType::STRING:
+      return std::string (getString ());
+    case ValueType::CELLADDRESS:
+      return std::format ("[{}, {}]", getRow (), getCol ());
+    default:
+      return "";
+    }
+}
+
+// -------------------- Primitive Adapters
+
+std::unique_ptr<Primitive>
+Value::toPrimitive () const
+{
+  switch (getType ())
+    {
+    case ValueType::INTEGER:
+      return std::make_unique<Integer> (getInt (), -1, -1);
+    case ValueType::FLOAT:
+      return std::make_unique<Float> (getFloat (), -1, -1);
+    case ValueType::BOOLEAN:
+      return std::make_unique<Boolean> (getBool (), -1, -1);
+    case ValueType::STRING:
+      return std::make_unique<String> (std::string (getString ()), -1, -1);
+    case ValueType::CELLADDRESS:
+      return std::make_unique<CellAddress> (getRow (), getCol (), -1, -1);
+    default:
+      return nullptr;
+    }
+}
+
+Value
+Value::fromPrimitive (Primitive *prim)
+{
+  if (prim == nullptr)
+    {
+      return Value ();
+    }
+  return prim->toValue ();
+}
@@ -0,0 +1,164 @@
+#ifndef value_H
+#define value_H
+
+#include "forward_declarations.h"
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <string_view>
+
+enum class ValueType : uint8_t
+{
+  EMPTY,
+  INTEGER,
+  FLOAT,
+  BOOLEAN,
+  STRING,
+  CELLADDRESS,
+};
+
+/* Value is what expressions evaluate to internally. It is a 16 byte tagged
+ * union that is passed around by value, so evaluating an expression doesn't
+ * allocate. Strings of up to 14 characters are stored inline, longer strings
+ * are immutable and reference counted so copying them is cheap too.
+ *
+ * Primitive is still what the rest of the program sees. toPrimitive and
+ * Expression::evaluate convert at that boundary.
+ */
+class Value
+{
+private:
+  // Shared storage for strings too long to store inline
+  struct HeapString
+  {
+    std::atomic<int> refs;
+    size_t length;
+    char data[1];
+  };
+
+  static constexpr size_t inline_capacity = 14;
+  static constexpr uint8_t heap_marker = 0xff;
+
+  // Byte 0 holds the type and byte 1 the length of an inline string (or
+  // heap_marker), which uses bytes 2 to 15. Every other payload, including
+  // the HeapString pointer, starts at byte 8.
+  alignas (8) unsigned char bytes[16];
+
+  template <typename T>
+  T
+  load () const
+  {
+    T val;
+    std::memcpy (&val, bytes + 8, sizeof (T));
+    return val;
+  }
+
+  template <typename T>
+  void
+  store (T val)
+  {
+    std::memcpy (bytes + 8, &val, sizeof (T));
+  }
+
+  bool
+  isHeapString () const
+  {
+    return getType () == ValueType::STRING && bytes[1] == heap_marker;
+  }
+
+  void release ();
+  void retain ();
+
+public:
+  Value () : bytes{} {} // All zero is EMPTY
+  Value (const Value &other);
+  Value (Value &&other) noexcept;
+  Value &operator= (const Value &other);
+  Value &operator= (Value &&other) noexcept;
+  ~Value () { release (); }
+
+  static Value fromInt (int val);
+  static Value fromFloat (float val);
+  static Value fromBool (bool val);
+  static Value fromString (std::string_view val);
+  static Value fromAddress (int row, int col);
+
+  ValueType
+  getType () const
+  {
+    return static_cast<ValueType> (bytes[0]);
+  }
+
+  bool
+  isEmpty () const
+  {
+    return getType () == ValueType::EMPTY;
+  }
+
+  // Integers and Floats
+  bool
+  isNumeric () const
+  {
+    return getType () == ValueType::INTEGER || getType () == ValueType::FLOAT;
+  }
+
+  int
+  getInt () const
+  {
+    return load<int> ();
+  }
+
+  float
+  getFloat () const
+  {
+    return load<float> ();
+  }
+
+  bool
+  getBool () const
+  {
+    return load<bool> ();
+  }
+
+  int
+  getRow () const
+  {
+    return load<int> ();
+  }
+
+  int
+  getCol () const
+  {
+    int col;
+    std::memcpy (&col, bytes + 12, sizeof (int));
+    return col;
+  }
+
+  std::string_view getString () const;
+
+  // Numeric values widened the same way C++ arithmetic would
+  float
+  toFloat () const
+  {
+    return getType () == ValueType::INTEGER ? static_cast<float> (getInt ())
+                                            : getFloat ();
+  }
+
+  double
+  toDouble () const
+  {
+    return getType () == ValueType::INTEGER ? getInt () : getFloat ();
+  }
+
+  // Same text as the matching Primitive's serialize
+  std::string serialize () const;
+
+  // Adapters for code that still works with Primitives. An empty value is
+  // nullptr.
+  std::unique_ptr<Primitive> toPrimitive () const;
+  static Value fromPrimitive (Primitive *prim);
+};
+
+#endif
@@ -0,0 +1,321 @@
+#include "vm.h"
+#include "kernels.h"
+#include "operations.h"
+#include "runtime.h"
+#include <stdexcept>
+#include <string>
+
+Value
+VirtualMachine::pop ()
+{
+  Value top = std::move (stack.back ());
+  stack.pop_back ();
+  return top;
+}
+
+template <typename Kernel, ValueType T>
+void
+VirtualMachine::specialized ()
+{
+  Value rightval = pop ();
+  stack.back () = Kernel::template apply<T, T> (stack.back (), rightval);
+}
+
+Value
+VirtualMachine::run (const Program &program, EvalContext &context)
+{
+  // A previous run that threw leaves its state behind
+  stack.clear ();
+  loops.clear ();
+  context.frame.reset (program.names.size ());
+
+  Runtime &runtime = context.runtime;
+  const Instruction *code = program.code.data ();
+  int size = static_cast<int> (program.code.size ());
+  int pc = 0;
+  while (pc < size)
+    {
+      const Instruction &instruction = code[pc++];
+      switch (instruction.op)
+        {
+        case OpCode::CONSTANT:
+          stack.push_back (program.constants[instruction.arg]);
+          break;
+        case OpCode::LOAD:
+          stack.push_back (context.frame.get (instruction.arg));
+          break;
+        case OpCode::STORE:
+          context.frame.set (instruction.arg, stack.back ());
+          break;
+        case OpCode::POP:
+          stack.pop_back ();
+          break;
+        case OpCode::JUMP:
+          pc = instruction.arg;
+          break;
+        case OpCode::JUMP_IF_FALSE:
+          {
+            Value condition = pop ();
+            if (condition.getType () != ValueType::BOOLEAN)
+              {
+                throw std::runtime_error (
+                    "Condition must evaluate to a boolean");
+              }
+            if (!condition.getBool ())
+              pc = instruction.arg;
+            break;
+          }
+        case OpCode::JUMP_IF_TRUE:
+          {
+            Value condition = pop ();
+            if (condition.getType () != ValueType::BOOLEAN)
+              {
+                throw std::runtime_error (
+                    "Condition must evaluate to a boolean");
+              }
+            if (condition.getBool ())
+              pc = instruction.arg;
+            break;
+          }
+        case OpCode::ROW:
+          stack.push_back (Value::fromInt (context.row + instruction.arg));
+          break;
+        case OpCode::COLUMN:
+          stack.push_back (Value::fromInt (context.col + instruction.arg));
+          break;
+        case OpCode::FAIL:
+          throw std::runtime_error (
+              std::string (program.constants[instruction.arg].getString ()));
+
+        case OpCode::NEGATE:
+          stack.back () = Operations::negate (stack.back ());
+          break;
+        case OpCode::NOT:
+          stack.back () = Operations::logicalNot (stack.back ());
+          break;
+        case OpCode::BITNOT:
+          stack.back () = Operations::bitNot (stack.back ());
+          break;
+        case OpCode::FLOATTOINT:
+          stack.back () = Operations::floatToInt (stack.back ());
+          break;
+        case OpCode::INTTOFLOAT:
+          stack.back () = Operations::intToFloat (stack.back ());
+          break;
+
+        case OpCode::CELL:
+          {
+            Value colval = pop ();
+            stack.back () = Operations::cell (runtime, stack.back (), colval);
+            break;
+          }
+        case OpCode::MAX:
+        case OpCode::MIN:
+        case OpCode::MEAN:
+        case OpCode::SUM:
+          {
+            Value bottomRight = pop ();
+            CellRange range = Operations::range (stack.back (), bottomRight);
+            if (instruction.op == OpCode::MAX)
+              stack.back () = Operations::max (runtime, range);
+            else if (instruction.op == OpCode::MIN)
+              stack.back () = Operations::min (runtime, range);
+            else if (instruction.op == OpCode::MEAN)
+              stack.back () = Operations::mean (runtime, range);
+            else
+              stack.back () = Operations::sum (runtime, range);
+            break;
+          }
+
+        case OpCode::ADD_II:
+          specialized<Arithmetic<AddOp>, ValueType::INTEGER> ();
+          break;
+        case OpCode::ADD_FF:
+          specialized<Arithmetic<AddOp>, ValueType::FLOAT> ();
+          break;
+        case OpCode::SUBTRACT_II:
+          specialized<Arithmetic<SubtractOp>, ValueType::INTEGER> ();
+          break;
+        case OpCode::SUBTRACT_FF:
+          specialized<Arithmetic<SubtractOp>, ValueType::FLOAT> ();
+          break;
+        case OpCode::MULTIPLY_II:
+          specialized<Arithmetic<MultiplyOp>, ValueType::INTEGER> ();
+          break;
+        case OpCode::MULTIPLY_FF:
+          specialized<Arithmetic<MultiplyOp>, ValueType::FLOAT> ();
+          break;
+        case OpCode::DIVIDE_II:
+          specialized<DivideKernel, ValueType::INTEGER> ();
+          break;
+        case OpCode::DIVIDE_FF:
+          specialized<DivideKernel, ValueType::FLOAT> ();
+          break;
+        case OpCode::EQUALS_II:
+          specialized<Equality<EqualsOp>, ValueType::INTEGER> ();
+          break;
+        case OpCode::EQUALS_FF:
+          specialized<Equality<EqualsOp>, ValueType::FLOAT> ();
+          break;
+        case OpCode::NOTEQUALS_II:
+          specialized<Equality<NotEqualsOp>, ValueType::INTEGER> ();
+          break;
+        case OpCode::NOTEQUALS_FF:
+          specialized<Equality<NotEqualsOp>, ValueType::FLOAT> ();
+          break;
+        case OpCode::LESSTHAN_II:
+          specialized<Ordering<LessThanOp>, ValueType::INTEGER> ();
+          break;
+        case OpCode::LESSTHAN_FF:
+          specialized<Ordering<LessThanOp>, ValueType::FLOAT> ();
+          break;
+        case OpCode::LESSTHANEQUAL_II:
+          specialized<Ordering<LessThanEqualOp>, ValueType::INTEGER> ();
+          break;
+        case OpCode::LESSTHANEQUAL_FF:
+          specialized<Ordering<LessThanEqualOp>, ValueType::FLOAT> ();
+          break;
+        case OpCode::GREATERTHAN_II:
+          specialized<Ordering<GreaterThanOp>, ValueType::INTEGER> ();
+          break;
+        case OpCode::GREATERTHAN_FF:
+          specialized<Ordering<GreaterThanOp>, ValueType::FLOAT> ();
+          break;
+        case OpCode::GREATERTHANEQUAL_II:
+          specialized<Ordering<GreaterThanEqualOp>, ValueType::INTEGER> ();
+          break;
+        case OpCode::GREATERTHANEQUAL_FF:
+          specialized<Ordering<GreaterThanEqualOp>, ValueType::FLOAT> ();
+          break;
+
+        case OpCode::FOR_ENTER:
+          {
+            Value bottomRight = pop ();
+            Value topLeft = pop ();
+            CellRange range = Operations::range (topLeft, bottomRight);
+            loops.push_back ({ range, range.top, range.left, instruction.arg,
+                               Value (), range.top, range.top });
+            if (batches.size () < loops.size ())
+              batches.emplace_back ();
+            break;
+          }
+        case OpCode::FOR_NEXT:
+          {
+            Loop &loop = loops.back ();
+            if (loop.row > loop.range.bottom)
+              {
+                pc = loop.exit;
+                break;
+              }
+            // Cells are read a batch of rows at a time. A batch stops short
+            // at the edge of the sheet, readCell throws for the cell past it.
+            std::vector<Value> &values = batches[loops.size () - 1];
+            if (loop.row == loop.batch_end && loop.col == loop.range.left)
+              {
+                loop.batch_top = loop.row;
+                loop.batch_end = Operations::readRows (runtime, loop.range,
+                                                       loop.row, values);
+              }
+            size_t width
+                = static_cast<size_t> (loop.range.right - loop.range.left)
+                  + 1;
+            size_t index = (loop.row - loop.batch_top) * width
+                           + (loop.col - loop.range.left);
+            context.frame.set (
+                instruction.arg,
+                index < values.size ()
+                    ? std::move (values[index])
+                    : Operations::readCell (runtime, loop.row, loop.col));
+            if (++loop.col > loop.range.right)
+              {
+                loop.col = loop.range.left;
+                loop.row++;
+              }
+            break;
+          }
+        case OpCode::FOR_CONTINUE:
+          loops.back ().ret = pop ();
+          pc = instruction.arg;
+          break;
+        case OpCode::FOR_EXIT:
+          stack.push_back (std::move (loops.back ().ret));
+          loops.pop_back ();
+          break;
+
+        default:
+          {
+            // Everything else is a binary operator
+            Value rightval = pop ();
+            Value &leftval = stack.back ();
+            switch (instruction.op)
+              {
+              case OpCode::ADD:
+                leftval = Operations::add (leftval, rightval);
+                break;
+              case OpCode::SUBTRACT:
+                leftval = Operations::subtract (leftval, rightval);
+                break;
+              case OpCode::MULTIPLY:
+                leftval = Operations::multiply (leftval, rightval);
+                break;
+              case OpCode::DIVIDE:
+                leftval = Operations::divide (leftval, rightval);
+                break;
+              case OpCode::MODULO:
+                leftval = Operations::modulo (leftval, rightval);
+                break;
+              case OpCode::EXPONENTIATE:
+                leftval = Operations::exponentiate (leftval, rightval);
+                break;
+              case OpCode::AND:
+                leftval = Operations::logicalAnd (leftval, rightval);
+                break;
+              case OpCode::OR:
+                leftval = Operations::logicalOr (leftval, rightval);
+                break;
+              case OpCode::BITAND:
+                leftval = Operations::bitAnd (leftval, rightval);
+                break;
+              case OpCode::BITOR:
+                leftval = Operations::bitOr (leftval, rightval);
+                break;
+              case OpCode::BITXOR:
+                leftval = Operations::bitXor (leftval, rightval);
+                break;
+              case OpCode::LEFTSHIFT:
+                leftval = Operations::leftShift (leftval, rightval);
+                break;
+              case OpCode::RIGHTSHIFT:
+                leftval = Operations::rightShift (leftval, rightval);
+                break;
+              case OpCode::EQUALS:
+                leftval = Operations::equals (leftval, rightval);
+                break;
+              case OpCode::NOTEQUALS:
+                leftval = Operations::notEquals (leftval, rightval);
+                break;
+              case OpCode::LESSTHAN:
+                leftval = Operations::lessThan (leftval, rightval);
+                break;
+              case OpCode::LESSTHANEQUAL:
+                leftval = Operations::lessThanEqual (leftval, rightval);
+                break;
+              case OpCode::GREATERTHAN:
+                leftval = Operations::greaterThan (leftval, rightval);
+                break;
+              case OpCode::GREATERTHANEQUAL:
+                leftval = Operations::greaterThanEqual (leftval, rightval);
+                break;
+              case OpCode::ADDRESS:
+                leftval = Operations::address (leftval, rightval);
+                break;
+              default:
+                throw std::runtime_error ("Unknown instruction");
+              }
+            break;
+          }
+        }
+    }
+
+  return pop ();
+}
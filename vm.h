@@ -0,0 +1,46 @@
+#ifndef vm_H
+#define vm_H
+
+#include "bytecode.h"
+#include "dependency.h"
+#include "forward_declarations.h"
+#include "value.h"
+#include <vector>
+
+/* VirtualMachine runs compiled Programs. Values are kept unboxed on an
+ * operand stack that is reused from one run to the next, so evaluating a
+ * formula doesn't allocate once the stack has grown to fit it.
+ */
+class VirtualMachine
+{
+private:
+  // A for loop that is running, cells are visited in row-major order
+  struct Loop
+  {
+    CellRange range;
+    int row;
+    int col;
+    int exit;
+    Value ret;
+    // The rows [batch_top, batch_end) have been read into batches
+    int batch_top;
+    int batch_end;
+  };
+
+  std::vector<Value> stack;
+  std::vector<Loop> loops;
+  // The cells each running loop has read ahead, by how deeply it is nested.
+  // Kept from one run to the next so they don't need to be allocated again.
+  std::vector<std::vector<Value> > batches;
+
+  Value pop ();
+  // Applies the kernel for two operands that are both of type T
+  template <typename Kernel, ValueType T> void specialized ();
+
+public:
+  // Returns what the program evaluates to, throws runtime_error like
+  // Expression::evaluateValue does.
+  Value run (const Program &program, EvalContext &context);
+};
+
+#endif